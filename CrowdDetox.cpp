@@ -1,7 +1,7 @@
-/*!
+/*! 
     @file       CrowdDetox.cpp
     @author     Jason Geffner (jason@crowdstrike.com)
-    @brief      CrowdDetox v1.0.2 Beta
+    @brief      CrowdDetox v1.1.0 Beta
    
     @details    The CrowdDetox plugin for Hex-Rays automatically removes junk
                 code and variables from Hex-Rays function decompilations.
@@ -19,8 +19,27 @@
 #pragma warning(push)
 #pragma warning(disable: 4800 4996)
 #include <hexrays.hpp>
+#include <expr.hpp>
+#include <funcs.hpp>
+#include <gdl.hpp>
+#include <netnode.hpp>
+#include <ua.hpp>
+#include <idp.hpp>
+#include <allins.hpp>
+#include <frame.hpp>
 #pragma warning(pop)
 
+#include <algorithm>
+#include <atomic>
+
+#ifdef __NT__
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
 #ifndef _countof
 #define _countof(array) (sizeof(array)/sizeof(array[0]))
 #endif
@@ -37,1098 +56,12769 @@ hexdsp_t* hexdsp = NULL;
 //
 bool g_fInitialized = false;
 
-/*! 
-    @brief Removes junk code and variables from the given function
+//
+// This global flag tracks whether GlobalIndexCallback() is hooked, which is
+// only the case once the database has a global variable index
+//
+bool g_fGlobalIndexHooked = false;
 
-    @param[in] pFunction The function from which to remove junk code and
-                         variables
-*/
-void
-Detox (
-    cfunc_t* pFunction
-    )
-{
-    lvars_t* pVariables;
+//
+// Name of the netnode in which per-function batch results are cached
+//
+#define CROWDDETOX_NETNODE "$ CrowdDetox"
 
-    //
-    // This structure is derived from ctree_visitor_t. It is used to find
-    // legitimate ctree_t items and legitimate variables.
-    //
-    struct ida_local FIND_LEGIT_ITEMS_VISITOR : public ctree_visitor_t
-    {
-        private:
+//
+// Name under which the batch entry point is exposed to IDC (and therefore to
+// IDAPython via idc.Eval)
+//
+#define CROWDDETOX_IDC_BATCH "CrowdDetoxBatch"
 
-        //
-        // This flag is used to ensure that afVariableIsLegit has been
-        // initialized
-        //
-        bool fInitialized;
+//
+// Values of the PLUGIN_run() argument. Pressing Shift-F5 passes 0; scripts
+// may call RunPlugin("hexrays_CrowdDetox", 1) to run a batch detox.
+//
+#define CROWDDETOX_RUN_INTERACTIVE 0
+#define CROWDDETOX_RUN_BATCH 1
+#define CROWDDETOX_RUN_COORDINATOR 2
+#define CROWDDETOX_RUN_WORKER 3
+#define CROWDDETOX_RUN_TRIAGE 4
 
-        //
-        // This variable keeps track of the function being decompiled
-        //
-        cfunc_t* pFunction;
+//
+// Name under which the multi-process batch entry point is exposed to IDC
+//
+#define CROWDDETOX_IDC_COORDINATE "CrowdDetoxCoordinate"
 
-        //
-        // This vector helps ensure we don't descend through items through
-        // which we've already descended
-        //
-        qvector<citem_t*> vectorDescendantsMarkedLegit;
+//
+// Name under which the triage entry point is exposed to IDC
+//
+#define CROWDDETOX_IDC_TRIAGE "CrowdDetoxTriage"
 
-        //
-        // This flag keeps track of the "mode" in which we're visiting ctree
-        // items. By default, this flag is false. However, the code sets it to
-        // true in order to mark all descendant ctree items and variables as
-        // legitimate. Hex-Rays is single-threaded, so there are no thread-
-        // safety issues.
-        //
-        bool fMarkingDescendantsLegit;
+//
+// The text-mode IDA executable that the coordinator launches as a worker
+// (relative to the IDA directory) unless overridden with the "ida" option
+//
+#ifdef __NT__
+#ifdef __EA64__
+#define CROWDDETOX_WORKER_EXECUTABLE "idaw64.exe"
+#else
+#define CROWDDETOX_WORKER_EXECUTABLE "idaw.exe"
+#endif
+#else
+#ifdef __EA64__
+#define CROWDDETOX_WORKER_EXECUTABLE "idal64"
+#else
+#define CROWDDETOX_WORKER_EXECUTABLE "idal"
+#endif
+#endif
 
-        /*! 
-            @brief Determine if the given function call is legitimate (as
-                   opposed to a trivial macro)
+//
+// Coordinator tuning: functions per shard, how often a worker may be
+// (re)launched, how often a shard may crash a worker before it is given up
+// on, and how often worker processes are polled
+//
+#define CROWDDETOX_DEFAULT_SHARD_SIZE 32
+#define CROWDDETOX_MAX_WORKER_LAUNCHES 8
+#define CROWDDETOX_MAX_SHARD_CRASHES 4
+#define CROWDDETOX_POLL_INTERVAL_MS 100
 
-            @param[in] pExpression The expression containing the function call
-            @return Returns true if the function call appears to be legitimate,
-                    returns false otherwise
-        */
-        bool
-        IsLegitimateCall (
-            cexpr_t* pExpression
-            )
-        {
-            cexpr_t* pCalledFunction;
-            char szFunctionName[1024];
+//
+// The coordinator closes a shard early once its estimated cost reaches
+// 1/CROWDDETOX_SHARDS_PER_WORKER of a worker's fair share, so that large
+// functions end up in small shards
+//
+#define CROWDDETOX_SHARDS_PER_WORKER 4
 
-            //
-            // These macros are from IDA's defs.h
-            //
-            char* aszNonLegitHelpers[] =
-            {
-                "__ROL__",
-                "__ROL1__",
-                "__ROL2__",
-                "__ROL4__",
-                "__ROL8__",
-                "__ROR1__",
-                "__ROR2__",
-                "__ROR4__",
-                "__ROR8__",
-                "LOBYTE",
-                "LOWORD",
-                "LODWORD",
-                "HIBYTE",
-                "HIWORD",
-                "HIDWORD",
-                "BYTEn",
-                "WORDn",
-                "BYTE1",
-                "BYTE2",
-                "BYTE3",
-                "BYTE4",
-                "BYTE5",
-                "BYTE6",
-                "BYTE7",
-                "BYTE8",
-                "BYTE9",
-                "BYTE10",
-                "BYTE11",
-                "BYTE12",
-                "BYTE13",
-                "BYTE14",
-                "BYTE15",
-                "WORD1",
-                "WORD2",
-                "WORD3",
-                "WORD4",
-                "WORD5",
-                "WORD6",
-                "WORD7",
-                "SLOBYTE",
-                "SLOWORD",
-                "SLODWORD",
-                "SHIBYTE",
-                "SHIWORD",
-                "SHIDWORD",
-                "SBYTEn",
-                "SWORDn",
-                "SBYTE1",
-                "SBYTE2",
-                "SBYTE3",
-                "SBYTE4",
-                "SBYTE5",
-                "SBYTE6",
-                "SBYTE7",
-                "SBYTE8",
-                "SBYTE9",
-                "SBYTE10",
-                "SBYTE11",
-                "SBYTE12",
-                "SBYTE13",
-                "SBYTE14",
-                "SBYTE15",
-                "SWORD1",
-                "SWORD2",
-                "SWORD3",
-                "SWORD4",
-                "SWORD5",
-                "SWORD6",
-                "SWORD7",
-                "__CFSHL__",
-                "__CFSHR__",
-                "__CFADD__",
-                "__CFSUB__",
-                "__OFADD__",
-                "__OFSUB__",
-                "__RCL__",
-                "__RCR__",
-                "__MKCRCL__",
-                "__MKCRCR__",
-                "__SETP__",
-                "__MKCSHL__",
-                "__MKCSHR__",
-                "__SETS__",
-                "__ROR__"
-            };
+//
+// Number of functions detoxed between two checkpoints of a batch run
+//
+#define CROWDDETOX_DEFAULT_CHECKPOINT_INTERVAL 64
 
-            //
-            // Ensure that the input expression is a call
-            //
-            if (pExpression->op != cot_call)
-            {
-                return false;
-            }
+//
+// Batch pipeline tuning: jobs that may be outstanding per analysis thread,
+// and the capacity of each thread's job and result queues (a power of two
+// no smaller than CROWDDETOX_JOBS_PER_THREAD + 1, which leaves room for the
+// NULL job that stops the thread)
+//
+#define CROWDDETOX_JOBS_PER_THREAD 2
+#define CROWDDETOX_THREAD_QUEUE_SIZE 4
 
-            //
-            // Get a pointer to the called function
-            //
-            pCalledFunction = pExpression->x;
+//
+// Default memory budget (in MB) for the decompiled functions queued in a
+// batch run's pipeline, and the estimated memory that Hex-Rays holds per
+// ctree item of a decompiled function (its ctree, types and microcode)
+//
+#define CROWDDETOX_DEFAULT_MEMORY_BUDGET_MB 512
+#define CROWDDETOX_BYTES_PER_CTREE_ITEM 512
 
-            //
-            // If the called function isn't a built-in "helper" (IDA macro),
-            // assume it's a call to a legitimate function
-            //
-            if (pCalledFunction->op != cot_helper)
-            {
-                return true;
-            }
+//
+// Default size (in KB) of the blocks of a DETOX_ARENA, and the alignment of
+// its allocations
+//
+#define CROWDDETOX_DEFAULT_ARENA_BLOCK_KB 256
+#define CROWDDETOX_ARENA_ALIGNMENT 16
 
-            //
-            // Get the name of the called "helper" function/macro
-            //
-            if (0 == pCalledFunction->print1(
-                szFunctionName,
-                _countof(szFunctionName) - 1,
-                NULL))
-            {
-                return false;
-            }
-            tag_remove(
-                szFunctionName,
-                szFunctionName,
-                _countof(szFunctionName) - 1);
+//
+// Formats of the batch export file
+//
+#define CROWDDETOX_EXPORT_NONE 0
+#define CROWDDETOX_EXPORT_JSONL 1
+#define CROWDDETOX_EXPORT_BINARY 2
 
-            //
-            // If the helper function is one of the macros from defs.h, it's
-            // not *necessarily* legitimate (though if one of the arguments to
-            // the function is legitimate, then the expression will get marked
-            // as legitimate anyway)
-            //
-            for (int i = 0; i < _countof(aszNonLegitHelpers); i++)
-            {
-                if (0 == strcmp(szFunctionName, aszNonLegitHelpers[i]))
-                {
-                    return false;
-                }
-            }
+//
+// Size of each of the export writer's two buffers
+//
+#define CROWDDETOX_EXPORT_BUFFER_SIZE (1024 * 1024)
 
-            //
-            // Otherwise, if the helper function is something like
-            // "__readfsdword", then it's probably legitimate
-            //
-            return true;
-        }
+//
+// Number of top-ranked functions that a triage run lists in the output
+// window
+//
+#define CROWDDETOX_TRIAGE_TOP_COUNT 10
 
-        /*!
-            @brief This function, called by Hex-Rays when the ctree visitor
-                   visits an expresison item, is a stub for visit_item()
+//
+// Maturity of the ctree at which the optional early Detox() pass runs:
+// right after Hex-Rays has generated it from the microcode, before any of
+// its ctree transformations
+//
+#define CROWDDETOX_EARLY_MATURITY CMAT_BUILT
 
-            @param[in] pExpression The visited expression item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        int
-        idaapi
-        visit_expr (
-            cexpr_t* pExpression
-            )
-        {
-            return visit_item(
-                pExpression);
-        }
+//
+// Names of the ctree maturities, as accepted by the "maturity" option
+//
+static const char* const g_aszMaturityNames[] =
+{
+    "zero",
+    "built",
+    "trans1",
+    "nice",
+    "trans2",
+    "cpa",
+    "trans3",
+    "casted",
+    "final"
+};
 
-        /*!
-            @brief This function, called by Hex-Rays when the ctree visitor
-                   visits a statement item, is a stub for visit_item()
+//
+// Flags of a TRIAGE_INSN
+//
+#define TRIAGE_INSN_SINK 0x01           // Stores, calls, compares, branches
+#define TRIAGE_INSN_HELPER 0x02         // Decompiles to a helper or macro
+#define TRIAGE_INSN_TRIVIAL_JUMP 0x04   // Jumps to the next instruction
+#define TRIAGE_INSN_READS_FRAME 0x08    // May read any stack slot (calls)
+#define TRIAGE_INSN_CALL 0x10           // Calls a function
 
-            @param[in] pExpression The visited statement item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        int
-        idaapi
-        visit_insn (
-            cinsn_t* pInstruction
-            )
-        {
-            return visit_item(
-                pInstruction);
-        }
+//
+// Kinds of a TRIAGE_SLOT_REF
+//
+#define TRIAGE_SLOT_NONE 0              // Slot is not tracked
+#define TRIAGE_SLOT_USE 1               // Slot is read
+#define TRIAGE_SLOT_DEF 2               // Slot is overwritten completely
+#define TRIAGE_SLOT_PARTIAL_DEF 3       // Slot is overwritten in part
+#define TRIAGE_SLOT_ESCAPE 4            // Slot's address is taken
 
-        /*! 
-            @brief This function determines if a ctree item is legitimate; it
-                   marks variables legitimate via the afVariableIsLegit array
-                   and saves legitimate items in the vectorLegitItems vector
+//
+// Size in bytes of the stack slots tracked by the triage pass
+//
+#define TRIAGE_SLOT_SIZE 4
 
-            @param[in] pItem The visited ctree item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        int
-        visit_item (
-            citem_t* pItem
-            )
-        {
-            cexpr_t* pExpression;
-            char szType[16];
+//
+// Registers of the x86 processor module that the triage pass handles
+// specially (see MapTriageRegister())
+//
+#define TRIAGE_X86_AX 0
+#define TRIAGE_X86_CX 1
+#define TRIAGE_X86_DX 2
+#define TRIAGE_X86_SP 4
+#define TRIAGE_X86_BP 5
+#define TRIAGE_X86_SI 6
+#define TRIAGE_X86_DI 7
+#define TRIAGE_X86_R8 8
+#define TRIAGE_X86_R9 9
+#define TRIAGE_X86_AL 16
+#define TRIAGE_X86_AH 20
+#define TRIAGE_X86_SPL 24
+#define TRIAGE_X86_DIL 27
 
-            //
-            // Ensure that we're initialized
-            //
-            if (!fInitialized)
-            {
-                if (!Initialize())
-                {
-                    return 1;
-                }
-            }
+//
+// Operations of a PREDICATE_PROGRAM
+//
+#define PREDICATE_OP_CONST 0            // Pushes qwValue
+#define PREDICATE_OP_ATOM 1             // Pushes atom bAtom
+#define PREDICATE_OP_ADD 2
+#define PREDICATE_OP_SUB 3
+#define PREDICATE_OP_MUL 4
+#define PREDICATE_OP_AND 5
+#define PREDICATE_OP_OR 6
+#define PREDICATE_OP_XOR 7
+#define PREDICATE_OP_NEG 8
+#define PREDICATE_OP_NOT 9
+#define PREDICATE_OP_SHL 10             // Shifts left by qwValue
+#define PREDICATE_OP_MOD 11             // Remainder of a division by
+                                        // 2^qwValue
 
-            //
-            // If we're traversing the graph solely to mark descendants as
-            // legitimate...
-            //
-            if (fMarkingDescendantsLegit)
-            {
-                //
-                // Don't descend through items through which we've already
-                //   descended
-                //
-                if (vectorDescendantsMarkedLegit.has(pItem))
-                {
-                    return 0;
-                }
+//
+// Limits of the opaque predicate evaluator: operations per condition,
+// distinct atoms per condition, low bits of the atoms enumerated, bits of
+// all atoms enumerated together (2^12 evaluations), and conditions memoized
+// per thread
+//
+#define CROWDDETOX_PREDICATE_MAX_OPS 64
+#define CROWDDETOX_PREDICATE_MAX_ATOMS 4
+#define CROWDDETOX_PREDICATE_MAX_BITS 4
+#define CROWDDETOX_PREDICATE_MAX_INPUT_BITS 12
+#define CROWDDETOX_PREDICATE_MEMO_SIZE 4096
 
-                //
-                // If this is a variable, mark the variable legitimate
-                //
-                if (pItem->op == cot_var)
-                {
-                    afVariableIsLegit[((cexpr_t*)pItem)->v.idx] = true;
-                }
+//
+// Node index used by MBA_NODE for "no node", and the largest number of
+// nodes that an expression may add to the MBA simplifier's DAG
+//
+#define MBA_NONE 0xFFFFFFFF
+#define CROWDDETOX_MBA_MAX_NODES 4096
 
-                //
-                // Mark the item itself legitimate
-                //
-                if (!vectorLegitItems.has(pItem))
-                {
-                    vectorLegitItems.push_back(
-                        pItem);
-                    fNewLegitItemFound = true;
-                }
+//
+// Index used by the junk signature structures for "none", and the number
+// of item types (ctype_t values) that the signature automaton handles
+//
+#define SIGNATURE_NONE 0xFFFFFFFF
+#define CROWDDETOX_SIGNATURE_ALPHABET 128
 
-                //
-                // Remember that we've now descended through this item
-                //
-                vectorDescendantsMarkedLegit.push_back(
-                    pItem);
+//
+// Class index used by ClassifyMirrorItems() for "none", and the largest
+// number of variables whose set an ITEM_CLASS records
+//
+#define ITEM_CLASS_NONE 0xFFFFFFFF
+#define CROWDDETOX_CLASS_MAX_VARIABLES 16
 
-                //
-                // Continue marking other descendant items as legitimate
-                //
-                return 0;
-            }
+//
+// ITEM_CLASS flags
+//
+#define ITEM_CLASS_SINK 0x01            // Contains a goto, break, continue,
+                                        // return, global or CPPEH_RECORD
+#define ITEM_CLASS_LEGIT_CALL 0x02      // Contains a legitimate call
+#define ITEM_CLASS_MANY_VARIABLES 0x04  // Reads too many variables to track
 
-            //
-            // If this item was already marked as legititmate...
-            //
-            if (vectorLegitItems.has(pItem))
-            {
-                //
-                // If we have a legitimate item that's an if/for/while/do/
-                // return statement then mark the expression part of that node
-                // (for example, the "x" in "if(x)") as legitimate as well
-                //
-                pExpression = NULL;
-                switch (pItem->op)
-                {
-                case cit_if:
-                    pExpression = &((cinsn_t*)pItem)->cif->expr; break;
-                case cit_for:
-                    pExpression = &((cinsn_t*)pItem)->cfor->expr; break;
-                case cit_while:
-                    pExpression = &((cinsn_t*)pItem)->cwhile->expr; break;
-                case cit_do:
-                    pExpression = &((cinsn_t*)pItem)->cdo->expr; break;
-                case cit_return:
-                    pExpression = &((cinsn_t*)pItem)->creturn->expr; break;
-                default:
-                    break;
-                }
-                if (pExpression == NULL)
-                {
-                    return 0;
-                }
+//
+// Side-effect summary flags, as computed by SummarizeSideEffects(); a
+// function without any of them is pure. Summaries are cached in the
+// CROWDDETOX_NETNODE netnode under CROWDDETOX_SUMMARY_TAG, or'ed with
+// SUMMARY_COMPUTED so that a missing summary reads as 0.
+//
+#define SUMMARY_WRITES_GLOBAL 0x01      // Writes to a global variable
+#define SUMMARY_WRITES_POINTER 0x02     // Writes through a pointer
+#define SUMMARY_CALLS_IMPORT 0x04       // Calls an imported function
+#define SUMMARY_UNKNOWN 0x08            // Does something that isn't tracked
+#define SUMMARY_COMPUTED 0x80
+#define CROWDDETOX_SUMMARY_TAG 'P'
 
-                //
-                // If the expression hasn't already been marked as legitimate
-                // then mark it so and mark all of its descendants as
-                // legitimate as well
-                //
-                if (!vectorDescendantsMarkedLegit.has(pExpression))
-                {
-                    //
-                    // Mark all items under this expression/call as legitimate
-                    //
-                    fMarkingDescendantsLegit = true;
-                    apply_to(
-                        pExpression,
-                        NULL);
-                    fMarkingDescendantsLegit = false;
+//
+// Global variable index flags, as computed by IndexGlobalVariable(). Each
+// global's entry is cached in the CROWDDETOX_NETNODE netnode under
+// CROWDDETOX_GLOBAL_TAG, keyed by its item head, with the size of its item
+// in the bits above GLOBAL_SIZE_SHIFT. CROWDDETOX_GLOBAL_INDEX_KEY is set
+// once BuildGlobalIndex() has indexed the whole database.
+//
+#define GLOBAL_INDEXED 0x01
+#define GLOBAL_READ 0x02                // Read, or its address is taken
+#define GLOBAL_WRITTEN 0x04
+#define GLOBAL_STALE 0x08               // One of its references was deleted
+#define GLOBAL_SIZE_SHIFT 8
+#define CROWDDETOX_GLOBAL_TAG 'G'
+#define CROWDDETOX_GLOBAL_INDEX_KEY "global_index"
 
-                    //
-                    // cit_for statements require us to also process the
-                    // for-loop initialization and step expressions
-                    //
-                    if (pItem->op == cit_for)
-                    {
-                        //
-                        // Process the for-loop's initialization expression
-                        //
-                        pExpression = &((cinsn_t*)pItem)->cfor->init;
-                        if (!vectorDescendantsMarkedLegit.has(pExpression))
-                        {
-                            //
-                            // Mark all items under this expression as legit
-                            //
-                            fMarkingDescendantsLegit = true;
-                            apply_to(
-                                pExpression,
-                                NULL);
-                            fMarkingDescendantsLegit = false;
-                        }
+//
+// Return value index flags, as computed by BuildReturnIndex() and stored in
+// the CROWDDETOX_NETNODE netnode under CROWDDETOX_RETURN_TAG
+//
+#define RETURN_INDEXED 0x01
+#define RETURN_USED 0x02                // Some caller uses the return value
+#define CROWDDETOX_RETURN_TAG 'R'
 
-                        //
-                        // Process the for-loop's step expression
-                        //
-                        pExpression = &((cinsn_t*)pItem)->cfor->step;
-                        if (!vectorDescendantsMarkedLegit.has(pExpression))
-                        {
-                            //
-                            // Mark all items under this expression as legit
-                            //
-                            fMarkingDescendantsLegit = true;
-                            apply_to(
-                                pExpression,
-                                NULL);
-                            fMarkingDescendantsLegit = false;
-                        }
-                    }
-                }
+//
+// Parameter index entries, as recorded by RecordUsedParameters() in the
+// CROWDDETOX_NETNODE netnode under CROWDDETOX_PARAMETER_TAG: bit i is set if
+// parameter i is used, the number of parameters is stored above
+// PARAMETERS_COUNT_SHIFT. Parameters are only recorded and used in runs
+// with the "params" option.
+//
+#define PARAMETERS_INDEXED 0x80000000
+#define PARAMETERS_COUNT_SHIFT 24
+#define CROWDDETOX_MAX_TRACKED_PARAMETERS 24
+#define CROWDDETOX_PARAMETER_TAG 'U'
 
-                return 0;
-            }
+//
+// SIGNATURE_TOKEN flags
+//
+#define SIGNATURE_TOKEN_JUNK 0x01       // Statement is removed on a match
 
-            //
-            // If this item is a legitimate variable and/or a CPPEH_RECORD
-            // variable, or a function, global variable, legit macro, goto,
-            // break, continue, return, or asm-statement then mark the ancestor
-            // expressions as legitimate
-            //
-            if (pItem->op == cot_var)
-            {
-                if (!afVariableIsLegit[((cexpr_t*)pItem)->v.idx])
-                {
-                    if (T_NORMAL != print_type_to_one_line(
-                        szType,
-                        _countof(szType),
-                        idati,
-                        ((cexpr_t*)pItem)->type.u_str()))
-                    {
-                        return 0;
-                    }
-                    if (0 != strcmp(szType, "CPPEH_RECORD"))
-                    {
-                        return 0;
-                    }
-                }
-            }
-            else if (!((pItem->op == cot_obj) ||
-                ((pItem->op == cot_call) &&
-                    IsLegitimateCall((cexpr_t*)pItem)) ||
-                (pItem->op == cit_goto) ||
-                (pItem->op == cit_break) ||
-                (pItem->op == cit_continue) ||
-                (pItem->op == cit_return)) ||
-                (pItem->op == cit_asm))
-            {
-                return 0;
-            }
+//
+// How a SIGNATURE_TOKEN's argument is matched
+//
+#define SIGNATURE_MATCH_ANY 0           // Item type only
+#define SIGNATURE_MATCH_BINDING 1       // Same variable or value as others
+#define SIGNATURE_MATCH_VALUE 2         // Constant equals qwValue
+#define SIGNATURE_MATCH_HELPER 3        // Helper is named nHelper
 
-            //
-            // Iterate through all ancestors (assumes that the decompilation
-            // graph is a tree and that no item has more than one parent)
-            //
-            for(citem_t* pCurrentItem = pItem;
-                pCurrentItem != NULL;
-                pCurrentItem = pFunction->body.find_parent_of(pCurrentItem))
-            {
-                if (!vectorLegitItems.has(pCurrentItem))
-                {
-                    vectorLegitItems.push_back(
-                        pCurrentItem);
-                    fNewLegitItemFound = true;
-                }
+//
+// This structure receives statistics about a single Detox() run
+//
+struct DETOX_STATS
+{
+    //
+    // Number of ctree items before and after junk removal
+    //
+    uint32 nItemsBefore;
+    uint32 nItemsAfter;
 
-                if ((pCurrentItem->op == cit_expr) ||
-                    ((pCurrentItem->op == cot_call) &&
-                        IsLegitimateCall((cexpr_t*)pCurrentItem)) ||
-                    (pCurrentItem->op == cit_return))
-                {
-                    //
-                    // This is a cit_expr statement node or cot_call
-                    // expression
-                    //
+    //
+    // Number of local variables whose CVAR_USED flag was cleared
+    //
+    uint32 nVariablesCleared;
 
-                    if (!vectorDescendantsMarkedLegit.has(pCurrentItem))
-                    {
-                        //
-                        // Mark all items under this expression/call as legit
-                        //
-                        fMarkingDescendantsLegit = true;
-                        apply_to(
-                            pCurrentItem,
-                            NULL);
-                        fMarkingDescendantsLegit = false;
-                    }
-                }
-            }
+    //
+    // Number of junk statements cleaned up, goto labels moved off of them,
+    // and gotos turned into returns because their label had nowhere to go
+    //
+    uint32 nStatementsPruned;
+    uint32 nLabelsRelocated;
+    uint32 nGotosConverted;
 
-            return 0;
-        }
+    //
+    // Number of rounds the legitimacy analysis took to converge
+    //
+    uint32 nRounds;
 
+    //
+    // Number of ifs and whiles removed or replaced by one of their arms
+    // because their conditions are constant
+    //
+    uint32 nPredicatesFolded;
 
-        public:
+    //
+    // Number of mixed boolean-arithmetic expressions rewritten into
+    // simpler ones
+    //
+    uint32 nExpressionsSimplified;
 
-        //
-        // This flag keeps track of whether or not new legitimate ctree items
-        // were found during the ctree traversal
-        //
-        bool fNewLegitItemFound;
+    //
+    // Number of junk signature occurrences whose statements were removed
+    // without going through the legitimacy analysis
+    //
+    uint32 nSignatureMatches;
 
-        //
-        // This vector is a list of all legitimate ctree items
-        //
-        qvector<citem_t*> vectorLegitItems;
+    //
+    // Arena memory used by AnalyzeMirror() and ApplyDetoxEdits(), in bytes
+    //
+    size_t cbAnalyzeArena;
+    size_t cbApplyArena;
+};
 
-        //
-        // This flag array (indexed to match the order of indeces in the
-        // function's lvars_t vector) keeps track of whether each variable is
-        // legitimate or not
-        //
-        bool* afVariableIsLegit;
+//
+// Ordinal used by MIRROR_ITEM for "no item"
+//
+#define MIRROR_NONE 0xFFFFFFFF
 
-        /*! 
-            @brief Allocate and initialize the afVariableIsLegit array
+//
+// MIRROR_ITEM flags
+//
+#define MIRROR_ITEM_LEGIT_CALL 0x01     // cot_call to a legitimate function
+#define MIRROR_ITEM_JUNK 0x02           // Statement matched a junk signature
+#define MIRROR_ITEM_NOT_SINK 0x04       // cot_obj that isn't legitimate by
+                                        // itself (callee of a pure call,
+                                        // or a global that is never read)
+#define MIRROR_ITEM_UNUSED 0x08         // Argument that the called function
+                                        // doesn't use, or returned value
+                                        // that no caller uses
 
-            @param[in] pItem The visited ctree item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        bool
-        Initialize (
-            void
-            )
-        {
-            lvars_t* pVariables;
+//
+// Properties of ctree item types, looked up in g_abItemOpProperties by the
+// legitimacy analysis and the pruning visitor
+//
+#define ITEM_OP_SINK 0x01               // Legitimate by itself (cot_obj
+                                        // unless MIRROR_ITEM_NOT_SINK)
+#define ITEM_OP_CLOSURE 0x02            // Legitimate item makes all of its
+                                        // descendants legitimate
+#define ITEM_OP_CONTROL_EXPRS 0x04      // Legitimate statement makes its
+                                        // expression slots legitimate
+#define ITEM_OP_PRUNE_BARRIER 0x08      // Neither it nor its descendants are
+                                        // ever cleaned up
+#define ITEM_OP_EMPTY 0x10              // Erased from blocks
 
-            //
-            // Allocate the afVariableIsLegit array
-            //
-            pVariables = pFunction->get_lvars();
-            afVariableIsLegit = (bool*)malloc(
-                pVariables->size());
-            if (afVariableIsLegit == NULL)
-            {
-                msg(
-                    "CrowdDetox error: Cannot allocate %d bytes.\n",
-                    pVariables->size() * sizeof(bool));
-                return false;
-            }
+//
+// Number of item types (ctype_t values) in g_abItemOpProperties
+//
+#define CROWDDETOX_ITEM_OP_COUNT 128
 
-            //
-            // Initialize the afVariableIsLegit array based on function
-            // arguments
-            //
-            for (size_t i = 0; i < pVariables->size(); i++)
-            {
-                afVariableIsLegit[i] = pVariables->at(i).is_arg_var();
-            }
+//
+// DETOX_MIRROR variable flags
+//
+#define MIRROR_VARIABLE_ARGUMENT 0x01       // Variable is a function argument
+#define MIRROR_VARIABLE_CPPEH 0x02          // Variable is a CPPEH_RECORD
+#define MIRROR_VARIABLE_TYPE_CHECKED 0x04   // MIRROR_VARIABLE_CPPEH is valid
 
-            fInitialized = true;
+//
+// This structure is a pointer-free copy of one ctree item. A function's
+// items are stored in the order in which ctree_visitor_t visits them, so an
+// item's ordinal is its index in that order and the item's descendants are
+// exactly the items with ordinals in [ordinal + 1, nEnd).
+//
+struct MIRROR_ITEM
+{
+    //
+    // The item's ctype_t
+    //
+    uint8 bOp;
 
-            return true;
-        }
+    //
+    // MIRROR_ITEM_* flags
+    //
+    uint8 bFlags;
 
-        //
-        // FIND_LEGIT_ITEMS_VISITOR constructor
-        //
-        FIND_LEGIT_ITEMS_VISITOR(cfunc_t* _pFunction):
-            ctree_visitor_t(CV_PARENTS),
-            fInitialized(false),
-            pFunction(_pFunction),
-            afVariableIsLegit(NULL),
-            fNewLegitItemFound(false),
-            fMarkingDescendantsLegit(false)
-        {
-            //
-            // Do nothing
-            //
-        }
+    uint16 wReserved;
 
-        //
-        // FIND_LEGIT_ITEMS_VISITOR destructor
-        //
-        ~FIND_LEGIT_ITEMS_VISITOR()
-        {
-            //
-            // Free the afVariableIsLegit array
-            //
-            if (afVariableIsLegit != NULL)
-            {
-                free(
-                    afVariableIsLegit);
-                afVariableIsLegit = NULL;
-            }
-        }
-    };
+    //
+    // Ordinal of the item's parent, or MIRROR_NONE for the function body
+    //
+    uint32 nParent;
 
     //
-    // Keep traversing the function's ctree until no new legitimate items are
-    // found
+    // Ordinal one past the item's last descendant
     //
-    FIND_LEGIT_ITEMS_VISITOR fliv(pFunction);
-    do
-    {
-        fliv.fNewLegitItemFound = false;
-        fliv.apply_to(
-            &pFunction->body,
-            NULL);
-    } while (fliv.fNewLegitItemFound);
+    uint32 nEnd;
 
+    //
+    // Local variable index for cot_var items, -1 otherwise
+    //
+    int32 nVariable;
+};
 
+//
+// This structure is a flattened copy ("mirror") of a function's ctree. It
+// is built by FlattenFunction() on the thread that owns the decompilation,
+// after which AnalyzeMirror() may run on any thread.
+//
+struct DETOX_MIRROR
+{
     //
-    // This structure is derived from ctree_visitor_t. It is used to prune
-    // junk ctree_t items from the decompilation graph.
+    // The function's items, indexed by ordinal
     //
-    struct ida_local PRUNE_ITEMS_VISITOR : public ctree_visitor_t
-    {
-        private:
+    qvector<MIRROR_ITEM> items;
 
-        //
-        // This vector is a list of all previously-found legitimate ctree items
-        //
-        qvector<citem_t*>* pVectorLegitItems;
+    //
+    // The ctree item behind each ordinal; only dereferenced by the thread
+    // that owns the decompilation
+    //
+    qvector<citem_t*> itemPointers;
 
-        //
-        // This variable keeps track of the function being decompiled
-        //
-        cfunc_t* pFunction;
+    //
+    // MIRROR_VARIABLE_* flags, indexed like the function's lvars_t vector
+    //
+    qvector<uint8> variableFlags;
 
-        //
-        // The modes in which the decompilation tree will be traversed
-        //
-        enum VisitingMode
-        {
-            Pruning,
-            CleaningUpGotoLabels,
-            ChangingGotos,
-            FindingChildrenOfParent
-        };
-        VisitingMode visitingMode;
+    //
+    // Number of conditions that FoldOpaquePredicates() folded, and number
+    // of ctree items before it did
+    //
+    uint32 nPredicatesFolded;
+    uint32 nItemsBeforeFolding;
 
-        //
-        // Used in FindingChildrenOfParent visiting mode. Parent currently
-        // being analyzed.
-        //
-        citem_t* pCurrentParent;
+    //
+    // Number of expressions that SimplifyMbaExpressions() rewrote
+    //
+    uint32 nExpressionsSimplified;
 
-        //
-        // Used in FindingChildrenOfParent visiting mode. This vector tracks
-        // children of the currently analyzed parent block.
-        //
-        qvector<citem_t*> vectorChildrenOfParentBlock;
+    //
+    // Number of junk signature occurrences that MatchJunkSignatures() found
+    //
+    uint32 nSignatureMatches;
+};
 
-        //
-        // Used in ChangingGotos visiting mode. Stores original goto
-        // destination label number.
-        //
-        int nOldLabelNumber;
+//
+// This structure is the result of AnalyzeMirror(): the edit list that
+// ApplyDetoxEdits() applies to the ctree
+//
+struct DETOX_EDITS
+{
+    //
+    // Bit vector indexed by ordinal: is the item legitimate
+    //
+    qvector<uint64> itemIsLegit;
 
-        //
-        // Used in ChangingGotos visiting mode. Stores new goto destination
-        // label number. If -1, change gotos to return.
-        //
-        int nNewLabelNumber;
+    //
+    // Per-variable flag: is the variable legitimate
+    //
+    qvector<uint8> variableIsLegit;
 
-        //
-        // If this item and all of its descendants contain no goto-labels,
-        // this is false (no cleaning up done). If a goto label was cleaned up,
-        // this is true.
-        bool fGotoCleaned;
+    //
+    // Number of rounds the analysis took to converge
+    //
+    uint32 nRounds;
 
-        /*!
-            @brief This function, called by Hex-Rays when the ctree visitor
-                   visits an expresison item, is a stub for visit_item()
+    //
+    // Arena memory the analysis used, in bytes
+    //
+    size_t cbArenaUsed;
+};
 
-            @param[in] pExpression The visited expression item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        int
-        idaapi
-        visit_expr (
-            cexpr_t* pExpression
-            )
-        {
-            return visit_item(
-                pExpression);
-        }
+//
+// This structure is one operation of a PREDICATE_PROGRAM
+//
+struct PREDICATE_OP
+{
+    //
+    // PREDICATE_OP_* operation
+    //
+    uint8 bOp;
 
-        /*!
-            @brief This function, called by Hex-Rays when the ctree visitor
-                   visits a statement item, is a stub for visit_item()
+    //
+    // Atom index for PREDICATE_OP_ATOM
+    //
+    uint8 bAtom;
 
-            @param[in] pExpression The visited statement item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        int
-        idaapi
-        visit_insn (
-            cinsn_t* pInstruction
-            )
-        {
-            return visit_item(
-                pInstruction);
-        }
+    uint16 wReserved;
+    uint32 dwReserved;
 
-        /*! 
-            @brief This function prunes junk items from the decompilation graph
+    //
+    // Operand for PREDICATE_OP_CONST, PREDICATE_OP_SHL and PREDICATE_OP_MOD
+    //
+    uint64 qwValue;
+};
 
-            @param[in] pItem The visited ctree item
-            @return Returns 0 to continue the traversal, returns 1 to stop
-                    the traversal
-        */
-        int
-        visit_item (
-            citem_t* pItem
-            )
-        {
-            cblock_t* pBlock;
-            citem_t* pParent;
-            citem_t* pNewDestination;
+//
+// This structure is a condition compiled by CompilePredicate(): a postfix
+// program that computes an integer from the condition's atoms, and tells
+// how the integer's being nonzero relates to the condition
+//
+struct PREDICATE_PROGRAM
+{
+    qvector<PREDICATE_OP> ops;
 
-            //
+    //
+    // Number of distinct atoms the program reads
+    //
+    uint32 nAtoms;
+
+    //
+    // Number of low bits of the computed integer that the atoms' low bits
+    // determine (lowered by PREDICATE_OP_MOD)
+    //
+    uint32 nMaxBits;
+
+    //
+    // Is the condition true when the computed integer is zero
+    //
+    bool fNegate;
+
+    //
+    // If nonzero, the computed integer has no bits outside of this mask
+    //
+    uint64 qwExactMask;
+};
+
+//
+// This structure is an entry of DETOX_SCRATCH::predicateMemo
+//
+struct PREDICATE_MEMO_ENTRY
+{
+    //
+    // HashPredicate() of the program
+    //
+    uint64 qwHash;
+
+    //
+    // The program's operations in DETOX_SCRATCH::predicateMemoOps
+    //
+    uint32 nFirstOp;
+    uint32 nOps;
+
+    //
+    // The rest of the program
+    //
+    bool fNegate;
+    uint64 qwExactMask;
+
+    //
+    // EvaluatePredicate() of the program
+    //
+    int nResult;
+};
+
+//
+// This structure is a node of the MBA simplifier's expression DAG. Equal
+// subexpressions are hash-consed into a single node.
+//
+struct MBA_NODE
+{
+    //
+    // PREDICATE_OP_* operation; PREDICATE_OP_ATOM nodes are leaves
+    //
+    uint8 bOp;
+
+    //
+    // Operand nodes, or MBA_NONE
+    //
+    uint32 nLeft;
+    uint32 nRight;
+
+    //
+    // Memoized result of SimplifyMbaNode(), or MBA_NONE
+    //
+    uint32 nSimplified;
+
+    //
+    // Constant for PREDICATE_OP_CONST, leaf index for PREDICATE_OP_ATOM
+    //
+    uint64 qwValue;
+
+    //
+    // Hash of the fields above that identify the node
+    //
+    uint64 qwHash;
+};
+
+//
+// This structure is a rewrite rule of the MBA simplifier. Patterns and
+// replacements are written in prefix notation: '+', '-', '*', '&', '|',
+// '^' are binary operations, '~' and 'n' are bitwise NOT and negation,
+// 'x' and 'y' are variables that match any subexpression, and '0', '1',
+// '2' and 'm' (all ones) are constants.
+//
+struct MBA_RULE
+{
+    const char* szPattern;
+    const char* szReplacement;
+};
+
+//
+// The MBA simplifier's rules, tried in order; every replacement is smaller
+// than its pattern
+//
+static const MBA_RULE g_aMbaRules[] =
+{
+    { "+^xy*2&xy", "+xy" },     // (x ^ y) + 2 * (x & y) == x + y
+    { "-*2|xy^xy", "+xy" },     // 2 * (x | y) - (x ^ y) == x + y
+    { "+|xy&xy", "+xy" },       // (x | y) + (x & y) == x + y
+    { "--x~y1", "+xy" },        // x - ~y - 1 == x + y
+    { "-+xy*2&xy", "^xy" },     // x + y - 2 * (x & y) == x ^ y
+    { "-|xy&xy", "^xy" },       // (x | y) - (x & y) == x ^ y
+    { "&|xy~&xy", "^xy" },      // (x | y) & ~(x & y) == x ^ y
+    { "^|xy&xy", "^xy" },       // (x | y) ^ (x & y) == x ^ y
+    { "|&x~y&~xy", "^xy" },     // (x & ~y) | (~x & y) == x ^ y
+    { "-+xy&xy", "|xy" },       // x + y - (x & y) == x | y
+    { "+&x~yy", "|xy" },        // (x & ~y) + y == x | y
+    { "|&xy^xy", "|xy" },       // (x & y) | (x ^ y) == x | y
+    { "-+xy|xy", "&xy" },       // x + y - (x | y) == x & y
+    { "+~x1", "nx" },           // ~x + 1 == -x
+    { "+xny", "-xy" },
+    { "-xny", "+xy" },
+    { "~~x", "x" },
+    { "nnx", "x" },
+    { "-xx", "0" },
+    { "^xx", "0" },
+    { "&xx", "x" },
+    { "|xx", "x" },
+    { "+x~x", "m" },
+    { "&x~x", "0" },
+    { "|x~x", "m" },
+    { "^x~x", "m" },
+    { "+x0", "x" },
+    { "-x0", "x" },
+    { "*x1", "x" },
+    { "*x0", "0" },
+    { "&x0", "0" },
+    { "&xm", "x" },
+    { "|x0", "x" },
+    { "|xm", "m" },
+    { "^x0", "x" },
+    { "^xm", "~x" }
+};
+
+//
+// This structure is one token of a JUNK_SIGNATURE; it matches one ctree
+// item
+//
+struct SIGNATURE_TOKEN
+{
+    //
+    // The item's ctype_t
+    //
+    uint8 bOp;
+
+    //
+    // SIGNATURE_TOKEN_* flags
+    //
+    uint8 bFlags;
+
+    //
+    // SIGNATURE_MATCH_* kind of argument
+    //
+    uint8 bMatch;
+
+    uint8 bReserved;
+
+    //
+    // Index in SIGNATURE_SET::helperNames for SIGNATURE_MATCH_HELPER
+    //
+    uint32 nHelper;
+
+    //
+    // Binding index (0 for 'a') for SIGNATURE_MATCH_BINDING, constant for
+    // SIGNATURE_MATCH_VALUE
+    //
+    uint64 qwValue;
+};
+
+//
+// This structure is a junk signature: a run of SIGNATURE_TOKENs that
+// matches whole statements
+//
+struct JUNK_SIGNATURE
+{
+    uint32 nFirstToken;
+    uint32 nTokens;
+
+    //
+    // Next signature that ends in the same automaton state, or
+    // SIGNATURE_NONE
+    //
+    uint32 nNext;
+};
+
+//
+// This structure holds a set of junk signatures and the Aho-Corasick
+// automaton built from their item types
+//
+struct SIGNATURE_SET
+{
+    qvector<SIGNATURE_TOKEN> tokens;
+    qvector<JUNK_SIGNATURE> signatures;
+    qvector<qstring> helperNames;
+
+    //
+    // Complete transition table: the state reached from state s on item
+    // type c is transitions[s * CROWDDETOX_SIGNATURE_ALPHABET + c]
+    //
+    qvector<uint32> transitions;
+
+    //
+    // Per state: first signature that ends in the state, and the nearest
+    // state on the failure chain that has outputs (or SIGNATURE_NONE)
+    //
+    qvector<uint32> outputs;
+    qvector<uint32> outputLinks;
+};
+
+//
+// The junk signatures used by MatchJunkSignatures(); loaded by
+// LoadJunkSignatures() on the main thread
+//
+static SIGNATURE_SET g_junkSignatures;
+
+//
+// This structure maps a signature token name to a ctree item type
+//
+struct SIGNATURE_TOKEN_NAME
+{
+    const char* szName;
+    ctype_t op;
+};
+
+//
+// Item type names accepted in junk signatures
+//
+static const SIGNATURE_TOKEN_NAME g_aSignatureTokenNames[] =
+{
+    { "empty", cit_empty },
+    { "block", cit_block },
+    { "expr", cit_expr },
+    { "if", cit_if },
+    { "goto", cit_goto },
+    { "return", cit_return },
+    { "comma", cot_comma },
+    { "asg", cot_asg },
+    { "asgbor", cot_asgbor },
+    { "asgxor", cot_asgxor },
+    { "asgband", cot_asgband },
+    { "asgadd", cot_asgadd },
+    { "asgsub", cot_asgsub },
+    { "asgmul", cot_asgmul },
+    { "asgshl", cot_asgshl },
+    { "bor", cot_bor },
+    { "xor", cot_xor },
+    { "band", cot_band },
+    { "eq", cot_eq },
+    { "ne", cot_ne },
+    { "sshr", cot_sshr },
+    { "ushr", cot_ushr },
+    { "shl", cot_shl },
+    { "add", cot_add },
+    { "sub", cot_sub },
+    { "mul", cot_mul },
+    { "neg", cot_neg },
+    { "cast", cot_cast },
+    { "lnot", cot_lnot },
+    { "bnot", cot_bnot },
+    { "ptr", cot_ptr },
+    { "ref", cot_ref },
+    { "postinc", cot_postinc },
+    { "postdec", cot_postdec },
+    { "preinc", cot_preinc },
+    { "predec", cot_predec },
+    { "call", cot_call },
+    { "idx", cot_idx },
+    { "memref", cot_memref },
+    { "memptr", cot_memptr },
+    { "num", cot_num },
+    { "obj", cot_obj },
+    { "var", cot_var },
+    { "helper", cot_helper }
+};
+
+//
+// Built-in junk signatures (see ParseJunkSignature() for the syntax)
+//
+static const char* const g_aszDefaultJunkSignatures[] =
+{
+    //
+    // a = a; (a push/pop pair of the same register)
+    //
+    "expr asg var:a var:a",
+
+    //
+    // a = b; b = a; (a push/pop pair turned into copies both ways)
+    //
+    "expr asg var:a var:b !expr asg var:b var:a",
+
+    //
+    // a += 0; a -= 0; a |= 0; a ^= 0;
+    //
+    "expr asgadd var:a num:0",
+    "expr asgsub var:a num:0",
+    "expr asgbor var:a num:0",
+    "expr asgxor var:a num:0",
+
+    //
+    // a = __ROL4__(__ROR4__(a, n), n); and the like: rotate round trips
+    //
+    "expr asg var:a call helper:__ROL1__ call helper:__ROR1__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROR1__ call helper:__ROL1__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROL2__ call helper:__ROR2__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROR2__ call helper:__ROL2__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROL4__ call helper:__ROR4__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROR4__ call helper:__ROL4__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROL8__ call helper:__ROR8__ var:a num:n num:n",
+    "expr asg var:a call helper:__ROR8__ call helper:__ROL8__ var:a num:n num:n"
+};
+
+//
+// The ITEM_OP_* properties of ctree item type t; a constant expression, so
+// that g_abItemOpProperties is built by the compiler
+//
+#define ITEM_OP_PROPERTIES(t) ( \
+    ((t) == cot_obj) ? ITEM_OP_SINK : \
+    (((t) == cot_empty) || ((t) == cit_empty)) ? \
+        ITEM_OP_PRUNE_BARRIER | ITEM_OP_EMPTY : \
+    ((t) == cit_expr) ? ITEM_OP_CLOSURE : \
+    (((t) == cit_if) || ((t) == cit_for) || ((t) == cit_while) || \
+        ((t) == cit_do)) ? ITEM_OP_CONTROL_EXPRS : \
+    (((t) == cit_break) || ((t) == cit_continue) || ((t) == cit_goto)) ? \
+        ITEM_OP_SINK | ITEM_OP_PRUNE_BARRIER : \
+    ((t) == cit_return) ? \
+        ITEM_OP_SINK | ITEM_OP_CLOSURE | ITEM_OP_CONTROL_EXPRS | \
+        ITEM_OP_PRUNE_BARRIER : \
+    ((t) == cit_asm) ? ITEM_OP_PRUNE_BARRIER : \
+    0)
+#define ITEM_OP_PROPERTIES_8(t) \
+    ITEM_OP_PROPERTIES(t), ITEM_OP_PROPERTIES(t + 1), \
+    ITEM_OP_PROPERTIES(t + 2), ITEM_OP_PROPERTIES(t + 3), \
+    ITEM_OP_PROPERTIES(t + 4), ITEM_OP_PROPERTIES(t + 5), \
+    ITEM_OP_PROPERTIES(t + 6), ITEM_OP_PROPERTIES(t + 7)
+#define ITEM_OP_PROPERTIES_32(t) \
+    ITEM_OP_PROPERTIES_8(t), ITEM_OP_PROPERTIES_8(t + 8), \
+    ITEM_OP_PROPERTIES_8(t + 16), ITEM_OP_PROPERTIES_8(t + 24)
+
+static_assert(
+    cit_end <= CROWDDETOX_ITEM_OP_COUNT,
+    "g_abItemOpProperties does not cover every ctype_t");
+
+//
+// The ITEM_OP_* properties of every item type, indexed by ctype_t, so that
+// each test is a single load
+//
+static const uint8 g_abItemOpProperties[CROWDDETOX_ITEM_OP_COUNT] =
+{
+    ITEM_OP_PROPERTIES_32(0),
+    ITEM_OP_PROPERTIES_32(32),
+    ITEM_OP_PROPERTIES_32(64),
+    ITEM_OP_PROPERTIES_32(96)
+};
+
+//
+// This structure describes one subtree shape found by ClassifyMirrorItems()
+//
+struct ITEM_CLASS
+{
+    //
+    // Hash of the shape's key
+    //
+    uint64 qwHash;
+
+    //
+    // Ordinal of the first item found with this shape
+    //
+    uint32 nRepresentative;
+
+    //
+    // The local variables read by the shape, in
+    // DETOX_SCRATCH::classVariables (unless ITEM_CLASS_MANY_VARIABLES)
+    //
+    uint32 nFirstVariable;
+    uint32 nVariables;
+
+    //
+    // ITEM_CLASS_* flags
+    //
+    uint8 bFlags;
+};
+
+//
+// This structure is a pure copy "a = b;" found by GroupCopiedVariables()
+//
+struct COPY_EDGE
+{
+    //
+    // The variables a and b
+    //
+    uint32 nDestination;
+    uint32 nSource;
+
+    //
+    // Ordinal of the cot_var item of a
+    //
+    uint32 nDestinationItem;
+};
+
+//
+// This structure orders a function's ordinals by the address of their
+// ctree items, for std::sort()
+//
+struct ITEM_ORDINAL_ORDER
+{
+    //
+    // The ctree item behind each ordinal (DETOX_MIRROR::itemPointers)
+    //
+    citem_t* const* apItems;
+
+    bool
+    operator() (
+        uint32 a,
+        uint32 b
+        ) const
+    {
+        return apItems[a] < apItems[b];
+    }
+};
+
+//
+// This structure is a bump allocator for the fixed-size arrays of a Detox()
+// step. Its allocations are never freed one by one: ResetArena() releases
+// all of them at once when the step returns, and keeps the memory for the
+// next step. Reused vectors alone would avoid the allocations too, but
+// each would keep the capacity of its own largest function; the arena
+// sizes the step's arrays as a whole, and measures them.
+//
+struct DETOX_ARENA
+{
+    //
+    // The blocks and their sizes; blocks[nBlock] is being filled, and its
+    // first cbUsed bytes are taken
+    //
+    qvector<uint8*> blocks;
+    qvector<size_t> blockSizes;
+    size_t nBlock;
+    size_t cbUsed;
+
+    //
+    // Bytes allocated since the last ResetArena()
+    //
+    size_t cbAllocated;
+
+    //
+    // DETOX_ARENA constructor
+    //
+    DETOX_ARENA():
+        nBlock(0),
+        cbUsed(0),
+        cbAllocated(0)
+    {
+    }
+
+    //
+    // DETOX_ARENA destructor
+    //
+    ~DETOX_ARENA()
+    {
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            qfree(
+                blocks[i]);
+        }
+    }
+};
+
+//
+// Size of the blocks that DETOX_ARENAs allocate, in bytes; set from the
+// "arena" option before any Detox() step runs
+//
+static size_t g_cbArenaBlockSize = CROWDDETOX_DEFAULT_ARENA_BLOCK_KB << 10;
+
+//
+// Whether the Detox() steps use the side-effect summaries and the global
+// variable and return value indexes, and record and use the parameter
+// index; set from the "purity", "globals", "returns" and "params" options
+// of the current run, as the summaries and indexes stay in the database
+// after the run that built them
+//
+static bool g_fPurity = false;
+static bool g_fGlobalIndex = false;
+static bool g_fReturnIndex = false;
+static bool g_fParameterIndex = false;
+
+//
+// This structure holds the working memory of the Detox() steps. Each thread
+// that runs them keeps one and passes it to every function it processes;
+// the vectors are emptied with qclear(), which keeps their capacity, and the
+// arena keeps its blocks, so once they have grown to the size of the largest
+// function seen so far the steps stop allocating.
+//
+struct DETOX_SCRATCH
+{
+    //
+    // FlattenFunction(): ordinals of the items whose descendants are being
+    // visited
+    //
+    qvector<uint32> openItems;
+
+    //
+    // AnalyzeMirror() and ApplyDetoxEdits(): the memory of the arrays whose
+    // size is known when the step starts; the arrays below that point into
+    // it are only valid until the step returns
+    //
+    DETOX_ARENA arena;
+
+    //
+    // AnalyzeMirror(): per-ordinal flag, have all of the item's descendants
+    // been marked legitimate
+    //
+    uint8* abDescendantsMarkedLegit;
+
+    //
+    // ApplyDetoxEdits(): the ordinals of the mirror's items, sorted by the
+    // address of their ctree items
+    //
+    uint32* anOrdinalsByItem;
+
+    //
+    // ClassifyMirrorItems(): per-ordinal class, the classes, the hash table
+    // that indexes them, the variable sets of the classes, and the set
+    // being merged
+    //
+    uint32* anItemClasses;
+    qvector<ITEM_CLASS> classes;
+    uint32* anClassTable;
+    qvector<uint32> classVariables;
+    qvector<uint32> mergedVariables;
+
+    //
+    // AnalyzeMirror(): per class, the round in which the class' liveness
+    // was last computed, and the result
+    //
+    uint32* anClassRounds;
+    uint8* abClassIsLive;
+
+    //
+    // GroupCopiedVariables(): the pure copies sorted by destination, the
+    // index of each variable's first copy, and the union-find parent and
+    // next class member of each variable
+    //
+    qvector<COPY_EDGE> copyEdges;
+    uint32* anCopyEdgeIndex;
+    uint32* anCopyParents;
+    uint32* anCopyNext;
+
+    //
+    // AnalyzeMirror(): variables that became legitimate and whose copies
+    // have not been followed yet
+    //
+    qvector<uint32> newLegitVariables;
+
+    //
+    // FoldOpaquePredicates(): the ifs and whiles of the function, the
+    // condition being evaluated and its atoms
+    //
+    qvector<cinsn_t*> conditionals;
+    PREDICATE_PROGRAM predicate;
+    qvector<cexpr_t*> predicateAtoms;
+
+    //
+    // EvaluateCondition(): results of the conditions evaluated so far,
+    // sorted by hash, and their programs' operations; unlike the rest of
+    // the scratch memory, these are kept from one function to the next
+    //
+    qvector<PREDICATE_MEMO_ENTRY> predicateMemo;
+    qvector<PREDICATE_OP> predicateMemoOps;
+
+    //
+    // SimplifyMbaExpressions(): the expressions to simplify, and the DAG of
+    // the one being simplified (its nodes, the hash table that indexes
+    // them, its leaves, and the mask of its width)
+    //
+    qvector<cexpr_t*> mbaRoots;
+    qvector<MBA_NODE> mbaNodes;
+    qvector<uint32> mbaTable;
+    qvector<cexpr_t*> mbaLeaves;
+    uint64 qwMbaMask;
+};
+
+//
+// This structure is stored (keyed by function start address) in the
+// CROWDDETOX_NETNODE netnode for every function processed in batch mode
+//
+#pragma pack(push, 1)
+struct DETOX_CACHE_ENTRY
+{
+    uint32 nItemsBefore;
+    uint32 nItemsAfter;
+    uint32 nVariablesCleared;
+    uint64 qwDecompileNs;
+    uint64 qwDetoxNs;
+};
+
+//
+// Batch workers append one of these records per detoxed function to their
+// shard's record file; the coordinator merges them into its own cache
+//
+struct DETOX_RESULT_RECORD
+{
+    ea_t ea;
+    DETOX_CACHE_ENTRY entry;
+
+    //
+    // The function's parameter index entry, if any
+    //
+    uint32 dwParameters;
+};
+
+//
+// Types of batch journal records
+//
+enum JOURNAL_RECORD_TYPE
+{
+    JOURNAL_STARTED = 'S',
+    JOURNAL_DONE = 'D',
+    JOURNAL_CRASHED = 'X',
+    JOURNAL_CHECKPOINT = 'C'
+};
+
+//
+// A batch run's journal is an append-only array of these records.
+// JOURNAL_STARTED is written (and flushed) before a function is decompiled;
+// JOURNAL_DONE records, holding a function's results, and JOURNAL_CRASHED
+// records are only written at checkpoints, each of which ends with a
+// JOURNAL_CHECKPOINT record holding the sizes of the output files at that
+// point.
+//
+struct JOURNAL_RECORD
+{
+    uint8 bType;
+    ea_t ea;
+    DETOX_CACHE_ENTRY entry;
+    uint64 qwOutputSize;
+    uint64 qwRecordSize;
+    uint64 qwExportSize;
+    uint64 qwStatsSize;
+};
+
+//
+// In a CROWDDETOX_EXPORT_BINARY export file, each function is stored as
+// this header, followed by the function's name and its detoxed pseudocode
+// (lines separated by '\n'), neither of which is NUL-terminated
+//
+struct EXPORT_RECORD_HEADER
+{
+    //
+    // Size of the record, including this header
+    //
+    uint32 cbRecord;
+
+    uint64 qwEA;
+    uint32 nItemsBefore;
+    uint32 nItemsAfter;
+    uint32 nVariablesCleared;
+    uint64 qwDecompileNs;
+    uint64 qwDetoxNs;
+    uint32 cbName;
+    uint32 cbCode;
+};
+#pragma pack(pop)
+
+//
+// This structure accumulates the totals of a batch run
+//
+struct BATCH_SUMMARY
+{
+    uint32 nDetoxed;
+    uint32 nFailed;
+    uint32 nResumed;
+    uint32 nCrashing;
+    uint64 qwDecompileNs;
+    uint64 qwDetoxNs;
+
+    //
+    // Number of analysis threads used, and the total time they spent
+    // analyzing
+    //
+    uint32 nThreads;
+    uint64 qwThreadBusyNs;
+
+    //
+    // Number of worker processes used, and the longest time a single
+    // function took to decompile and detox
+    //
+    uint32 nWorkers;
+    uint64 qwLongestNs;
+
+    //
+    // Memory budget of the pipeline (0 if unlimited), the most memory that
+    // queued functions were estimated to use at once, and the number of
+    // functions that exceeded the budget on their own
+    //
+    uint64 qwMemoryBudget;
+    uint64 qwPeakQueuedBytes;
+    uint32 nOversize;
+
+    //
+    // Number of statements removed by the early Detox() pass, and the time
+    // it took (which is part of qwDecompileNs)
+    //
+    uint32 nEarlyStatementsPruned;
+    uint64 qwEarlyDetoxNs;
+
+    //
+    // Number of functions run through the dead-store pass, the dead
+    // register definitions and stack stores it found, and the time it took
+    //
+    uint32 nDeadStoreFunctions;
+    uint32 nDeadStores;
+    uint64 qwDeadStoreNs;
+
+    //
+    // Most arena memory that a single function's AnalyzeMirror() and
+    // ApplyDetoxEdits() used
+    //
+    size_t cbPeakAnalyzeArena;
+    size_t cbPeakApplyArena;
+
+    //
+    // Ctree maturity at which the functions were detoxed
+    //
+    ctree_maturity_t nMaturity;
+};
+
+//
+// This structure describes which functions a batch run should process and
+// where its results should go
+//
+struct BATCH_OPTIONS
+{
+    //
+    // Only functions starting within [startEA, endEA) are processed
+    //
+    ea_t startEA;
+    ea_t endEA;
+
+    //
+    // If not empty, a text file listing the start addresses (in hex, one per
+    // line) of the functions to process; overrides startEA and endEA
+    //
+    qstring strListPath;
+
+    //
+    // Path of the file to which detoxed pseudocode is written; if empty, the
+    // database path with a ".detox.c" extension is used
+    //
+    qstring strOutputPath;
+
+    //
+    // Number of worker processes launched by CoordinateWorkers(); 0 means
+    // one per CPU
+    //
+    int nWorkers;
+
+    //
+    // Number of functions per shard of a multi-process batch run
+    //
+    uint32 nShardSize;
+
+    //
+    // Path of the IDA executable launched for each worker; if empty,
+    // CROWDDETOX_WORKER_EXECUTABLE in the IDA directory is used
+    //
+    qstring strIdaPath;
+
+    //
+    // Index of this process when it is a worker launched by
+    // CoordinateWorkers(), or -1
+    //
+    int nWorkerIndex;
+
+    //
+    // Number of functions between two checkpoints; 0 disables
+    // checkpointing
+    //
+    uint32 nCheckpointInterval;
+
+    //
+    // Number of analysis threads that run alongside the decompiler; 0 runs
+    // every step on the main thread, -1 picks one per additional CPU
+    //
+    int nThreads;
+
+    //
+    // If not empty, the path of the file to which each function's detoxed
+    // pseudocode and statistics are exported in nExportFormat
+    //
+    qstring strExportPath;
+    int nExportFormat;
+
+    //
+    // Memory budget (in MB) of the decompiled functions queued in the
+    // pipeline; 0 means unlimited
+    //
+    uint32 nMemoryBudgetMB;
+
+    //
+    // If not empty, the path of the CSV file to which each function's
+    // Detox() statistics are written
+    //
+    qstring strStatsPath;
+
+    //
+    // Whether to also run an early Detox() pass on each function's ctree as
+    // soon as Hex-Rays has built it
+    //
+    bool fEarlyDetox;
+
+    //
+    // Whether to run the triage pass' dead-store analysis on each function
+    // before decompiling it, to compare its cost with that of Detox()
+    //
+    bool fDeadStores;
+
+    //
+    // Maturity of the ctree at which Detox() runs
+    //
+    ctree_maturity_t nMaturity;
+
+    //
+    // If not empty, the path of a file of junk signatures that replace the
+    // built-in ones
+    //
+    qstring strSignaturesPath;
+
+    //
+    // Whether to summarize the side effects of every function (unless they
+    // are cached already) before detoxing, so that calls to pure functions
+    // can be pruned
+    //
+    bool fPurity;
+
+    //
+    // Whether to index the reads and writes of every global variable
+    // (unless the database is indexed already) before detoxing, so that
+    // writes to globals that are never read can be pruned
+    //
+    bool fGlobals;
+
+    //
+    // Whether to index which functions' return values are used by their
+    // callers (unless the index is cached already) before detoxing, so that
+    // unused return values can be pruned
+    //
+    bool fReturns;
+
+    //
+    // Whether to record which parameters each detoxed function uses, and
+    // to drop the unused arguments of calls to functions detoxed before;
+    // batch runs then detox callees before their callers
+    //
+    bool fParameters;
+
+    //
+    // Size (in KB) of the blocks of the Detox() steps' arenas
+    //
+    uint32 nArenaBlockKB;
+};
+
+//
+// This structure streams export records to disk from a background thread.
+// The main thread fills one buffer while the writer thread writes the
+// other, so memory use does not depend on the number of functions.
+//
+struct EXPORT_WRITER
+{
+    FILE* pFile;
+    char szPath[QMAXPATH];
+    int nFormat;
+
+    //
+    // The main thread appends to apBuffers[nFilling]; while fWriting is
+    // set, apBuffers[nWriting] belongs to the writer thread
+    //
+    char* apBuffers[2];
+    size_t acbUsed[2];
+    uint32 nFilling;
+    uint32 nWriting;
+    bool fWriting;
+
+    //
+    // Posted by the main thread when it hands over a buffer (or sets
+    // fStop), and by the writer thread when that buffer has been written
+    //
+    qthread_t hThread;
+    qsemaphore_t hBufferReady;
+    qsemaphore_t hBufferWritten;
+    bool fStop;
+
+    //
+    // Set by the writer thread if a write failed
+    //
+    bool fFailed;
+
+    //
+    // Scratch space in which the main thread encodes a record
+    //
+    qstring strRecord;
+};
+
+//
+// This structure holds the open files of a batch run
+//
+struct BATCH_RUN
+{
+    //
+    // Detoxed pseudocode output
+    //
+    FILE* pOutputFile;
+
+    //
+    // DETOX_RESULT_RECORD output, or NULL to cache results in the
+    // CROWDDETOX_NETNODE netnode instead
+    //
+    FILE* pRecordFile;
+
+    //
+    // Checkpoint journal, or NULL if checkpointing is disabled
+    //
+    FILE* pJournalFile;
+    char szJournalPath[QMAXPATH];
+
+    //
+    // Number of functions between checkpoints, and the JOURNAL_DONE
+    // records of the functions completed since the last checkpoint
+    //
+    uint32 nCheckpointInterval;
+    qvector<JOURNAL_RECORD> pending;
+
+    //
+    // Export stream; its pFile is NULL if nothing is exported
+    //
+    EXPORT_WRITER exportWriter;
+
+    //
+    // CSV statistics output, or NULL
+    //
+    FILE* pStatsFile;
+};
+
+//
+// This structure tracks one worker process of a multi-process batch run
+//
+struct WORKER_SLOT
+{
+    int nWorker;
+    int nLaunches;
+    void* hProcess;
+    char szDatabasePath[QMAXPATH];
+};
+
+//
+// This class is a fixed-capacity, lock-free queue for exactly one producer
+// thread and one consumer thread. nCapacity must be a power of two.
+//
+template <class T, uint32 nCapacity>
+class SPSC_QUEUE
+{
+    private:
+
+    T aSlots[nCapacity];
+
+    //
+    // Number of values ever popped (written by the consumer only) and ever
+    // pushed (written by the producer only)
+    //
+    std::atomic<uint32> nHead;
+    std::atomic<uint32> nTail;
+
+    public:
+
+    SPSC_QUEUE():
+        nHead(0),
+        nTail(0)
+    {
+    }
+
+    /*! 
+        @brief Appends a value; called by the producer thread only
+
+        @param[in] value The value to append
+        @return Returns true on success, returns false if the queue is full
+    */
+    bool
+    Push (
+        const T& value
+        )
+    {
+        uint32 nCurrentTail = nTail.load(
+            std::memory_order_relaxed);
+        if (nCurrentTail - nHead.load(std::memory_order_acquire) == nCapacity)
+        {
+            return false;
+        }
+
+        aSlots[nCurrentTail & (nCapacity - 1)] = value;
+        nTail.store(
+            nCurrentTail + 1,
+            std::memory_order_release);
+
+        return true;
+    }
+
+    /*! 
+        @brief Removes the oldest value; called by the consumer thread only
+
+        @param[out] pValue Receives the value
+        @return Returns true on success, returns false if the queue is empty
+    */
+    bool
+    Pop (
+        T* pValue
+        )
+    {
+        uint32 nCurrentHead = nHead.load(
+            std::memory_order_relaxed);
+        if (nCurrentHead == nTail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        *pValue = aSlots[nCurrentHead & (nCapacity - 1)];
+        nHead.store(
+            nCurrentHead + 1,
+            std::memory_order_release);
+
+        return true;
+    }
+};
+
+//
+// This structure carries one function through the batch pipeline. Only the
+// main thread touches pFunction; an analysis thread reads the mirror and
+// writes the edit list and qwAnalyzeNs. Finished jobs are recycled, so that
+// their mirror and edit list keep their capacity.
+//
+struct DETOX_JOB
+{
+    cfuncptr_t pFunction;
+    ea_t ea;
+    DETOX_MIRROR mirror;
+    DETOX_EDITS edits;
+
+    //
+    // Set by the main thread once the job's analysis has been collected
+    //
+    bool fAnalyzed;
+
+    //
+    // Set if the function was detoxed while it was being decompiled (at a
+    // maturity other than CMAT_FINAL), in which case stats holds the
+    // results
+    //
+    bool fDetoxed;
+    DETOX_STATS stats;
+
+    uint64 qwDecompileNs;
+    uint64 qwFlattenNs;
+    uint64 qwAnalyzeNs;
+    uint64 qwApplyNs;
+
+    //
+    // Estimated memory held by the job once its function is flattened
+    //
+    uint64 qwMemoryBytes;
+
+    DETOX_JOB():
+        ea(BADADDR),
+        fAnalyzed(false),
+        fDetoxed(false),
+        qwDecompileNs(0),
+        qwFlattenNs(0),
+        qwAnalyzeNs(0),
+        qwApplyNs(0),
+        qwMemoryBytes(0)
+    {
+    }
+};
+
+//
+// This structure is the context of the Hex-Rays callback that detoxes a
+// batch run's functions while they are decompiled, when Detox() runs at a
+// maturity other than CMAT_FINAL
+//
+struct DETOX_HOOK
+{
+    ctree_maturity_t maturity;
+
+    //
+    // The job of the function being decompiled, or NULL
+    //
+    DETOX_JOB* pJob;
+
+    //
+    // The main thread's working memory
+    //
+    DETOX_SCRATCH* pScratch;
+};
+
+//
+// This structure is one analysis thread of a batch run. The main thread
+// is the only producer of jobs and the only consumer of results.
+//
+struct DETOX_THREAD
+{
+    qthread_t hThread;
+
+    //
+    // Jobs for this thread, and the semaphore posted for each of them
+    //
+    SPSC_QUEUE<DETOX_JOB*, CROWDDETOX_THREAD_QUEUE_SIZE> jobs;
+    qsemaphore_t hJobsAvailable;
+
+    //
+    // Analyzed jobs, and the pool-wide semaphore posted for each of them
+    //
+    SPSC_QUEUE<DETOX_JOB*, CROWDDETOX_THREAD_QUEUE_SIZE> results;
+    qsemaphore_t hResultsAvailable;
+
+    //
+    // Number of jobs submitted but not yet collected (main thread only)
+    //
+    uint32 nOutstanding;
+
+    //
+    // Time this thread spent analyzing (this thread only, until joined)
+    //
+    uint64 qwBusyNs;
+
+    //
+    // Working memory of AnalyzeMirror() (this thread only)
+    //
+    DETOX_SCRATCH scratch;
+
+    DETOX_THREAD():
+        hThread(NULL),
+        hJobsAvailable(NULL),
+        hResultsAvailable(NULL),
+        nOutstanding(0),
+        qwBusyNs(0)
+    {
+    }
+};
+
+//
+// This structure holds the analysis threads of a batch run
+//
+struct DETOX_THREAD_POOL
+{
+    qvector<DETOX_THREAD*> threads;
+    qsemaphore_t hResultsAvailable;
+};
+
+//
+// This structure describes a decoded instruction for the triage pass.
+// Registers are given as bit masks of (mapped) register numbers.
+//
+struct TRIAGE_INSN
+{
+    ea_t ea;
+    uint64 qwUses;
+    uint64 qwDefs;
+    uint32 dwFlags;
+
+    //
+    // The instruction's stack slot references in TRIAGE_SCRATCH::slotRefs
+    //
+    uint32 nFirstSlotRef;
+    uint32 nSlotRefs;
+};
+
+//
+// This structure describes a reference of the triage pass to a stack slot
+//
+struct TRIAGE_SLOT_REF
+{
+    sval_t nSlot;
+    uint32 nKind;
+};
+
+//
+// This structure receives the junk indicators of a single function
+//
+struct TRIAGE_RESULT
+{
+    ea_t startEA;
+    uint32 nInstructions;
+    uint32 nBlocks;
+    uint32 nDefs;
+    uint32 nDeadDefs;
+    uint32 nDeadStackStores;
+    uint32 nStackSlots;
+    uint32 nHelpers;
+    uint32 nDeadLabels;
+    uint32 nUnreachable;
+    uint32 nScore;
+};
+
+//
+// This structure holds the triage pass' working memory, which is reused
+// from one function to the next
+//
+struct TRIAGE_SCRATCH
+{
+    //
+    // The function's instructions, in flow chart block order
+    //
+    qvector<TRIAGE_INSN> instructions;
+    qvector<TRIAGE_SLOT_REF> slotRefs;
+
+    //
+    // Frame offset (divided by TRIAGE_SLOT_SIZE) of each tracked stack slot,
+    // and whether the slot's address is taken
+    //
+    qvector<sval_t> slotOffsets;
+    qvector<bool> escaped;
+
+    //
+    // Index into instructions of each block's first instruction, followed
+    // by the total number of instructions
+    //
+    qvector<uint32> blockStarts;
+
+    //
+    // Bit vectors of the registers and stack slots live on entry to each
+    // block, and of the ones live at the instruction being analyzed
+    //
+    qvector<uint64> liveIn;
+    qvector<uint64> live;
+
+    //
+    // Whether each block is reachable from the function's entry block, and
+    // the worklist of the reachability search
+    //
+    qvector<bool> reachable;
+    qvector<int> worklist;
+};
+
+/*! 
+    @brief Counts the ctree items in the given function's body
+
+    @param[in] pFunction The function whose ctree items are counted
+    @return Returns the number of ctree items in the function's body
+*/
+uint32
+CountItems (
+    cfunc_t* pFunction
+    )
+{
+    //
+    // This structure is derived from ctree_visitor_t. It is used to count
+    // every statement and expression in the decompilation graph.
+    //
+    struct ida_local COUNT_ITEMS_VISITOR : public ctree_visitor_t
+    {
+        uint32 nItems;
+
+        int
+        idaapi
+        visit_expr (
+            cexpr_t* pExpression
+            )
+        {
+            UNUSED(pExpression);
+            nItems++;
+            return 0;
+        }
+
+        int
+        idaapi
+        visit_insn (
+            cinsn_t* pInstruction
+            )
+        {
+            UNUSED(pInstruction);
+            nItems++;
+            return 0;
+        }
+
+        COUNT_ITEMS_VISITOR():
+            ctree_visitor_t(CV_FAST),
+            nItems(0)
+        {
+        }
+    };
+
+    COUNT_ITEMS_VISITOR civ;
+    civ.apply_to(
+        &pFunction->body,
+        NULL);
+
+    return civ.nItems;
+}
+
+/*! 
+    @brief Reads a function's cached side-effect summary
+
+    @param[in] ea The start address of the function
+    @return Returns the function's SUMMARY_* flags, returns SUMMARY_UNKNOWN
+            if SummarizeSideEffects() has not summarized it or the current
+            run doesn't use the summaries
+*/
+uint8
+GetSideEffectSummary (
+    ea_t ea
+    )
+{
+    if (!g_fPurity)
+    {
+        return SUMMARY_UNKNOWN;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE);
+
+    nodeidx_t nSummary = nodeCache.altval(
+        ea,
+        CROWDDETOX_SUMMARY_TAG);
+    if (!(nSummary & SUMMARY_COMPUTED))
+    {
+        return SUMMARY_UNKNOWN;
+    }
+
+    return (uint8)(nSummary & ~SUMMARY_COMPUTED);
+}
+
+/*! 
+    @brief Adds the target of a call, or of a jump that leaves its function,
+           to a function's side-effect summary
+
+    @param[in] ea The target address
+    @param[in,out] pCallees Receives ea if it is the start of a function
+    @return Returns the SUMMARY_* flags of a target that is not a function
+*/
+uint8
+AddSummaryTarget (
+    ea_t ea,
+    eavec_t* pCallees
+    )
+{
+    segment_t* pSegment = getseg(
+        ea);
+    if ((pSegment != NULL) && (pSegment->type == SEG_XTRN))
+    {
+        return SUMMARY_CALLS_IMPORT;
+    }
+
+    func_t* pCallee = get_func(
+        ea);
+    if ((pCallee == NULL) || (pCallee->startEA != ea))
+    {
+        return SUMMARY_UNKNOWN;
+    }
+
+    pCallees->push_back(
+        ea);
+    return 0;
+}
+
+/*! 
+    @brief Computes the side effects of a function's own instructions
+    @details Writes to the function's stack frame are not side effects, any
+             other memory write is. Calls, and jumps to other functions, are
+             returned as call graph edges; calls to imported functions and
+             calls whose target is unknown are side effects. Only x86 is
+             supported: on other processors, the side effects of every
+             function are unknown.
+
+    @param[in] pFunc The function
+    @param[out] pCallees Receives the start addresses of the functions that
+                         the function calls or jumps to
+    @return Returns the SUMMARY_* flags of the function's instructions
+*/
+uint8
+ComputeLocalSideEffects (
+    func_t* pFunc,
+    eavec_t* pCallees
+    )
+{
+    func_item_iterator_t items;
+    uint8 bSummary = 0;
+
+    pCallees->clear();
+    if (ph.id != PLFM_386)
+    {
+        return SUMMARY_UNKNOWN;
+    }
+
+    for (bool fOk = items.set(pFunc); fOk; fOk = items.next_code())
+    {
+        ea_t ea = items.current();
+        if (decode_insn(ea) <= 0)
+        {
+            return SUMMARY_UNKNOWN;
+        }
+
+        uint32 dwFeature = ph.instruc[cmd.itype].feature;
+
+        //
+        // Explicit memory writes
+        //
+        for (int i = 0; i < UA_MAXOP; i++)
+        {
+            const op_t& op = cmd.Operands[i];
+
+            if (op.type == o_void)
+            {
+                break;
+            }
+            if ((dwFeature & (CF_CHG1 << i)) == 0)
+            {
+                continue;
+            }
+
+            if (op.type == o_mem)
+            {
+                bSummary |= SUMMARY_WRITES_GLOBAL;
+            }
+            else if (((op.type == o_phrase) || (op.type == o_displ)) &&
+                (BADADDR == calc_stkvar_struc_offset(pFunc, ea, i)))
+            {
+                bSummary |= SUMMARY_WRITES_POINTER;
+            }
+        }
+
+        //
+        // Implicit memory writes, I/O, and system calls
+        //
+        switch (cmd.itype)
+        {
+        case NN_movs:
+        case NN_stos:
+            bSummary |= SUMMARY_WRITES_POINTER;
+            break;
+        case NN_ins:
+        case NN_outs:
+        case NN_in:
+        case NN_out:
+        case NN_int:
+        case NN_into:
+        case NN_int3:
+        case NN_syscall:
+        case NN_sysenter:
+        case NN_hlt:
+            return SUMMARY_UNKNOWN;
+        default:
+            break;
+        }
+
+        //
+        // Follow the calls and the jumps that leave the function. A call or
+        // indirect jump through an import's pointer only has a data
+        // reference, to the import.
+        //
+        bool fCall = (dwFeature & CF_CALL) != 0;
+        bool fIndirect = fCall || ((dwFeature & CF_JUMP) != 0);
+        bool fTargetFound = false;
+        xrefblk_t xref;
+        for (bool fRef = xref.first_from(ea, XREF_ALL); fRef;
+            fRef = xref.next_from())
+        {
+            if (xref.iscode)
+            {
+                if (xref.type == fl_F)
+                {
+                    continue;
+                }
+                fTargetFound = true;
+                if (((xref.type == fl_JN) || (xref.type == fl_JF)) &&
+                    (get_func(xref.to) == pFunc))
+                {
+                    continue;
+                }
+                bSummary |= AddSummaryTarget(
+                    xref.to,
+                    pCallees);
+            }
+            else if (fIndirect && (xref.type == dr_R))
+            {
+                segment_t* pSegment = getseg(
+                    xref.to);
+                if ((pSegment != NULL) && (pSegment->type == SEG_XTRN))
+                {
+                    fTargetFound = true;
+                    bSummary |= SUMMARY_CALLS_IMPORT;
+                }
+            }
+        }
+        if (fIndirect && !fTargetFound)
+        {
+            return SUMMARY_UNKNOWN;
+        }
+        if (bSummary & SUMMARY_UNKNOWN)
+        {
+            return SUMMARY_UNKNOWN;
+        }
+    }
+
+    return bSummary;
+}
+
+/*! 
+    @brief Computes the side-effect summary of every function in the
+           database and caches it in the CROWDDETOX_NETNODE netnode
+    @details The call graph is summarized bottom-up, one strongly connected
+             component at a time: Tarjan's algorithm completes each
+             component after every component that it calls, so that its
+             summary is the union of its members' own side effects and of
+             its callees' summaries. Mutually recursive functions therefore
+             share a summary. Cached summaries are reused unless a function
+             has been created since they were computed.
+*/
+void
+SummarizeSideEffects (
+    void
+    )
+{
+    size_t nFunctions = get_func_qty();
+    eavec_t callees;
+    qvector<uint8> summaries;
+    qvector<uint32> edges;
+    qvector<uint32> edgeIndex;
+    qvector<uint32> indices;
+    qvector<uint32> lowLinks;
+    qvector<uint32> edgePositions;
+    qvector<uint32> componentStack;
+    qvector<uint32> callStack;
+    qvector<bool> onStack;
+    uint32 nNextIndex = 1;
+    uint32 nPure = 0;
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+
+    size_t nCached = 0;
+    while ((nCached < nFunctions) &&
+        (nodeCache.altval(getn_func(nCached)->startEA,
+            CROWDDETOX_SUMMARY_TAG) & SUMMARY_COMPUTED))
+    {
+        nCached++;
+    }
+    if ((nFunctions == 0) || (nCached == nFunctions))
+    {
+        return;
+    }
+
+    uint64 qwStart = get_nsec_stamp();
+
+    //
+    // Decode every function, and index the call graph's edges by caller:
+    // the callees of function i are edges[edgeIndex[i], edgeIndex[i + 1])
+    //
+    summaries.resize(
+        nFunctions,
+        0);
+    edgeIndex.push_back(
+        0);
+    for (size_t i = 0; i < nFunctions; i++)
+    {
+        summaries[i] = ComputeLocalSideEffects(
+            getn_func(i),
+            &callees);
+        for (size_t j = 0; j < callees.size(); j++)
+        {
+            edges.push_back(
+                (uint32)get_func_num(callees[j]));
+        }
+        edgeIndex.push_back(
+            (uint32)edges.size());
+    }
+
+    //
+    // Tarjan's algorithm, with an explicit call stack; indices[v] is 0 until
+    // v is visited
+    //
+    indices.resize(
+        nFunctions,
+        0);
+    lowLinks.resize(
+        nFunctions,
+        0);
+    edgePositions.resize(
+        nFunctions,
+        0);
+    onStack.resize(
+        nFunctions,
+        false);
+    for (uint32 nRoot = 0; nRoot < nFunctions; nRoot++)
+    {
+        if (indices[nRoot] != 0)
+        {
+            continue;
+        }
+
+        indices[nRoot] = lowLinks[nRoot] = nNextIndex++;
+        edgePositions[nRoot] = edgeIndex[nRoot];
+        componentStack.push_back(
+            nRoot);
+        onStack[nRoot] = true;
+        callStack.push_back(
+            nRoot);
+
+        while (!callStack.empty())
+        {
+            uint32 v = callStack.back();
+
+            if (edgePositions[v] < edgeIndex[v + 1])
+            {
+                uint32 w = edges[edgePositions[v]++];
+
+                if (indices[w] == 0)
+                {
+                    indices[w] = lowLinks[w] = nNextIndex++;
+                    edgePositions[w] = edgeIndex[w];
+                    componentStack.push_back(
+                        w);
+                    onStack[w] = true;
+                    callStack.push_back(
+                        w);
+                }
+                else if (onStack[w])
+                {
+                    lowLinks[v] = qmin(lowLinks[v], indices[w]);
+                }
+                else
+                {
+                    //
+                    // w's component is complete
+                    //
+                    summaries[v] |= summaries[w];
+                }
+                continue;
+            }
+
+            //
+            // All of v's callees have been visited; if v is the root of its
+            // component, the component is complete
+            //
+            callStack.pop_back();
+            if (lowLinks[v] == indices[v])
+            {
+                uint8 bComponent = 0;
+                size_t nFirst = componentStack.size();
+
+                do
+                {
+                    nFirst--;
+                    bComponent |= summaries[componentStack[nFirst]];
+                } while (componentStack[nFirst] != v);
+
+                for (size_t i = nFirst; i < componentStack.size(); i++)
+                {
+                    summaries[componentStack[i]] = bComponent;
+                    onStack[componentStack[i]] = false;
+                }
+                componentStack.resize(
+                    nFirst);
+            }
+            if (!callStack.empty())
+            {
+                uint32 u = callStack.back();
+
+                lowLinks[u] = qmin(lowLinks[u], lowLinks[v]);
+                summaries[u] |= summaries[v];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nFunctions; i++)
+    {
+        nodeCache.altset(
+            getn_func(i)->startEA,
+            summaries[i] | SUMMARY_COMPUTED,
+            CROWDDETOX_SUMMARY_TAG);
+        if (summaries[i] == 0)
+        {
+            nPure++;
+        }
+    }
+
+    msg(
+        "CrowdDetox: Summarized the side effects of %u functions (%u pure) "
+        "in %.1f ms.\n",
+        (uint32)nFunctions,
+        nPure,
+        (get_nsec_stamp() - qwStart) / 1e6);
+}
+
+/*! 
+    @brief Tests whether an address is referenced; used with nextthat()
+
+    @param[in] flags The address' flags
+    @param[in] pContext Unused
+    @return Returns true if the address is referenced
+*/
+bool
+idaapi
+HasReference (
+    flags_t flags,
+    void* pContext
+    )
+{
+    UNUSED(pContext);
+
+    return hasRef(flags);
+}
+
+/*! 
+    @brief Computes a global variable's entry in the global variable index
+    @details The references to any address of the global's item count, so
+             that fields and elements accessed on their own are accounted
+             for. A reference that takes the global's address counts as a
+             read, since the global may then be read through a pointer.
+
+    @param[in] head The address of the global's item
+    @param[in] end The end address of the global's item
+    @return Returns the global's GLOBAL_* flags and size
+*/
+nodeidx_t
+IndexGlobalVariable (
+    ea_t head,
+    ea_t end
+    )
+{
+    nodeidx_t nEntry = GLOBAL_INDEXED |
+        ((nodeidx_t)(end - head) << GLOBAL_SIZE_SHIFT);
+    xrefblk_t xref;
+
+    for (ea_t ea = hasRef(get_flags_novalue(head)) ?
+            head : nextthat(head, end, HasReference);
+        (ea != BADADDR) && (ea < end);
+        ea = nextthat(ea, end, HasReference))
+    {
+        for (bool fOk = xref.first_to(ea, XREF_ALL); fOk;
+            fOk = xref.next_to())
+        {
+            if (!xref.iscode && (xref.type == dr_W))
+            {
+                nEntry |= GLOBAL_WRITTEN;
+            }
+            else
+            {
+                nEntry |= GLOBAL_READ;
+            }
+        }
+    }
+
+    return nEntry;
+}
+
+/*! 
+    @brief Keeps the global variable index up to date as IDA adds and
+           deletes data references
+    @details A new reference updates its global's entry in place. A deleted
+             reference may have been the global's only read, so its entry is
+             marked stale and recomputed by IsWriteOnlyGlobal() the next
+             time it is needed.
+
+    @param[in] pUserData Unused
+    @param[in] nNotification The processor module notification
+    @param[in] va The notification's arguments
+    @return Always returns 0 to let IDA proceed
+*/
+int
+idaapi
+GlobalIndexCallback (
+    void* pUserData,
+    int nNotification,
+    va_list va
+    )
+{
+    UNUSED(pUserData);
+
+    if ((nNotification != processor_t::add_dref) &&
+        (nNotification != processor_t::del_dref))
+    {
+        return 0;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE);
+    if (nodeCache.hashval_long(CROWDDETOX_GLOBAL_INDEX_KEY) == 0)
+    {
+        return 0;
+    }
+
+    va_arg(
+        va,
+        ea_t);
+    ea_t to = va_arg(
+        va,
+        ea_t);
+    ea_t head = get_item_head(
+        to);
+    nodeidx_t nEntry = nodeCache.altval(
+        head,
+        CROWDDETOX_GLOBAL_TAG);
+
+    if (nNotification == processor_t::del_dref)
+    {
+        if (nEntry == 0)
+        {
+            return 0;
+        }
+        nEntry |= GLOBAL_STALE;
+    }
+    else
+    {
+        //
+        // The new reference isn't there yet, so it is added by hand
+        //
+        dref_t type = (dref_t)va_arg(
+            va,
+            int);
+
+        if (!(nEntry & GLOBAL_INDEXED))
+        {
+            nEntry = IndexGlobalVariable(
+                head,
+                get_item_end(head));
+        }
+        nEntry |= (type == dr_W) ? GLOBAL_WRITTEN : GLOBAL_READ;
+    }
+
+    nodeCache.altset(
+        head,
+        nEntry,
+        CROWDDETOX_GLOBAL_TAG);
+
+    return 0;
+}
+
+/*! 
+    @brief Indexes the reads and writes of every referenced global variable
+           in the database
+    @details Every referenced address outside of code and import segments
+             is visited once, and its item is indexed with
+             IndexGlobalVariable(). The index is cached in the
+             CROWDDETOX_NETNODE netnode, so it is only built once per
+             database; GlobalIndexCallback(), which is hooked from then on,
+             keeps it up to date as references are added and deleted.
+*/
+void
+BuildGlobalIndex (
+    void
+    )
+{
+    uint32 nGlobals = 0;
+    uint32 nWriteOnly = 0;
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+    if (nodeCache.hashval_long(CROWDDETOX_GLOBAL_INDEX_KEY) != 0)
+    {
+        return;
+    }
+
+    uint64 qwStart = get_nsec_stamp();
+
+    for (int i = 0; i < get_segm_qty(); i++)
+    {
+        segment_t* pSegment = getnseg(
+            i);
+        if ((pSegment == NULL) || (pSegment->type == SEG_XTRN))
+        {
+            continue;
+        }
+
+        ea_t ea = pSegment->startEA;
+        if (!hasRef(get_flags_novalue(ea)))
+        {
+            ea = nextthat(
+                ea,
+                pSegment->endEA,
+                HasReference);
+        }
+        while ((ea != BADADDR) && (ea < pSegment->endEA))
+        {
+            ea_t head = get_item_head(
+                ea);
+            ea_t end = get_item_end(
+                head);
+
+            if (!isCode(get_flags_novalue(head)))
+            {
+                nodeidx_t nEntry = IndexGlobalVariable(
+                    head,
+                    end);
+                nodeCache.altset(
+                    head,
+                    nEntry,
+                    CROWDDETOX_GLOBAL_TAG);
+
+                nGlobals++;
+                if ((nEntry & (GLOBAL_READ | GLOBAL_WRITTEN)) ==
+                    GLOBAL_WRITTEN)
+                {
+                    nWriteOnly++;
+                }
+            }
+
+            ea = nextthat(
+                end - 1,
+                pSegment->endEA,
+                HasReference);
+        }
+    }
+
+    nodeCache.hashset(
+        CROWDDETOX_GLOBAL_INDEX_KEY,
+        1);
+    if (!g_fGlobalIndexHooked)
+    {
+        g_fGlobalIndexHooked = hook_to_notification_point(
+            HT_IDP,
+            GlobalIndexCallback,
+            NULL);
+    }
+
+    msg(
+        "CrowdDetox: Indexed %u global variables (%u never read) in %.1f "
+        "ms.\n",
+        nGlobals,
+        nWriteOnly,
+        (get_nsec_stamp() - qwStart) / 1e6);
+}
+
+/*! 
+    @brief Determines whether a global variable is written but never read
+    @details Only answers from the global variable index built by
+             BuildGlobalIndex(), and only in runs with the "globals" option. Exported globals may be read by other
+             modules, so they are never considered write-only.
+
+    @param[in] ea An address within the global variable
+    @return Returns true if nothing in the database reads the global,
+            returns false if something does or if it isn't known
+*/
+bool
+IsWriteOnlyGlobal (
+    ea_t ea
+    )
+{
+    if (!g_fGlobalIndex)
+    {
+        return false;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE);
+    if (nodeCache.hashval_long(CROWDDETOX_GLOBAL_INDEX_KEY) == 0)
+    {
+        return false;
+    }
+
+    ea_t head = get_item_head(
+        ea);
+    if (isCode(get_flags_novalue(head)) || is_public_name(head))
+    {
+        return false;
+    }
+
+    nodeidx_t nEntry = nodeCache.altval(
+        head,
+        CROWDDETOX_GLOBAL_TAG);
+    if (!(nEntry & GLOBAL_INDEXED))
+    {
+        return false;
+    }
+
+    //
+    // Recompute the entry if a reference was deleted or the item was
+    // resized since
+    //
+    ea_t end = get_item_end(
+        head);
+    nodeidx_t nSizeBits = (nodeidx_t)(end - head) << GLOBAL_SIZE_SHIFT;
+    if ((nEntry & GLOBAL_STALE) ||
+        ((nEntry & ~(((nodeidx_t)1 << GLOBAL_SIZE_SHIFT) - 1)) != nSizeBits))
+    {
+        nEntry = IndexGlobalVariable(
+            head,
+            end);
+        nodeCache.altset(
+            head,
+            nEntry,
+            CROWDDETOX_GLOBAL_TAG);
+    }
+
+    return (nEntry & (GLOBAL_READ | GLOBAL_WRITTEN)) == GLOBAL_WRITTEN;
+}
+
+/*! 
+    @brief Determines whether any caller of a function uses its return value
+
+    @param[in] ea The start address of the function
+    @return Returns false if BuildReturnIndex() found that no caller uses the
+            function's return value and the current run uses the index,
+            returns true otherwise
+*/
+bool
+IsReturnValueUsed (
+    ea_t ea
+    )
+{
+    if (!g_fReturnIndex)
+    {
+        return true;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE);
+
+    nodeidx_t nEntry = nodeCache.altval(
+        ea,
+        CROWDDETOX_RETURN_TAG);
+
+    return !(nEntry & RETURN_INDEXED) || (nEntry & RETURN_USED);
+}
+
+/*! 
+    @brief Determine if the given function call is legitimate (as
+           opposed to a trivial macro)
+
+    @param[in] pExpression The expression containing the function call
+    @return Returns true if the function call appears to be legitimate,
+            returns false otherwise
+*/
+bool
+IsLegitimateCall (
+    cexpr_t* pExpression
+    )
+{
+    cexpr_t* pCalledFunction;
+    char szFunctionName[1024];
+
+    //
+    // These macros are from IDA's defs.h
+    //
+    char* aszNonLegitHelpers[] =
+    {
+        "__ROL__",
+        "__ROL1__",
+        "__ROL2__",
+        "__ROL4__",
+        "__ROL8__",
+        "__ROR1__",
+        "__ROR2__",
+        "__ROR4__",
+        "__ROR8__",
+        "LOBYTE",
+        "LOWORD",
+        "LODWORD",
+        "HIBYTE",
+        "HIWORD",
+        "HIDWORD",
+        "BYTEn",
+        "WORDn",
+        "BYTE1",
+        "BYTE2",
+        "BYTE3",
+        "BYTE4",
+        "BYTE5",
+        "BYTE6",
+        "BYTE7",
+        "BYTE8",
+        "BYTE9",
+        "BYTE10",
+        "BYTE11",
+        "BYTE12",
+        "BYTE13",
+        "BYTE14",
+        "BYTE15",
+        "WORD1",
+        "WORD2",
+        "WORD3",
+        "WORD4",
+        "WORD5",
+        "WORD6",
+        "WORD7",
+        "SLOBYTE",
+        "SLOWORD",
+        "SLODWORD",
+        "SHIBYTE",
+        "SHIWORD",
+        "SHIDWORD",
+        "SBYTEn",
+        "SWORDn",
+        "SBYTE1",
+        "SBYTE2",
+        "SBYTE3",
+        "SBYTE4",
+        "SBYTE5",
+        "SBYTE6",
+        "SBYTE7",
+        "SBYTE8",
+        "SBYTE9",
+        "SBYTE10",
+        "SBYTE11",
+        "SBYTE12",
+        "SBYTE13",
+        "SBYTE14",
+        "SBYTE15",
+        "SWORD1",
+        "SWORD2",
+        "SWORD3",
+        "SWORD4",
+        "SWORD5",
+        "SWORD6",
+        "SWORD7",
+        "__CFSHL__",
+        "__CFSHR__",
+        "__CFADD__",
+        "__CFSUB__",
+        "__OFADD__",
+        "__OFSUB__",
+        "__RCL__",
+        "__RCR__",
+        "__MKCRCL__",
+        "__MKCRCR__",
+        "__SETP__",
+        "__MKCSHL__",
+        "__MKCSHR__",
+        "__SETS__",
+        "__ROR__"
+    };
+
+    //
+    // Ensure that the input expression is a call
+    //
+    if (pExpression->op != cot_call)
+    {
+        return false;
+    }
+
+    //
+    // Get a pointer to the called function
+    //
+    pCalledFunction = pExpression->x;
+
+    //
+    // A call to a function that SummarizeSideEffects() found pure only
+    // matters if its result is used
+    //
+    if ((pCalledFunction->op == cot_obj) &&
+        (0 == GetSideEffectSummary(pCalledFunction->obj_ea)))
+    {
+        return false;
+    }
+
+    //
+    // If the called function isn't a built-in "helper" (IDA macro),
+    // assume it's a call to a legitimate function
+    //
+    if (pCalledFunction->op != cot_helper)
+    {
+        return true;
+    }
+
+    //
+    // Get the name of the called "helper" function/macro
+    //
+    if (0 == pCalledFunction->print1(
+        szFunctionName,
+        _countof(szFunctionName) - 1,
+        NULL))
+    {
+        return false;
+    }
+    tag_remove(
+        szFunctionName,
+        szFunctionName,
+        _countof(szFunctionName) - 1);
+
+    //
+    // If the helper function is one of the macros from defs.h, it's
+    // not *necessarily* legitimate (though if one of the arguments to
+    // the function is legitimate, then the expression will get marked
+    // as legitimate anyway)
+    //
+    for (int i = 0; i < _countof(aszNonLegitHelpers); i++)
+    {
+        if (0 == strcmp(szFunctionName, aszNonLegitHelpers[i]))
+        {
+            return false;
+        }
+    }
+
+    //
+    // Otherwise, if the helper function is something like
+    // "__readfsdword", then it's probably legitimate
+    //
+    return true;
+}
+
+/*! 
+    @brief Orders PREDICATE_MEMO_ENTRY structures by hash
+
+    @param[in] a The first entry
+    @param[in] b The second entry
+    @return Returns true if a's hash is lower than b's
+*/
+bool
+ComparePredicateMemoEntries (
+    const PREDICATE_MEMO_ENTRY& a,
+    const PREDICATE_MEMO_ENTRY& b
+    )
+{
+    return a.qwHash < b.qwHash;
+}
+
+/*! 
+    @brief Compiles an integer expression into a PREDICATE_PROGRAM
+    @details Additions, subtractions, multiplications, negations, bitwise
+             operations, left shifts by a constant, and remainders of
+             divisions by a power of two are compiled into operations. Any
+             other integer or pointer expression without side effects
+             becomes an atom, a free variable of the program; equal atoms
+             share one variable.
+
+    @param[in] pExpression The expression to compile
+    @param[in,out] pProgram Receives the operations that compute the
+                            expression
+    @param[in,out] pAtoms The atoms found so far
+    @return Returns true on success, returns false if the expression cannot
+            be compiled
+*/
+bool
+CompilePredicateExpression (
+    cexpr_t* pExpression,
+    PREDICATE_PROGRAM* pProgram,
+    qvector<cexpr_t*>* pAtoms
+    )
+{
+    PREDICATE_OP op;
+
+    if (pProgram->ops.size() >= CROWDDETOX_PREDICATE_MAX_OPS)
+    {
+        return false;
+    }
+
+    op.bAtom = 0;
+    op.wReserved = 0;
+    op.dwReserved = 0;
+    op.qwValue = 0;
+
+    switch (pExpression->op)
+    {
+    case cot_num:
+        op.bOp = PREDICATE_OP_CONST;
+        op.qwValue = pExpression->numval();
+        break;
+
+    case cot_add:
+    case cot_sub:
+    case cot_mul:
+    case cot_band:
+    case cot_bor:
+    case cot_xor:
+        if (!CompilePredicateExpression(pExpression->x, pProgram, pAtoms) ||
+            !CompilePredicateExpression(pExpression->y, pProgram, pAtoms))
+        {
+            return false;
+        }
+        op.bOp = (pExpression->op == cot_add) ? PREDICATE_OP_ADD :
+            (pExpression->op == cot_sub) ? PREDICATE_OP_SUB :
+            (pExpression->op == cot_mul) ? PREDICATE_OP_MUL :
+            (pExpression->op == cot_band) ? PREDICATE_OP_AND :
+            (pExpression->op == cot_bor) ? PREDICATE_OP_OR : PREDICATE_OP_XOR;
+        break;
+
+    case cot_neg:
+    case cot_bnot:
+        if (!CompilePredicateExpression(pExpression->x, pProgram, pAtoms))
+        {
+            return false;
+        }
+        op.bOp = (pExpression->op == cot_neg) ?
+            PREDICATE_OP_NEG : PREDICATE_OP_NOT;
+        break;
+
+    case cot_shl:
+    case cot_smod:
+    case cot_umod:
+    {
+        if (pExpression->y->op != cot_num)
+        {
+            return false;
+        }
+
+        uint64 qwValue = pExpression->y->numval();
+        if (pExpression->op == cot_shl)
+        {
+            op.bOp = PREDICATE_OP_SHL;
+            op.qwValue = qwValue;
+        }
+        else
+        {
+            //
+            // x % 2^j is congruent to x modulo 2^j, whatever the signs
+            //
+            if ((qwValue < 2) || ((qwValue & (qwValue - 1)) != 0))
+            {
+                return false;
+            }
+            op.bOp = PREDICATE_OP_MOD;
+            for (op.qwValue = 0; ((uint64)1 << op.qwValue) < qwValue; )
+            {
+                op.qwValue++;
+            }
+            pProgram->nMaxBits = qmin(
+                pProgram->nMaxBits,
+                (uint32)op.qwValue);
+        }
+
+        if (!CompilePredicateExpression(pExpression->x, pProgram, pAtoms))
+        {
+            return false;
+        }
+        break;
+    }
+
+    default:
+    {
+        //
+        // Atoms are integers; a floating-point value is not determined by
+        // its bits under the program's operations (v != v for a NaN)
+        //
+        if (pExpression->has_side_effects() ||
+            !(is_type_int(*pExpression->type.u_str()) ||
+                is_type_ptr(*pExpression->type.u_str())))
+        {
+            return false;
+        }
+
+        size_t i = 0;
+        while ((i < pAtoms->size()) &&
+            !pAtoms->at(i)->equal_effect(*pExpression))
+        {
+            i++;
+        }
+        if (i == pAtoms->size())
+        {
+            if (i == CROWDDETOX_PREDICATE_MAX_ATOMS)
+            {
+                return false;
+            }
+            pAtoms->push_back(
+                pExpression);
+        }
+        op.bOp = PREDICATE_OP_ATOM;
+        op.bAtom = (uint8)i;
+        break;
+    }
+    }
+
+    pProgram->ops.push_back(
+        op);
+
+    return true;
+}
+
+/*! 
+    @brief Compiles a condition into a PREDICATE_PROGRAM
+    @details The condition is reduced to a test of whether an integer
+             expression is nonzero: "!x" and "x == y" test the negation of
+             "x" and "x - y", respectively. If the tested expression is a
+             remainder of a division by 2^j, or a bitwise AND with a constant
+             mask, its value is known to be zero exactly when its low bits
+             are.
+
+    @param[in] pCondition The condition
+    @param[out] pProgram Receives the compiled condition
+    @param[in,out] pAtoms Working memory; receives the condition's atoms
+    @return Returns true on success, returns false if the condition cannot
+            be compiled
+*/
+bool
+CompilePredicate (
+    cexpr_t* pCondition,
+    PREDICATE_PROGRAM* pProgram,
+    qvector<cexpr_t*>* pAtoms
+    )
+{
+    pProgram->ops.qclear();
+    pProgram->fNegate = false;
+    pProgram->qwExactMask = 0;
+    pProgram->nMaxBits = CROWDDETOX_PREDICATE_MAX_BITS;
+    pAtoms->qclear();
+
+    if (pCondition->has_side_effects())
+    {
+        return false;
+    }
+
+    cexpr_t* pTested = pCondition;
+    while (pTested->op == cot_lnot)
+    {
+        pProgram->fNegate = !pProgram->fNegate;
+        pTested = pTested->x;
+    }
+
+    if ((pTested->op == cot_eq) || (pTested->op == cot_ne))
+    {
+        //
+        // Only integer and pointer comparisons are identities of x - y; a
+        // floating-point v != v holds for a NaN
+        //
+        if (!(is_type_int(*pTested->x->type.u_str()) ||
+            is_type_ptr(*pTested->x->type.u_str())))
+        {
+            return false;
+        }
+
+        if (pTested->op == cot_eq)
+        {
+            pProgram->fNegate = !pProgram->fNegate;
+        }
+
+        if ((pTested->y->op == cot_num) && (pTested->y->numval() == 0))
+        {
+            pTested = pTested->x;
+        }
+        else
+        {
+            PREDICATE_OP op;
+
+            if (!CompilePredicateExpression(pTested->x, pProgram, pAtoms) ||
+                !CompilePredicateExpression(pTested->y, pProgram, pAtoms))
+            {
+                return false;
+            }
+            op.bOp = PREDICATE_OP_SUB;
+            op.bAtom = 0;
+            op.wReserved = 0;
+            op.dwReserved = 0;
+            op.qwValue = 0;
+            pProgram->ops.push_back(
+                op);
+            pProgram->nAtoms = (uint32)pAtoms->size();
+
+            return true;
+        }
+    }
+
+    if (!CompilePredicateExpression(pTested, pProgram, pAtoms))
+    {
+        return false;
+    }
+    pProgram->nAtoms = (uint32)pAtoms->size();
+
+    //
+    // Note when the tested value's low bits tell whether it is zero
+    //
+    const PREDICATE_OP& top = pProgram->ops.back();
+    if (top.bOp == PREDICATE_OP_MOD)
+    {
+        pProgram->qwExactMask = ((uint64)1 << top.qwValue) - 1;
+    }
+    else if ((top.bOp == PREDICATE_OP_AND) && (pTested->y->op == cot_num))
+    {
+        pProgram->qwExactMask = pTested->y->numval();
+    }
+
+    return true;
+}
+
+/*! 
+    @brief Hashes a compiled condition's structure
+    @details Atoms are numbered in order of first appearance, so conditions
+             that only differ in their variables, such as "(x * x + x) % 2"
+             and "(y * y + y) % 2", hash (and evaluate) alike.
+
+    @param[in] pProgram The compiled condition
+    @return Returns the structural hash
+*/
+uint64
+HashPredicate (
+    const PREDICATE_PROGRAM* pProgram
+    )
+{
+    //
+    // FNV-1a
+    //
+    uint64 qwHash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < pProgram->ops.size(); i++)
+    {
+        const PREDICATE_OP& op = pProgram->ops[i];
+        uint64 aqwFields[2] = { (uint64)op.bOp | ((uint64)op.bAtom << 8),
+            op.qwValue };
+
+        for (size_t j = 0; j < _countof(aqwFields); j++)
+        {
+            for (int k = 0; k < 64; k += 8)
+            {
+                qwHash ^= (aqwFields[j] >> k) & 0xFF;
+                qwHash *= 0x100000001B3ULL;
+            }
+        }
+    }
+
+    qwHash ^= (uint64)pProgram->fNegate;
+    qwHash *= 0x100000001B3ULL;
+    qwHash ^= pProgram->qwExactMask;
+    qwHash *= 0x100000001B3ULL;
+
+    return qwHash;
+}
+
+/*! 
+    @brief Determines whether a compiled condition is constant
+    @details Every operation of the program is compatible with arithmetic
+             modulo 2^k, so the low k bits of the tested value only depend
+             on the low k bits of the atoms. The program is evaluated for
+             every combination of the atoms' low k bits, for growing k. If
+             the low bits are never all zero, the tested value is never zero.
+             If they are always zero and the value cannot exceed its low
+             bits (see PREDICATE_PROGRAM::qwExactMask), it is always zero.
+
+    @param[in] pProgram The compiled condition
+    @return Returns 1 if the condition is always true, 0 if it is always
+            false, or -1 if it could not be shown to be constant
+*/
+int
+EvaluatePredicate (
+    const PREDICATE_PROGRAM* pProgram
+    )
+{
+    uint64 aqwStack[CROWDDETOX_PREDICATE_MAX_OPS];
+
+    for (uint32 nBits = 1; nBits <= pProgram->nMaxBits; nBits++)
+    {
+        if (nBits * pProgram->nAtoms > CROWDDETOX_PREDICATE_MAX_INPUT_BITS)
+        {
+            break;
+        }
+
+        uint64 qwMask = ((uint64)1 << nBits) - 1;
+        uint64 qwAssignments = (uint64)1 << (nBits * pProgram->nAtoms);
+        bool fEverZero = false;
+        bool fEverNonZero = false;
+
+        for (uint64 qwInput = 0; qwInput < qwAssignments; qwInput++)
+        {
+            size_t nDepth = 0;
+
+            for (size_t i = 0; i < pProgram->ops.size(); i++)
+            {
+                const PREDICATE_OP& op = pProgram->ops[i];
+
+                switch (op.bOp)
+                {
+                case PREDICATE_OP_CONST:
+                    aqwStack[nDepth++] = op.qwValue;
+                    break;
+                case PREDICATE_OP_ATOM:
+                    aqwStack[nDepth++] = qwInput >> (op.bAtom * nBits);
+                    break;
+                case PREDICATE_OP_ADD:
+                    nDepth--;
+                    aqwStack[nDepth - 1] += aqwStack[nDepth];
+                    break;
+                case PREDICATE_OP_SUB:
+                    nDepth--;
+                    aqwStack[nDepth - 1] -= aqwStack[nDepth];
+                    break;
+                case PREDICATE_OP_MUL:
+                    nDepth--;
+                    aqwStack[nDepth - 1] *= aqwStack[nDepth];
+                    break;
+                case PREDICATE_OP_AND:
+                    nDepth--;
+                    aqwStack[nDepth - 1] &= aqwStack[nDepth];
+                    break;
+                case PREDICATE_OP_OR:
+                    nDepth--;
+                    aqwStack[nDepth - 1] |= aqwStack[nDepth];
+                    break;
+                case PREDICATE_OP_XOR:
+                    nDepth--;
+                    aqwStack[nDepth - 1] ^= aqwStack[nDepth];
+                    break;
+                case PREDICATE_OP_NEG:
+                    aqwStack[nDepth - 1] = 0 - aqwStack[nDepth - 1];
+                    break;
+                case PREDICATE_OP_NOT:
+                    aqwStack[nDepth - 1] = ~aqwStack[nDepth - 1];
+                    break;
+                case PREDICATE_OP_SHL:
+                    aqwStack[nDepth - 1] = (op.qwValue < 64) ?
+                        aqwStack[nDepth - 1] << op.qwValue : 0;
+                    break;
+                case PREDICATE_OP_MOD:
+                    //
+                    // nBits never exceeds the modulus' bits
+                    //
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if ((aqwStack[0] & qwMask) == 0)
+            {
+                fEverZero = true;
+            }
+            else
+            {
+                fEverNonZero = true;
+            }
+            if (fEverZero && fEverNonZero)
+            {
+                break;
+            }
+        }
+
+        if (!fEverZero)
+        {
+            return pProgram->fNegate ? 0 : 1;
+        }
+        if (!fEverNonZero && (pProgram->qwExactMask != 0) &&
+            (pProgram->qwExactMask <= qwMask))
+        {
+            return pProgram->fNegate ? 1 : 0;
+        }
+    }
+
+    return -1;
+}
+
+/*! 
+    @brief Determines whether a condition is constant, using and updating
+           the memo of earlier results
+
+    @param[in] pCondition The condition
+    @param[in,out] pScratch The calling thread's working memory, which holds
+                            the memo
+    @return Returns 1 if the condition is always true, 0 if it is always
+            false, or -1 if it could not be shown to be constant
+*/
+int
+EvaluateCondition (
+    cexpr_t* pCondition,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    PREDICATE_PROGRAM* pProgram = &pScratch->predicate;
+    PREDICATE_MEMO_ENTRY entry;
+
+    if (!CompilePredicate(pCondition, pProgram, &pScratch->predicateAtoms))
+    {
+        return -1;
+    }
+
+    entry.qwHash = HashPredicate(
+        pProgram);
+
+    //
+    // Look the condition up by its structural hash, comparing the programs
+    // to rule out collisions
+    //
+    PREDICATE_MEMO_ENTRY* pEntry = std::lower_bound(
+        pScratch->predicateMemo.begin(),
+        pScratch->predicateMemo.end(),
+        entry,
+        ComparePredicateMemoEntries);
+    for (; (pEntry != pScratch->predicateMemo.end()) &&
+        (pEntry->qwHash == entry.qwHash); pEntry++)
+    {
+        if ((pEntry->nOps == pProgram->ops.size()) &&
+            (pEntry->fNegate == pProgram->fNegate) &&
+            (pEntry->qwExactMask == pProgram->qwExactMask) &&
+            (0 == memcmp(
+                &pScratch->predicateMemoOps[pEntry->nFirstOp],
+                pProgram->ops.begin(),
+                pEntry->nOps * sizeof(PREDICATE_OP))))
+        {
+            return pEntry->nResult;
+        }
+    }
+
+    entry.nResult = EvaluatePredicate(
+        pProgram);
+
+    //
+    // Start over once the memo is full
+    //
+    if (pScratch->predicateMemo.size() >= CROWDDETOX_PREDICATE_MEMO_SIZE)
+    {
+        pScratch->predicateMemo.qclear();
+        pScratch->predicateMemoOps.qclear();
+    }
+
+    entry.nFirstOp = (uint32)pScratch->predicateMemoOps.size();
+    entry.nOps = (uint32)pProgram->ops.size();
+    entry.fNegate = pProgram->fNegate;
+    entry.qwExactMask = pProgram->qwExactMask;
+    for (size_t i = 0; i < pProgram->ops.size(); i++)
+    {
+        pScratch->predicateMemoOps.push_back(
+            pProgram->ops[i]);
+    }
+    pScratch->predicateMemo.insert(
+        std::upper_bound(
+            pScratch->predicateMemo.begin(),
+            pScratch->predicateMemo.end(),
+            entry,
+            ComparePredicateMemoEntries),
+        entry);
+
+    return entry.nResult;
+}
+
+/*! 
+    @brief Removes the dead arms of ifs and whiles whose conditions are
+           constant (opaque predicates)
+    @details Runs before the legitimacy analysis, which would otherwise keep
+             a junk arm alive as soon as its if statement is legitimate. An
+             if statement with a constant condition is replaced by the arm
+             that always runs; a while loop whose condition is always false
+             is removed, and one whose condition is always true gets the
+             constant condition of an endless loop. Nothing that contains
+             a goto label is removed.
+
+    @param[in] pFunction The function whose ctree is folded
+    @param[in,out] pScratch The calling thread's working memory
+    @param[out] pnItems Receives the number of ctree items before folding
+    @return Returns the number of conditions folded
+*/
+uint32
+FoldOpaquePredicates (
+    cfunc_t* pFunction,
+    DETOX_SCRATCH* pScratch,
+    uint32* pnItems
+    )
+{
+    uint32 nFolded = 0;
+
+    //
+    // This structure is derived from ctree_visitor_t. It is used to count
+    // the ctree items and to collect the ifs and whiles, in visiting order.
+    //
+    struct ida_local CONDITIONAL_VISITOR : public ctree_visitor_t
+    {
+        uint32 nItems;
+        qvector<cinsn_t*>* pVectorConditionals;
+
+        int
+        idaapi
+        visit_insn (
+            cinsn_t* pInstruction
+            )
+        {
+            nItems++;
+            if ((pInstruction->op == cit_if) ||
+                (pInstruction->op == cit_while))
+            {
+                pVectorConditionals->push_back(
+                    pInstruction);
+            }
+            return 0;
+        }
+
+        int
+        idaapi
+        visit_expr (
+            cexpr_t* pExpression
+            )
+        {
+            UNUSED(pExpression);
+            nItems++;
+            return 0;
+        }
+
+        CONDITIONAL_VISITOR(qvector<cinsn_t*>* _pVectorConditionals):
+            ctree_visitor_t(CV_FAST),
+            nItems(0),
+            pVectorConditionals(_pVectorConditionals)
+        {
+        }
+    };
+
+    pScratch->conditionals.qclear();
+    CONDITIONAL_VISITOR cv(&pScratch->conditionals);
+    cv.apply_to(
+        &pFunction->body,
+        NULL);
+    *pnItems = cv.nItems;
+
+    //
+    // Fold the innermost conditionals first, so that no conditional is
+    // visited after an enclosing one has been rewritten
+    //
+    for (size_t i = pScratch->conditionals.size(); i > 0; i--)
+    {
+        cinsn_t* pInstruction = pScratch->conditionals[i - 1];
+        cinsn_t* pKept = NULL;
+        cinsn_t* pDropped = NULL;
+        int nLabel = pInstruction->label_num;
+
+        if (pInstruction->op == cit_if)
+        {
+            int nResult = EvaluateCondition(
+                &pInstruction->cif->expr,
+                pScratch);
+            if (nResult < 0)
+            {
+                continue;
+            }
+            pKept = nResult ?
+                pInstruction->cif->ithen : pInstruction->cif->ielse;
+            pDropped = nResult ?
+                pInstruction->cif->ielse : pInstruction->cif->ithen;
+        }
+        else
+        {
+            cexpr_t* pCondition = &pInstruction->cwhile->expr;
+
+            if (pCondition->op == cot_num)
+            {
+                continue;
+            }
+
+            int nResult = EvaluateCondition(
+                pCondition,
+                pScratch);
+            if (nResult < 0)
+            {
+                continue;
+            }
+
+            //
+            // An always-true condition becomes the constant of an endless
+            // loop, "while ( 1 )"; nothing is dropped
+            //
+            if (nResult > 0)
+            {
+                size_t cbCondition = get_type_size0(
+                    idati,
+                    pCondition->type.u_str());
+                if ((cbCondition == BADSIZE) || (cbCondition == 0) ||
+                    (cbCondition > sizeof(uint64)))
+                {
+                    continue;
+                }
+
+                pCondition->put_number(
+                    pFunction,
+                    1,
+                    (int)cbCondition);
+                nFolded++;
+                continue;
+            }
+            pDropped = pInstruction->cwhile->body;
+        }
+
+        //
+        // Gotos may lead into the dropped code, and the conditional's own
+        // label can only be kept if there is a kept arm without one to put
+        // it on (an empty statement would be erased along with the label)
+        //
+        if (((pDropped != NULL) && pDropped->contains_label()) ||
+            ((nLabel != -1) &&
+                ((pKept == NULL) || (pKept->label_num != -1))))
+        {
+            continue;
+        }
+
+        if (pKept != NULL)
+        {
+            if (pKept == pInstruction->cif->ithen)
+            {
+                pInstruction->cif->ithen = NULL;
+            }
+            else
+            {
+                pInstruction->cif->ielse = NULL;
+            }
+            pInstruction->replace_by(
+                pKept);
+        }
+        else
+        {
+            pInstruction->cleanup();
+        }
+        if (nLabel != -1)
+        {
+            pInstruction->label_num = nLabel;
+        }
+
+        nFolded++;
+    }
+
+    return nFolded;
+}
+
+/*! 
+    @brief Determines whether a ctree operator is one of the integer
+           operators that SimplifyMbaExpressions() rewrites
+
+    @param[in] op The operator
+    @return Returns true if the operator is handled
+*/
+bool
+IsMbaOperator (
+    ctype_t op
+    )
+{
+    switch (op)
+    {
+    case cot_add:
+    case cot_sub:
+    case cot_mul:
+    case cot_band:
+    case cot_bor:
+    case cot_xor:
+    case cot_bnot:
+    case cot_neg:
+    case cot_shl:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*! 
+    @brief Returns the node that represents the given operation in the
+           expression DAG, creating it if it does not exist yet
+    @details Operations on constants are folded, and the operands of
+             commutative operations are put in a canonical order, so that
+             equal subexpressions always map to the same node.
+
+    @param[in,out] pScratch The calling thread's working memory, which holds
+                            the DAG
+    @param[in] bOp The PREDICATE_OP_* operation
+    @param[in] nLeft The first operand's node, or MBA_NONE
+    @param[in] nRight The second operand's node, or MBA_NONE
+    @param[in] qwValue The constant for PREDICATE_OP_CONST, or the leaf index
+                       for PREDICATE_OP_ATOM
+    @return Returns the node's index
+*/
+uint32
+MakeMbaNode (
+    DETOX_SCRATCH* pScratch,
+    uint8 bOp,
+    uint32 nLeft,
+    uint32 nRight,
+    uint64 qwValue
+    )
+{
+    qvector<MBA_NODE>* pVectorNodes = &pScratch->mbaNodes;
+    qvector<uint32>* pVectorTable = &pScratch->mbaTable;
+
+    //
+    // Fold operations on constants
+    //
+    if ((nLeft != MBA_NONE) &&
+        (pVectorNodes->at(nLeft).bOp == PREDICATE_OP_CONST) &&
+        ((nRight == MBA_NONE) ||
+        (pVectorNodes->at(nRight).bOp == PREDICATE_OP_CONST)))
+    {
+        uint64 qwLeft = pVectorNodes->at(nLeft).qwValue;
+        uint64 qwRight = (nRight == MBA_NONE) ?
+            0 : pVectorNodes->at(nRight).qwValue;
+
+        switch (bOp)
+        {
+        case PREDICATE_OP_ADD: qwValue = qwLeft + qwRight; break;
+        case PREDICATE_OP_SUB: qwValue = qwLeft - qwRight; break;
+        case PREDICATE_OP_MUL: qwValue = qwLeft * qwRight; break;
+        case PREDICATE_OP_AND: qwValue = qwLeft & qwRight; break;
+        case PREDICATE_OP_OR: qwValue = qwLeft | qwRight; break;
+        case PREDICATE_OP_XOR: qwValue = qwLeft ^ qwRight; break;
+        case PREDICATE_OP_NEG: qwValue = 0 - qwLeft; break;
+        case PREDICATE_OP_NOT: qwValue = ~qwLeft; break;
+        default: break;
+        }
+
+        bOp = PREDICATE_OP_CONST;
+        nLeft = MBA_NONE;
+        nRight = MBA_NONE;
+    }
+    if (bOp == PREDICATE_OP_CONST)
+    {
+        qwValue &= pScratch->qwMbaMask;
+    }
+
+    if ((nRight != MBA_NONE) && (nLeft > nRight) &&
+        (bOp != PREDICATE_OP_SUB))
+    {
+        std::swap(
+            nLeft,
+            nRight);
+    }
+
+    //
+    // Grow the hash table once it is half full
+    //
+    if (pVectorNodes->size() * 2 >= pVectorTable->size())
+    {
+        pVectorTable->qclear();
+        pVectorTable->resize(
+            qmax(pVectorNodes->size() * 4, (size_t)64),
+            MBA_NONE);
+        for (uint32 i = 0; i < pVectorNodes->size(); i++)
+        {
+            size_t nSlot = (size_t)pVectorNodes->at(i).qwHash;
+            for (nSlot &= pVectorTable->size() - 1;
+                pVectorTable->at(nSlot) != MBA_NONE;
+                nSlot = (nSlot + 1) & (pVectorTable->size() - 1))
+            {
+            }
+            pVectorTable->at(nSlot) = i;
+        }
+    }
+
+    //
+    // Look the node up, or append it
+    //
+    uint64 qwHash = ((uint64)bOp * 0x9E3779B97F4A7C15ULL) ^
+        ((uint64)nLeft * 0xC2B2AE3D27D4EB4FULL) ^
+        ((uint64)nRight * 0x165667B19E3779F9ULL) ^
+        (qwValue * 0x27D4EB2F165667C5ULL);
+    qwHash ^= qwHash >> 29;
+
+    size_t nSlot = (size_t)qwHash & (pVectorTable->size() - 1);
+    for (; pVectorTable->at(nSlot) != MBA_NONE;
+        nSlot = (nSlot + 1) & (pVectorTable->size() - 1))
+    {
+        const MBA_NODE& node = pVectorNodes->at(pVectorTable->at(nSlot));
+        if ((node.bOp == bOp) && (node.nLeft == nLeft) &&
+            (node.nRight == nRight) && (node.qwValue == qwValue))
+        {
+            return pVectorTable->at(nSlot);
+        }
+    }
+
+    MBA_NODE node;
+    node.bOp = bOp;
+    node.nLeft = nLeft;
+    node.nRight = nRight;
+    node.nSimplified = MBA_NONE;
+    node.qwValue = qwValue;
+    node.qwHash = qwHash;
+
+    pVectorTable->at(nSlot) = (uint32)pVectorNodes->size();
+    pVectorNodes->push_back(
+        node);
+
+    return pVectorTable->at(nSlot);
+}
+
+/*! 
+    @brief Adds an expression to the DAG
+    @details Integer operations of the expression's width become operation
+             nodes; left shifts by a constant become multiplications. Every
+             other subexpression becomes a leaf; equal leaves share one
+             node.
+
+    @param[in] pExpression The expression
+    @param[in] nSize The width, in bytes, of the expression being simplified
+    @param[in,out] pScratch The calling thread's working memory, which holds
+                            the DAG
+    @param[in,out] pnItems Receives the number of nodes of the expression,
+                           counting each leaf as one
+    @return Returns the expression's node, or MBA_NONE if the expression is
+            too large
+*/
+uint32
+AddMbaExpression (
+    cexpr_t* pExpression,
+    size_t nSize,
+    DETOX_SCRATCH* pScratch,
+    uint32* pnItems
+    )
+{
+    uint32 nLeft = MBA_NONE;
+    uint32 nRight = MBA_NONE;
+    uint8 bOp;
+
+    if (pScratch->mbaNodes.size() >= CROWDDETOX_MBA_MAX_NODES)
+    {
+        return MBA_NONE;
+    }
+    (*pnItems)++;
+
+    if (pExpression->op == cot_num)
+    {
+        return MakeMbaNode(
+            pScratch,
+            PREDICATE_OP_CONST,
+            MBA_NONE,
+            MBA_NONE,
+            pExpression->numval());
+    }
+
+    if (IsMbaOperator(pExpression->op) &&
+        is_type_int(*pExpression->type.u_str()) &&
+        (nSize == get_type_size0(idati, pExpression->type.u_str())) &&
+        ((pExpression->op != cot_shl) || (pExpression->y->op == cot_num)))
+    {
+        nLeft = AddMbaExpression(
+            pExpression->x,
+            nSize,
+            pScratch,
+            pnItems);
+        if (nLeft == MBA_NONE)
+        {
+            return MBA_NONE;
+        }
+
+        switch (pExpression->op)
+        {
+        case cot_bnot:
+            return MakeMbaNode(
+                pScratch,
+                PREDICATE_OP_NOT,
+                nLeft,
+                MBA_NONE,
+                0);
+
+        case cot_neg:
+            return MakeMbaNode(
+                pScratch,
+                PREDICATE_OP_NEG,
+                nLeft,
+                MBA_NONE,
+                0);
+
+        case cot_shl:
+            (*pnItems)++;
+            nRight = MakeMbaNode(
+                pScratch,
+                PREDICATE_OP_CONST,
+                MBA_NONE,
+                MBA_NONE,
+                (pExpression->y->numval() < 64) ?
+                    (uint64)1 << pExpression->y->numval() : 0);
+            return MakeMbaNode(
+                pScratch,
+                PREDICATE_OP_MUL,
+                nLeft,
+                nRight,
+                0);
+
+        default:
+            break;
+        }
+
+        nRight = AddMbaExpression(
+            pExpression->y,
+            nSize,
+            pScratch,
+            pnItems);
+        if (nRight == MBA_NONE)
+        {
+            return MBA_NONE;
+        }
+
+        bOp = (pExpression->op == cot_add) ? PREDICATE_OP_ADD :
+            (pExpression->op == cot_sub) ? PREDICATE_OP_SUB :
+            (pExpression->op == cot_mul) ? PREDICATE_OP_MUL :
+            (pExpression->op == cot_band) ? PREDICATE_OP_AND :
+            (pExpression->op == cot_bor) ? PREDICATE_OP_OR : PREDICATE_OP_XOR;
+
+        return MakeMbaNode(
+            pScratch,
+            bOp,
+            nLeft,
+            nRight,
+            0);
+    }
+
+    //
+    // Anything else is a leaf
+    //
+    size_t i = 0;
+    while ((i < pScratch->mbaLeaves.size()) &&
+        !pScratch->mbaLeaves[i]->equal_effect(*pExpression))
+    {
+        i++;
+    }
+    if (i == pScratch->mbaLeaves.size())
+    {
+        pScratch->mbaLeaves.push_back(
+            pExpression);
+    }
+
+    return MakeMbaNode(
+        pScratch,
+        PREDICATE_OP_ATOM,
+        MBA_NONE,
+        MBA_NONE,
+        i);
+}
+
+/*! 
+    @brief Translates a g_aMbaRules token into a PREDICATE_OP_* operation
+
+    @param[in] cToken The token
+    @return Returns the operation, or PREDICATE_OP_ATOM if the token is a
+            variable or a constant
+*/
+uint8
+GetMbaRuleOperation (
+    char cToken
+    )
+{
+    switch (cToken)
+    {
+    case '+': return PREDICATE_OP_ADD;
+    case '-': return PREDICATE_OP_SUB;
+    case '*': return PREDICATE_OP_MUL;
+    case '&': return PREDICATE_OP_AND;
+    case '|': return PREDICATE_OP_OR;
+    case '^': return PREDICATE_OP_XOR;
+    case '~': return PREDICATE_OP_NOT;
+    case 'n': return PREDICATE_OP_NEG;
+    default: return PREDICATE_OP_ATOM;
+    }
+}
+
+/*! 
+    @brief Skips one operand of a g_aMbaRules pattern
+
+    @param[in] szPattern The operand
+    @return Returns a pointer to the token after the operand
+*/
+const char*
+SkipMbaRuleOperand (
+    const char* szPattern
+    )
+{
+    uint8 bOp = GetMbaRuleOperation(
+        *szPattern);
+
+    if (bOp == PREDICATE_OP_ATOM)
+    {
+        return szPattern + 1;
+    }
+    szPattern = SkipMbaRuleOperand(
+        szPattern + 1);
+    if ((bOp == PREDICATE_OP_NOT) || (bOp == PREDICATE_OP_NEG))
+    {
+        return szPattern;
+    }
+
+    return SkipMbaRuleOperand(
+        szPattern);
+}
+
+/*! 
+    @brief Matches a g_aMbaRules pattern against a DAG node
+    @details Commutative operations match with their operands in either
+             order.
+
+    @param[in] szPattern The pattern
+    @param[in] nNode The node
+    @param[in] pScratch The calling thread's working memory, which holds the
+                        DAG
+    @param[in,out] anBindings The nodes bound to the variables 'x' and 'y',
+                              or MBA_NONE
+    @return Returns a pointer to the token after the pattern on success,
+            returns NULL if the node does not match
+*/
+const char*
+MatchMbaRule (
+    const char* szPattern,
+    uint32 nNode,
+    const DETOX_SCRATCH* pScratch,
+    uint32* anBindings
+    )
+{
+    const MBA_NODE& node = pScratch->mbaNodes[nNode];
+    uint8 bOp = GetMbaRuleOperation(
+        *szPattern);
+
+    if ((*szPattern == 'x') || (*szPattern == 'y'))
+    {
+        uint32* pnBinding = &anBindings[*szPattern - 'x'];
+        if (*pnBinding == MBA_NONE)
+        {
+            *pnBinding = nNode;
+        }
+        return (*pnBinding == nNode) ? szPattern + 1 : NULL;
+    }
+    if (bOp == PREDICATE_OP_ATOM)
+    {
+        uint64 qwValue = (*szPattern == 'm') ?
+            pScratch->qwMbaMask : (uint64)(*szPattern - '0');
+        return ((node.bOp == PREDICATE_OP_CONST) &&
+            (node.qwValue == qwValue)) ? szPattern + 1 : NULL;
+    }
+    if (node.bOp != bOp)
+    {
+        return NULL;
+    }
+    if ((bOp == PREDICATE_OP_NOT) || (bOp == PREDICATE_OP_NEG))
+    {
+        return MatchMbaRule(
+            szPattern + 1,
+            node.nLeft,
+            pScratch,
+            anBindings);
+    }
+
+    uint32 anSavedBindings[2] = { anBindings[0], anBindings[1] };
+    const char* p = MatchMbaRule(
+        szPattern + 1,
+        node.nLeft,
+        pScratch,
+        anBindings);
+    if (p != NULL)
+    {
+        p = MatchMbaRule(
+            p,
+            node.nRight,
+            pScratch,
+            anBindings);
+        if ((p != NULL) || (bOp == PREDICATE_OP_SUB))
+        {
+            return p;
+        }
+    }
+    else if (bOp == PREDICATE_OP_SUB)
+    {
+        return NULL;
+    }
+
+    //
+    // Try the commuted operands
+    //
+    anBindings[0] = anSavedBindings[0];
+    anBindings[1] = anSavedBindings[1];
+    p = MatchMbaRule(
+        szPattern + 1,
+        node.nRight,
+        pScratch,
+        anBindings);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    return MatchMbaRule(
+        p,
+        node.nLeft,
+        pScratch,
+        anBindings);
+}
+
+/*! 
+    @brief Builds the DAG node of a g_aMbaRules replacement
+
+    @param[in] szReplacement The replacement
+    @param[in] anBindings The nodes bound to the variables 'x' and 'y'
+    @param[in,out] pScratch The calling thread's working memory, which holds
+                            the DAG
+    @param[out] pnNode Receives the replacement's node
+    @return Returns a pointer to the token after the replacement
+*/
+const char*
+BuildMbaRuleReplacement (
+    const char* szReplacement,
+    const uint32* anBindings,
+    DETOX_SCRATCH* pScratch,
+    uint32* pnNode
+    )
+{
+    uint8 bOp = GetMbaRuleOperation(
+        *szReplacement);
+    uint32 nLeft = MBA_NONE;
+    uint32 nRight = MBA_NONE;
+
+    if ((*szReplacement == 'x') || (*szReplacement == 'y'))
+    {
+        *pnNode = anBindings[*szReplacement - 'x'];
+        return szReplacement + 1;
+    }
+    if (bOp == PREDICATE_OP_ATOM)
+    {
+        *pnNode = MakeMbaNode(
+            pScratch,
+            PREDICATE_OP_CONST,
+            MBA_NONE,
+            MBA_NONE,
+            (*szReplacement == 'm') ?
+                pScratch->qwMbaMask : (uint64)(*szReplacement - '0'));
+        return szReplacement + 1;
+    }
+
+    szReplacement = BuildMbaRuleReplacement(
+        szReplacement + 1,
+        anBindings,
+        pScratch,
+        &nLeft);
+    if ((bOp != PREDICATE_OP_NOT) && (bOp != PREDICATE_OP_NEG))
+    {
+        szReplacement = BuildMbaRuleReplacement(
+            szReplacement,
+            anBindings,
+            pScratch,
+            &nRight);
+    }
+
+    *pnNode = MakeMbaNode(
+        pScratch,
+        bOp,
+        nLeft,
+        nRight,
+        0);
+
+    return szReplacement;
+}
+
+/*! 
+    @brief Simplifies a DAG node
+    @details The node's operands are simplified first, then the first
+             matching rule of g_aMbaRules is applied, and the result is
+             simplified again. Every rule makes the expression smaller, so
+             this terminates. Results are memoized in the nodes, so shared
+             subexpressions are only simplified once.
+
+    @param[in] nNode The node
+    @param[in,out] pScratch The calling thread's working memory, which holds
+                            the DAG
+    @return Returns the simplified node
+*/
+uint32
+SimplifyMbaNode (
+    uint32 nNode,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    MBA_NODE node = pScratch->mbaNodes[nNode];
+    uint32 nResult = nNode;
+
+    if (node.nSimplified != MBA_NONE)
+    {
+        return node.nSimplified;
+    }
+
+    if (node.nLeft != MBA_NONE)
+    {
+        uint32 nLeft = SimplifyMbaNode(
+            node.nLeft,
+            pScratch);
+        uint32 nRight = (node.nRight == MBA_NONE) ?
+            MBA_NONE : SimplifyMbaNode(
+                node.nRight,
+                pScratch);
+
+        nResult = MakeMbaNode(
+            pScratch,
+            node.bOp,
+            nLeft,
+            nRight,
+            0);
+
+        //
+        // The rebuilt node may be one that has been simplified already
+        //
+        if ((nResult != nNode) &&
+            (pScratch->mbaNodes[nResult].nSimplified != MBA_NONE))
+        {
+            nResult = pScratch->mbaNodes[nResult].nSimplified;
+            pScratch->mbaNodes[nNode].nSimplified = nResult;
+            return nResult;
+        }
+
+        for (size_t i = 0; i < _countof(g_aMbaRules); i++)
+        {
+            uint32 anBindings[2] = { MBA_NONE, MBA_NONE };
+
+            if (NULL != MatchMbaRule(
+                g_aMbaRules[i].szPattern,
+                nResult,
+                pScratch,
+                anBindings))
+            {
+                BuildMbaRuleReplacement(
+                    g_aMbaRules[i].szReplacement,
+                    anBindings,
+                    pScratch,
+                    &nResult);
+                nResult = SimplifyMbaNode(
+                    nResult,
+                    pScratch);
+                break;
+            }
+        }
+    }
+
+    pScratch->mbaNodes[nNode].nSimplified = nResult;
+    pScratch->mbaNodes[nResult].nSimplified = nResult;
+
+    return nResult;
+}
+
+/*! 
+    @brief Counts the nodes of a DAG node's expression tree
+
+    @param[in] nNode The node
+    @param[in] pScratch The calling thread's working memory, which holds the
+                        DAG
+    @param[in] nLimit Counting stops once the count exceeds this limit
+    @return Returns the number of nodes, counting each leaf as one, or a
+            number above nLimit
+*/
+uint32
+CountMbaTree (
+    uint32 nNode,
+    const DETOX_SCRATCH* pScratch,
+    uint32 nLimit
+    )
+{
+    const MBA_NODE& node = pScratch->mbaNodes[nNode];
+    uint32 nCount = 1;
+
+    if ((node.nLeft != MBA_NONE) && (nCount <= nLimit))
+    {
+        nCount += CountMbaTree(
+            node.nLeft,
+            pScratch,
+            nLimit - nCount);
+    }
+    if ((node.nRight != MBA_NONE) && (nCount <= nLimit))
+    {
+        nCount += CountMbaTree(
+            node.nRight,
+            pScratch,
+            nLimit - nCount);
+    }
+
+    return nCount;
+}
+
+/*! 
+    @brief Builds the ctree expression of a DAG node
+
+    @param[in] nNode The node
+    @param[in] pRoot The expression being replaced, whose type and address
+                     the new operations take
+    @param[in] nSize The width, in bytes, of pRoot
+    @param[in] pFunction The function being simplified
+    @param[in] pScratch The calling thread's working memory, which holds the
+                        DAG
+    @return Returns the new expression; leaves are copies of the originals
+*/
+cexpr_t*
+BuildMbaExpression (
+    uint32 nNode,
+    const cexpr_t* pRoot,
+    size_t nSize,
+    cfunc_t* pFunction,
+    const DETOX_SCRATCH* pScratch
+    )
+{
+    const MBA_NODE& node = pScratch->mbaNodes[nNode];
+    cexpr_t* pExpression;
+
+    switch (node.bOp)
+    {
+    case PREDICATE_OP_ATOM:
+        return new cexpr_t(
+            *pScratch->mbaLeaves[(size_t)node.qwValue]);
+
+    case PREDICATE_OP_CONST:
+        pExpression = new cexpr_t();
+        pExpression->put_number(
+            pFunction,
+            node.qwValue,
+            (int)nSize);
+        pExpression->ea = pRoot->ea;
+        return pExpression;
+
+    case PREDICATE_OP_NOT:
+    case PREDICATE_OP_NEG:
+        pExpression = new cexpr_t(
+            (node.bOp == PREDICATE_OP_NOT) ? cot_bnot : cot_neg,
+            BuildMbaExpression(
+                node.nLeft,
+                pRoot,
+                nSize,
+                pFunction,
+                pScratch));
+        break;
+
+    default:
+        pExpression = new cexpr_t(
+            (node.bOp == PREDICATE_OP_ADD) ? cot_add :
+            (node.bOp == PREDICATE_OP_SUB) ? cot_sub :
+            (node.bOp == PREDICATE_OP_MUL) ? cot_mul :
+            (node.bOp == PREDICATE_OP_AND) ? cot_band :
+            (node.bOp == PREDICATE_OP_OR) ? cot_bor : cot_xor,
+            BuildMbaExpression(
+                node.nLeft,
+                pRoot,
+                nSize,
+                pFunction,
+                pScratch),
+            BuildMbaExpression(
+                node.nRight,
+                pRoot,
+                nSize,
+                pFunction,
+                pScratch));
+        break;
+    }
+
+    pExpression->type = pRoot->type;
+    pExpression->ea = pRoot->ea;
+
+    return pExpression;
+}
+
+/*! 
+    @brief Rewrites mixed boolean-arithmetic (MBA) expressions into simpler
+           equivalents
+    @details Runs before the legitimacy analysis, so that obfuscated
+             expressions that feed legitimate code are reduced rather than
+             kept whole. Each maximal integer expression without side effects
+             is hash-consed into a DAG, simplified with the rules of
+             g_aMbaRules, and replaced if the result is smaller.
+
+    @param[in] pFunction The function whose ctree is simplified
+    @param[in,out] pScratch The calling thread's working memory
+    @return Returns the number of expressions rewritten
+*/
+uint32
+SimplifyMbaExpressions (
+    cfunc_t* pFunction,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    uint32 nSimplified = 0;
+
+    //
+    // This structure is derived from ctree_visitor_t. It is used to collect
+    // the MBA operations whose parents are not MBA operations, in visiting
+    // order.
+    //
+    struct ida_local MBA_ROOT_VISITOR : public ctree_visitor_t
+    {
+        qvector<cexpr_t*>* pVectorRoots;
+
+        int
+        idaapi
+        visit_expr (
+            cexpr_t* pExpression
+            )
+        {
+            citem_t* pParent = parents.empty() ? NULL : parents.back();
+
+            if (IsMbaOperator(pExpression->op) &&
+                ((pParent == NULL) || !pParent->is_expr() ||
+                !IsMbaOperator(pParent->op)))
+            {
+                pVectorRoots->push_back(
+                    pExpression);
+            }
+            return 0;
+        }
+
+        MBA_ROOT_VISITOR(qvector<cexpr_t*>* _pVectorRoots):
+            ctree_visitor_t(CV_PARENTS),
+            pVectorRoots(_pVectorRoots)
+        {
+        }
+    };
+
+    pScratch->mbaRoots.qclear();
+    MBA_ROOT_VISITOR rv(&pScratch->mbaRoots);
+    rv.apply_to(
+        &pFunction->body,
+        NULL);
+
+    //
+    // Rewrite the innermost roots first; a rewrite replaces a root's
+    // contents in place, so enclosing roots stay valid
+    //
+    for (size_t i = pScratch->mbaRoots.size(); i > 0; i--)
+    {
+        cexpr_t* pRoot = pScratch->mbaRoots[i - 1];
+        uint32 nItems = 0;
+
+        if (!is_type_int(*pRoot->type.u_str()) || pRoot->has_side_effects())
+        {
+            continue;
+        }
+        size_t nSize = get_type_size0(
+            idati,
+            pRoot->type.u_str());
+        if ((nSize == BADSIZE) || (nSize == 0) || (nSize > 8))
+        {
+            continue;
+        }
+
+        pScratch->qwMbaMask = (nSize == 8) ?
+            ~(uint64)0 : ((uint64)1 << (nSize * 8)) - 1;
+        pScratch->mbaNodes.qclear();
+        pScratch->mbaTable.qclear();
+        pScratch->mbaLeaves.qclear();
+
+        uint32 nNode = AddMbaExpression(
+            pRoot,
+            nSize,
+            pScratch,
+            &nItems);
+        if (nNode == MBA_NONE)
+        {
+            continue;
+        }
+
+        nNode = SimplifyMbaNode(
+            nNode,
+            pScratch);
+        if (CountMbaTree(nNode, pScratch, nItems) >= nItems)
+        {
+            continue;
+        }
+
+        pRoot->replace_by(
+            BuildMbaExpression(
+                nNode,
+                pRoot,
+                nSize,
+                pFunction,
+                pScratch));
+        nSimplified++;
+    }
+
+    return nSimplified;
+}
+
+/*! 
+    @brief Parses one junk signature and adds it to a SIGNATURE_SET
+    @details A signature is a list of tokens separated by blanks, one per
+             ctree item, in the order in which ctree_visitor_t visits the
+             items. Each token is the name of an item type from
+             g_aSignatureTokenNames, optionally followed by ':' and an
+             argument: for "var" and "num", a lowercase letter binds the
+             item to a variable that must match the same local variable or
+             value wherever it appears; for "num", a number must match the
+             constant's value; for "helper", a name must match the helper's
+             name. The signature must cover one or more whole, consecutive
+             sibling statements. Statement tokens prefixed with '!' mark the
+             statements that are junk; without any, all of them are.
+
+    @param[in] szSignature The signature
+    @param[in,out] pSet The signature set
+    @return Returns true on success, returns false if the signature is
+            invalid
+*/
+bool
+ParseJunkSignature (
+    const char* szSignature,
+    SIGNATURE_SET* pSet
+    )
+{
+    JUNK_SIGNATURE signature;
+    bool fJunkMarked = false;
+
+    signature.nFirstToken = (uint32)pSet->tokens.size();
+    signature.nTokens = 0;
+    signature.nNext = SIGNATURE_NONE;
+
+    for (const char* p = szSignature; ; )
+    {
+        SIGNATURE_TOKEN token;
+        char szName[MAXSTR];
+        size_t nLength = 0;
+
+        while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+        {
+            p++;
+        }
+        if ((*p == '\0') || (*p == '#'))
+        {
+            break;
+        }
+
+        token.bFlags = 0;
+        token.bMatch = SIGNATURE_MATCH_ANY;
+        token.nHelper = SIGNATURE_NONE;
+        token.qwValue = 0;
+        if (*p == '!')
+        {
+            token.bFlags |= SIGNATURE_TOKEN_JUNK;
+            fJunkMarked = true;
+            p++;
+        }
+
+        //
+        // Look the item type up
+        //
+        while ((*p != '\0') && (*p != ':') && (*p != ' ') && (*p != '\t') &&
+            (*p != '\r') && (*p != '\n') && (nLength < _countof(szName) - 1))
+        {
+            szName[nLength++] = *p++;
+        }
+        szName[nLength] = '\0';
+
+        size_t i = 0;
+        while ((i < _countof(g_aSignatureTokenNames)) &&
+            (0 != strcmp(szName, g_aSignatureTokenNames[i].szName)))
+        {
+            i++;
+        }
+        if (i == _countof(g_aSignatureTokenNames))
+        {
+            msg(
+                "CrowdDetox error: Unknown signature token \"%s\".\n",
+                szName);
+            pSet->tokens.resize(
+                signature.nFirstToken);
+            return false;
+        }
+        token.bOp = (uint8)g_aSignatureTokenNames[i].op;
+
+        //
+        // Parse the argument, if any
+        //
+        if (*p == ':')
+        {
+            nLength = 0;
+            for (p++; (*p != '\0') && (*p != ' ') && (*p != '\t') &&
+                (*p != '\r') && (*p != '\n') &&
+                (nLength < _countof(szName) - 1); p++)
+            {
+                szName[nLength++] = *p;
+            }
+            szName[nLength] = '\0';
+
+            if (((token.bOp == cot_var) || (token.bOp == cot_num)) &&
+                (nLength == 1) && (szName[0] >= 'a') && (szName[0] <= 'z'))
+            {
+                token.bMatch = SIGNATURE_MATCH_BINDING;
+                token.qwValue = szName[0] - 'a';
+            }
+            else if ((token.bOp == cot_num) && (nLength != 0))
+            {
+                char* pEnd;
+                token.bMatch = SIGNATURE_MATCH_VALUE;
+                token.qwValue = (szName[0] == '-') ?
+                    (uint64)strtoll(szName, &pEnd, 0) :
+                    (uint64)strtoull(szName, &pEnd, 0);
+                if (*pEnd != '\0')
+                {
+                    nLength = 0;
+                }
+            }
+            else if ((token.bOp == cot_helper) && (nLength != 0))
+            {
+                token.bMatch = SIGNATURE_MATCH_HELPER;
+                token.nHelper = (uint32)pSet->helperNames.size();
+                pSet->helperNames.push_back(
+                    qstring(szName));
+            }
+            else
+            {
+                nLength = 0;
+            }
+
+            if (nLength == 0)
+            {
+                msg(
+                    "CrowdDetox error: Invalid signature token argument in "
+                    "\"%s\".\n",
+                    szSignature);
+                pSet->tokens.resize(
+                    signature.nFirstToken);
+                return false;
+            }
+        }
+
+        pSet->tokens.push_back(
+            token);
+        signature.nTokens++;
+    }
+
+    //
+    // Only whole statements are ever removed
+    //
+    if (signature.nTokens == 0)
+    {
+        return true;
+    }
+    if (pSet->tokens[signature.nFirstToken].bOp <= cot_last)
+    {
+        msg(
+            "CrowdDetox error: Signature \"%s\" does not start with a "
+            "statement.\n",
+            szSignature);
+        pSet->tokens.resize(
+            signature.nFirstToken);
+        return false;
+    }
+
+    if (!fJunkMarked)
+    {
+        for (uint32 i = 0; i < signature.nTokens; i++)
+        {
+            SIGNATURE_TOKEN* pToken = &pSet->tokens[signature.nFirstToken + i];
+            if (pToken->bOp > cot_last)
+            {
+                pToken->bFlags |= SIGNATURE_TOKEN_JUNK;
+            }
+        }
+    }
+
+    pSet->signatures.push_back(
+        signature);
+
+    return true;
+}
+
+/*! 
+    @brief Builds the Aho-Corasick automaton of a SIGNATURE_SET
+    @details The signatures' item types are inserted into a trie, whose
+             missing transitions are then filled in from the failure links,
+             so that matching takes exactly one table lookup per ctree item.
+
+    @param[in,out] pSet The signature set
+*/
+void
+BuildSignatureAutomaton (
+    SIGNATURE_SET* pSet
+    )
+{
+    qvector<uint32> failureLinks;
+    qvector<uint32> queue;
+
+    pSet->transitions.qclear();
+    pSet->outputs.qclear();
+    pSet->outputLinks.qclear();
+
+    pSet->transitions.resize(
+        CROWDDETOX_SIGNATURE_ALPHABET,
+        SIGNATURE_NONE);
+    pSet->outputs.push_back(
+        SIGNATURE_NONE);
+
+    //
+    // Build the trie
+    //
+    for (uint32 i = 0; i < pSet->signatures.size(); i++)
+    {
+        JUNK_SIGNATURE* pSignature = &pSet->signatures[i];
+        uint32 nState = 0;
+
+        for (uint32 j = 0; j < pSignature->nTokens; j++)
+        {
+            uint32* pnNext = &pSet->transitions[nState *
+                CROWDDETOX_SIGNATURE_ALPHABET +
+                pSet->tokens[pSignature->nFirstToken + j].bOp];
+            if (*pnNext == SIGNATURE_NONE)
+            {
+                *pnNext = (uint32)pSet->outputs.size();
+                pSet->transitions.resize(
+                    pSet->transitions.size() + CROWDDETOX_SIGNATURE_ALPHABET,
+                    SIGNATURE_NONE);
+                pSet->outputs.push_back(
+                    SIGNATURE_NONE);
+
+                //
+                // The transitions vector may have moved
+                //
+                pnNext = &pSet->transitions[nState *
+                    CROWDDETOX_SIGNATURE_ALPHABET +
+                    pSet->tokens[pSignature->nFirstToken + j].bOp];
+            }
+            nState = *pnNext;
+        }
+
+        pSignature->nNext = pSet->outputs[nState];
+        pSet->outputs[nState] = i;
+    }
+
+    //
+    // Compute the failure and output links breadth-first, completing the
+    // transitions along the way
+    //
+    failureLinks.resize(
+        pSet->outputs.size(),
+        0);
+    pSet->outputLinks.resize(
+        pSet->outputs.size(),
+        SIGNATURE_NONE);
+
+    queue.push_back(
+        0);
+    for (size_t nHead = 0; nHead < queue.size(); nHead++)
+    {
+        uint32 nState = queue[nHead];
+
+        for (uint32 c = 0; c < CROWDDETOX_SIGNATURE_ALPHABET; c++)
+        {
+            uint32* pnNext = &pSet->transitions[nState *
+                CROWDDETOX_SIGNATURE_ALPHABET + c];
+
+            if (*pnNext == SIGNATURE_NONE)
+            {
+                *pnNext = (nState == 0) ? 0 : pSet->transitions[
+                    failureLinks[nState] * CROWDDETOX_SIGNATURE_ALPHABET + c];
+                continue;
+            }
+
+            uint32 nFailure = (nState == 0) ? 0 : pSet->transitions[
+                failureLinks[nState] * CROWDDETOX_SIGNATURE_ALPHABET + c];
+            failureLinks[*pnNext] = nFailure;
+            pSet->outputLinks[*pnNext] =
+                (pSet->outputs[nFailure] != SIGNATURE_NONE) ?
+                    nFailure : pSet->outputLinks[nFailure];
+            queue.push_back(
+                *pnNext);
+        }
+    }
+}
+
+/*! 
+    @brief Loads the junk signatures used by MatchJunkSignatures()
+    @details Reads one signature per line (see ParseJunkSignature()); empty
+             lines and lines starting with '#' are ignored. Without a file,
+             the built-in g_aszDefaultJunkSignatures are loaded. Must not be
+             called while functions are being detoxed.
+
+    @param[in] szPath The path of the signature file, or NULL
+    @return Returns true on success, returns false on error, in which case
+            the built-in signatures are loaded
+*/
+bool
+LoadJunkSignatures (
+    const char* szPath
+    )
+{
+    bool fSuccess = true;
+
+    g_junkSignatures.tokens.qclear();
+    g_junkSignatures.signatures.qclear();
+    g_junkSignatures.helperNames.clear();
+
+    if ((szPath != NULL) && (*szPath != '\0'))
+    {
+        FILE* pSignatureFile = qfopen(
+            szPath,
+            "r");
+        if (pSignatureFile == NULL)
+        {
+            msg(
+                "CrowdDetox error: Cannot open signature file \"%s\".\n",
+                szPath);
+            fSuccess = false;
+        }
+        else
+        {
+            char szLine[MAXSTR];
+            while (fSuccess &&
+                (NULL != qfgets(szLine, sizeof(szLine), pSignatureFile)))
+            {
+                fSuccess = ParseJunkSignature(
+                    szLine,
+                    &g_junkSignatures);
+            }
+            qfclose(
+                pSignatureFile);
+        }
+    }
+
+    if (!fSuccess || (szPath == NULL) || (*szPath == '\0'))
+    {
+        g_junkSignatures.tokens.qclear();
+        g_junkSignatures.signatures.qclear();
+        g_junkSignatures.helperNames.clear();
+        for (size_t i = 0; i < _countof(g_aszDefaultJunkSignatures); i++)
+        {
+            ParseJunkSignature(
+                g_aszDefaultJunkSignatures[i],
+                &g_junkSignatures);
+        }
+    }
+
+    BuildSignatureAutomaton(
+        &g_junkSignatures);
+
+    return fSuccess;
+}
+
+/*! 
+    @brief Checks the item types and arguments of one signature occurrence
+           and marks its junk statements
+
+    @param[in,out] pMirror The flattened function
+    @param[in] pSignature The signature
+    @param[in] nFirst The ordinal of the occurrence's first item
+    @return Returns true if the occurrence matched
+*/
+bool
+VerifyJunkSignature (
+    DETOX_MIRROR* pMirror,
+    const JUNK_SIGNATURE* pSignature,
+    uint32 nFirst
+    )
+{
+    const SIGNATURE_TOKEN* aTokens =
+        &g_junkSignatures.tokens[pSignature->nFirstToken];
+    MIRROR_ITEM* aItems = pMirror->items.begin();
+    uint64 aqwBindings[26];
+    uint32 dwBound = 0;
+
+    //
+    // The occurrence must consist of whole sibling statements
+    //
+    uint32 nLast = nFirst + pSignature->nTokens - 1;
+    uint32 n = nFirst;
+    while (n <= nLast)
+    {
+        if (aItems[n].nParent != aItems[nFirst].nParent)
+        {
+            return false;
+        }
+        n = aItems[n].nEnd;
+    }
+    if (n != nLast + 1)
+    {
+        return false;
+    }
+
+    //
+    // Several statements are only consecutive inside a block; the arms of
+    // an if are siblings too, but only one of them runs
+    //
+    if ((aItems[nFirst].nEnd <= nLast) &&
+        (aItems[aItems[nFirst].nParent].bOp != cit_block))
+    {
+        return false;
+    }
+
+    //
+    // A goto may only lead to the occurrence's first statement; one that
+    // leads into the middle of it skips the statements before
+    //
+    for (uint32 i = 1; i < pSignature->nTokens; i++)
+    {
+        if (pMirror->itemPointers[nFirst + i]->label_num != -1)
+        {
+            return false;
+        }
+    }
+
+    for (uint32 i = 0; i < pSignature->nTokens; i++)
+    {
+        const SIGNATURE_TOKEN* pToken = &aTokens[i];
+        const cexpr_t* pExpression =
+            (const cexpr_t*)pMirror->itemPointers[nFirst + i];
+        uint64 qwValue;
+
+        switch (pToken->bMatch)
+        {
+        case SIGNATURE_MATCH_BINDING:
+            qwValue = (pToken->bOp == cot_var) ?
+                (uint64)aItems[nFirst + i].nVariable : pExpression->numval();
+            if (!(dwBound & (1 << pToken->qwValue)))
+            {
+                dwBound |= 1 << pToken->qwValue;
+                aqwBindings[pToken->qwValue] = qwValue;
+            }
+            else if (aqwBindings[pToken->qwValue] != qwValue)
+            {
+                return false;
+            }
+            break;
+
+        case SIGNATURE_MATCH_VALUE:
+            if (pExpression->numval() != pToken->qwValue)
+            {
+                return false;
+            }
+            break;
+
+        case SIGNATURE_MATCH_HELPER:
+            if (0 != strcmp(
+                pExpression->helper,
+                g_junkSignatures.helperNames[pToken->nHelper].c_str()))
+            {
+                return false;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    for (uint32 i = 0; i < pSignature->nTokens; i++)
+    {
+        if (aTokens[i].bFlags & SIGNATURE_TOKEN_JUNK)
+        {
+            aItems[nFirst + i].bFlags |= MIRROR_ITEM_JUNK;
+        }
+    }
+
+    return true;
+}
+
+/*! 
+    @brief Marks the statements of a flattened function that match a junk
+           signature
+    @details The items' types are fed through the Aho-Corasick automaton of
+             g_junkSignatures in a single pass; each occurrence of a
+             signature is then checked by VerifyJunkSignature(). Must run on
+             the thread that owns the decompilation, since the items'
+             arguments are read from the ctree.
+
+    @param[in,out] pMirror The flattened function
+    @return Returns the number of signature occurrences found
+*/
+uint32
+MatchJunkSignatures (
+    DETOX_MIRROR* pMirror
+    )
+{
+    const SIGNATURE_SET* pSet = &g_junkSignatures;
+    uint32 nMatches = 0;
+    uint32 nState = 0;
+
+    if (pSet->signatures.empty())
+    {
+        return 0;
+    }
+
+    for (uint32 n = 0; n < pMirror->items.size(); n++)
+    {
+        uint8 bOp = pMirror->items[n].bOp;
+
+        nState = (bOp < CROWDDETOX_SIGNATURE_ALPHABET) ?
+            pSet->transitions[nState * CROWDDETOX_SIGNATURE_ALPHABET + bOp] :
+            0;
+
+        for (uint32 nOutput = (pSet->outputs[nState] != SIGNATURE_NONE) ?
+                nState : pSet->outputLinks[nState];
+            nOutput != SIGNATURE_NONE;
+            nOutput = pSet->outputLinks[nOutput])
+        {
+            for (uint32 i = pSet->outputs[nOutput];
+                i != SIGNATURE_NONE;
+                i = pSet->signatures[i].nNext)
+            {
+                const JUNK_SIGNATURE* pSignature = &pSet->signatures[i];
+
+                if (VerifyJunkSignature(
+                    pMirror,
+                    pSignature,
+                    n + 1 - pSignature->nTokens))
+                {
+                    nMatches++;
+                }
+            }
+        }
+    }
+
+    return nMatches;
+}
+
+/*! 
+    @brief Flags the values of a function's return statements if no caller
+           uses them
+    @details This has the same effect as setting the function's prototype to
+             return void: the returned values no longer make the
+             computations behind them legitimate, while the ctree itself is
+             left alone. Only integer and pointer values, which x86 returns
+             in the registers that BuildReturnIndex() tracks, are flagged,
+             and only if they have no side effects.
+
+    @param[in] pFunction The function
+    @param[in,out] pMirror The function's flattened ctree
+    @return Returns the number of return values flagged
+*/
+uint32
+MarkUnusedReturnValues (
+    cfunc_t* pFunction,
+    DETOX_MIRROR* pMirror
+    )
+{
+    MIRROR_ITEM* aItems = pMirror->items.begin();
+    uint32 nItems = (uint32)pMirror->items.size();
+    uint32 nFlagged = 0;
+
+    if (IsReturnValueUsed(pFunction->entry_ea))
+    {
+        return 0;
+    }
+
+    for (uint32 n = 0; n < nItems; n++)
+    {
+        //
+        // The returned value is the return statement's only child
+        //
+        if ((aItems[n].bOp != cit_return) || (n + 1 >= aItems[n].nEnd) ||
+            (aItems[n + 1].bOp == cot_empty))
+        {
+            continue;
+        }
+
+        const cexpr_t* pValue = (const cexpr_t*)pMirror->itemPointers[n + 1];
+        if (!(is_type_int(*pValue->type.u_str()) ||
+            is_type_ptr(*pValue->type.u_str())) ||
+            pValue->has_side_effects())
+        {
+            continue;
+        }
+
+        aItems[n + 1].bFlags |= MIRROR_ITEM_UNUSED;
+        nFlagged++;
+    }
+
+    return nFlagged;
+}
+
+/*! 
+    @brief Records which of a detoxed function's parameters are still used
+    @details Only does anything in runs with the "params" option. Functions with more than
+             CROWDDETOX_MAX_TRACKED_PARAMETERS parameters are not recorded,
+             so all of their parameters count as used.
+
+    @param[in] pFunction The detoxed function
+*/
+void
+RecordUsedParameters (
+    cfunc_t* pFunction
+    )
+{
+    //
+    // This structure is derived from ctree_visitor_t. It is used to find
+    // the variables that the function's ctree still refers to.
+    //
+    struct ida_local USED_VARIABLES_VISITOR : public ctree_visitor_t
+    {
+        public:
+
+        //
+        // Whether each variable is referred to
+        //
+        qvector<bool> variableIsUsed;
+
+        int
+        idaapi
+        visit_expr (
+            cexpr_t* pExpression
+            )
+        {
+            if ((pExpression->op == cot_var) &&
+                ((size_t)pExpression->v.idx < variableIsUsed.size()))
+            {
+                variableIsUsed[pExpression->v.idx] = true;
+            }
+
+            return 0;
+        }
+
+        USED_VARIABLES_VISITOR():
+            ctree_visitor_t(CV_FAST)
+        {
+        }
+    };
+
+    if (!g_fParameterIndex)
+    {
+        return;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+
+    size_t nParameters = pFunction->argidx.size();
+    if (nParameters > CROWDDETOX_MAX_TRACKED_PARAMETERS)
+    {
+        nodeCache.altdel(
+            pFunction->entry_ea,
+            CROWDDETOX_PARAMETER_TAG);
+        return;
+    }
+
+    USED_VARIABLES_VISITOR uvv;
+    uvv.variableIsUsed.resize(
+        pFunction->get_lvars()->size(),
+        false);
+    uvv.apply_to(
+        &pFunction->body,
+        NULL);
+
+    nodeidx_t nEntry = PARAMETERS_INDEXED |
+        ((nodeidx_t)nParameters << PARAMETERS_COUNT_SHIFT);
+    for (size_t i = 0; i < nParameters; i++)
+    {
+        size_t nVariable = (size_t)pFunction->argidx[i];
+
+        if ((nVariable >= uvv.variableIsUsed.size()) ||
+            uvv.variableIsUsed[nVariable])
+        {
+            nEntry |= (nodeidx_t)1 << i;
+        }
+    }
+
+    nodeCache.altset(
+        pFunction->entry_ea,
+        nEntry,
+        CROWDDETOX_PARAMETER_TAG);
+}
+
+/*! 
+    @brief Flags the arguments that called functions don't use
+    @details Uses the parameter bitmaps recorded by RecordUsedParameters()
+             when the called functions were detoxed. The computations behind
+             a flagged argument are then not made legitimate by the call;
+             the ctree itself is left alone. Only integer and pointer
+             arguments without side effects are flagged, and only if the
+             call passes exactly as many arguments as the called function
+             had parameters when it was detoxed.
+
+    @param[in,out] pMirror The flattened function
+    @return Returns the number of arguments flagged
+*/
+uint32
+MarkUnusedArguments (
+    DETOX_MIRROR* pMirror
+    )
+{
+    MIRROR_ITEM* aItems = pMirror->items.begin();
+    uint32 nItems = (uint32)pMirror->items.size();
+    uint32 nFlagged = 0;
+
+    if (!g_fParameterIndex)
+    {
+        return 0;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE);
+
+    for (uint32 n = 0; n < nItems; n++)
+    {
+        //
+        // The called function is the call's first child, the arguments
+        // follow it
+        //
+        if ((aItems[n].bOp != cot_call) || (n + 1 >= aItems[n].nEnd) ||
+            (aItems[n + 1].bOp != cot_obj))
+        {
+            continue;
+        }
+
+        nodeidx_t nEntry = nodeCache.altval(
+            ((cexpr_t*)pMirror->itemPointers[n + 1])->obj_ea,
+            CROWDDETOX_PARAMETER_TAG);
+        if (!(nEntry & PARAMETERS_INDEXED) ||
+            (((cexpr_t*)pMirror->itemPointers[n])->a->size() !=
+                ((nEntry & ~PARAMETERS_INDEXED) >> PARAMETERS_COUNT_SHIFT)))
+        {
+            continue;
+        }
+
+        uint32 i = 0;
+        for (uint32 nArgument = aItems[n + 1].nEnd;
+            nArgument < aItems[n].nEnd;
+            nArgument = aItems[nArgument].nEnd, i++)
+        {
+            const cexpr_t* pArgument =
+                (const cexpr_t*)pMirror->itemPointers[nArgument];
+
+            if ((nEntry & ((nodeidx_t)1 << i)) ||
+                !(is_type_int(*pArgument->type.u_str()) ||
+                    is_type_ptr(*pArgument->type.u_str())) ||
+                pArgument->has_side_effects())
+            {
+                continue;
+            }
+
+            aItems[nArgument].bFlags |= MIRROR_ITEM_UNUSED;
+            nFlagged++;
+        }
+    }
+
+    return nFlagged;
+}
+
+/*! 
+    @brief Flattens the given function's ctree into a DETOX_MIRROR
+    @details Everything that requires the Hex-Rays or IDA APIs (such as
+             printing helper names and types) is evaluated here, so that the
+             resulting mirror can be analyzed by AnalyzeMirror() on any
+             thread.
+
+    @param[in] pFunction The function to flatten
+    @param[out] pMirror Receives the flattened ctree
+    @param[in,out] pScratch The calling thread's working memory
+*/
+void
+FlattenFunction (
+    cfunc_t* pFunction,
+    DETOX_MIRROR* pMirror,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    lvars_t* pVariables;
+
+    //
+    // This structure is derived from ctree_visitor_t. It is used to copy
+    // every ctree item, in visiting order, into the mirror.
+    //
+    struct ida_local FLATTEN_VISITOR : public ctree_visitor_t
+    {
+        private:
+
+        //
+        // The mirror being built
+        //
+        DETOX_MIRROR* pMirror;
+
+        //
+        // Ordinals of the items whose descendants are currently being
+        // visited, innermost last
+        //
+        qvector<uint32>* pVectorOpenItems;
+
+        int
+        idaapi
+        visit_expr (
+            cexpr_t* pExpression
+            )
+        {
+            return visit_item(
+                pExpression);
+        }
+
+        int
+        idaapi
+        visit_insn (
+            cinsn_t* pInstruction
+            )
+        {
+            return visit_item(
+                pInstruction);
+        }
+
+        int
+        idaapi
+        leave_expr (
+            cexpr_t* pExpression
+            )
+        {
+            UNUSED(pExpression);
+            return leave_item();
+        }
+
+        int
+        idaapi
+        leave_insn (
+            cinsn_t* pInstruction
+            )
+        {
+            UNUSED(pInstruction);
+            return leave_item();
+        }
+
+        /*! 
+            @brief Appends the visited ctree item to the mirror
+
+            @param[in] pItem The visited ctree item
+            @return Always returns 0 to continue the traversal
+        */
+        int
+        visit_item (
+            citem_t* pItem
+            )
+        {
+            MIRROR_ITEM item;
+            char szType[16];
+
+            item.bOp = (uint8)pItem->op;
+            item.bFlags = 0;
+            item.wReserved = 0;
+            item.nParent = pVectorOpenItems->empty() ?
+                MIRROR_NONE : pVectorOpenItems->back();
+            item.nEnd = MIRROR_NONE;
+            item.nVariable = -1;
+
+            if (pItem->op == cot_var)
+            {
+                item.nVariable = ((cexpr_t*)pItem)->v.idx;
+
+                //
+                // CPPEH_RECORD variables are always legitimate; check each
+                // variable's type once
+                //
+                uint8* pbFlags = &pMirror->variableFlags[item.nVariable];
+                if (!(*pbFlags & MIRROR_VARIABLE_TYPE_CHECKED))
+                {
+                    *pbFlags |= MIRROR_VARIABLE_TYPE_CHECKED;
+                    if ((T_NORMAL == print_type_to_one_line(
+                        szType,
+                        _countof(szType),
+                        idati,
+                        ((cexpr_t*)pItem)->type.u_str())) &&
+                        (0 == strcmp(szType, "CPPEH_RECORD")))
+                    {
+                        *pbFlags |= MIRROR_VARIABLE_CPPEH;
+                    }
+                }
+            }
+            else if ((pItem->op == cot_call) &&
+                IsLegitimateCall((cexpr_t*)pItem))
+            {
+                item.bFlags |= MIRROR_ITEM_LEGIT_CALL;
+            }
+            else if ((pItem->op == cot_obj) &&
+                (item.nParent != MIRROR_NONE) &&
+                (item.nParent + 1 == pMirror->items.size()) &&
+                (pMirror->items[item.nParent].bOp == cot_call) &&
+                !(pMirror->items[item.nParent].bFlags &
+                    MIRROR_ITEM_LEGIT_CALL))
+            {
+                //
+                // The called function of a call that IsLegitimateCall()
+                // rejected is pure, so naming it doesn't make the call
+                // legitimate
+                //
+                item.bFlags |= MIRROR_ITEM_NOT_SINK;
+            }
+            else if ((pItem->op == cot_obj) &&
+                IsWriteOnlyGlobal(((cexpr_t*)pItem)->obj_ea))
+            {
+                item.bFlags |= MIRROR_ITEM_NOT_SINK;
+            }
+
+            pVectorOpenItems->push_back(
+                (uint32)pMirror->items.size());
+            pMirror->items.push_back(
+                item);
+            pMirror->itemPointers.push_back(
+                pItem);
+
+            return 0;
+        }
+
+        /*! 
+            @brief Records where the subtree of the item being left ends
+
+            @return Always returns 0 to continue the traversal
+        */
+        int
+        leave_item (
+            void
+            )
+        {
+            pMirror->items[pVectorOpenItems->back()].nEnd =
+                (uint32)pMirror->items.size();
+            pVectorOpenItems->pop_back();
+
+            return 0;
+        }
+
+
+        public:
+
+        //
+        // FLATTEN_VISITOR constructor
+        //
+        FLATTEN_VISITOR(DETOX_MIRROR* _pMirror, qvector<uint32>* _pVectorOpenItems):
+            ctree_visitor_t(CV_POST),
+            pMirror(_pMirror),
+            pVectorOpenItems(_pVectorOpenItems)
+        {
+        }
+    };
+
+    pScratch->openItems.qclear();
+    pMirror->items.qclear();
+    pMirror->itemPointers.qclear();
+    pMirror->variableFlags.qclear();
+
+    //
+    // Remove the dead arms of opaque predicates before anything is marked
+    // legitimate
+    //
+    pMirror->nPredicatesFolded = FoldOpaquePredicates(
+        pFunction,
+        pScratch,
+        &pMirror->nItemsBeforeFolding);
+
+    //
+    // Reduce obfuscated arithmetic, including arithmetic that will turn out
+    // to be legitimate
+    //
+    pMirror->nExpressionsSimplified = SimplifyMbaExpressions(
+        pFunction,
+        pScratch);
+
+    //
+    // Function arguments are always legitimate
+    //
+    pVariables = pFunction->get_lvars();
+    pMirror->variableFlags.resize(
+        pVariables->size(),
+        0);
+    for (size_t i = 0; i < pVariables->size(); i++)
+    {
+        if (pVariables->at(i).is_arg_var())
+        {
+            pMirror->variableFlags[i] |= MIRROR_VARIABLE_ARGUMENT;
+        }
+    }
+
+    FLATTEN_VISITOR fv(pMirror, &pScratch->openItems);
+    fv.apply_to(
+        &pFunction->body,
+        NULL);
+
+    //
+    // Returned values that no caller uses, and arguments that no called
+    // function uses, are not legitimate
+    //
+    MarkUnusedReturnValues(
+        pFunction,
+        pMirror);
+    MarkUnusedArguments(
+        pMirror);
+
+    //
+    // Mark statements that match known junk idioms
+    //
+    pMirror->nSignatureMatches = MatchJunkSignatures(
+        pMirror);
+}
+
+/*! 
+    @brief Allocates zeroed memory from an arena
+    @details The memory stays valid until the next ResetArena(). A request
+             that does not fit in what is left of the current block moves
+             on to the next block, allocating one of at least
+             g_cbArenaBlockSize bytes when there is none.
+
+    @param[in,out] pArena The arena
+    @param[in] cb The number of bytes to allocate
+    @return Returns the memory, aligned on CROWDDETOX_ARENA_ALIGNMENT bytes
+*/
+void*
+AllocateFromArena (
+    DETOX_ARENA* pArena,
+    size_t cb
+    )
+{
+    cb = (cb + CROWDDETOX_ARENA_ALIGNMENT - 1) &
+        ~(size_t)(CROWDDETOX_ARENA_ALIGNMENT - 1);
+
+    while ((pArena->nBlock < pArena->blocks.size()) &&
+        (pArena->cbUsed + cb > pArena->blockSizes[pArena->nBlock]))
+    {
+        pArena->nBlock++;
+        pArena->cbUsed = 0;
+    }
+    if (pArena->nBlock == pArena->blocks.size())
+    {
+        size_t cbBlock = qmax(
+            g_cbArenaBlockSize,
+            cb);
+        uint8* pBlock = (uint8*)qalloc(
+            cbBlock);
+
+        if (pBlock == NULL)
+        {
+            nomem(
+                "CrowdDetox arena");
+        }
+        pArena->blocks.push_back(
+            pBlock);
+        pArena->blockSizes.push_back(
+            cbBlock);
+    }
+
+    uint8* pMemory = pArena->blocks[pArena->nBlock] + pArena->cbUsed;
+    pArena->cbUsed += cb;
+    pArena->cbAllocated += cb;
+    memset(
+        pMemory,
+        0,
+        cb);
+
+    return pMemory;
+}
+
+/*! 
+    @brief Releases everything allocated from an arena at once
+    @details If the step that just returned needed more than one block, the
+             blocks are replaced with a single one of their total size, so
+             that the next step of the same size fits in one block.
+
+    @param[in,out] pArena The arena
+    @return Returns the number of bytes allocated since the last reset,
+            i.e. the step's high-water mark
+*/
+size_t
+ResetArena (
+    DETOX_ARENA* pArena
+    )
+{
+    size_t cbHighWater = pArena->cbAllocated;
+
+    if (pArena->blocks.size() > 1)
+    {
+        size_t cbTotal = 0;
+
+        for (size_t i = 0; i < pArena->blocks.size(); i++)
+        {
+            cbTotal += pArena->blockSizes[i];
+            qfree(
+                pArena->blocks[i]);
+        }
+        pArena->blocks.qclear();
+        pArena->blockSizes.qclear();
+
+        uint8* pBlock = (uint8*)qalloc(
+            cbTotal);
+        if (pBlock != NULL)
+        {
+            pArena->blocks.push_back(
+                pBlock);
+            pArena->blockSizes.push_back(
+                cbTotal);
+        }
+    }
+
+    pArena->nBlock = 0;
+    pArena->cbUsed = 0;
+    pArena->cbAllocated = 0;
+
+    return cbHighWater;
+}
+
+/*! 
+    @brief Returns all of an arena's blocks to the heap
+
+    @param[in,out] pArena The arena
+*/
+void
+FreeArena (
+    DETOX_ARENA* pArena
+    )
+{
+    for (size_t i = 0; i < pArena->blocks.size(); i++)
+    {
+        qfree(
+            pArena->blocks[i]);
+    }
+    pArena->blocks.clear();
+    pArena->blockSizes.clear();
+    pArena->nBlock = 0;
+    pArena->cbUsed = 0;
+    pArena->cbAllocated = 0;
+}
+
+/*! 
+    @brief Groups the items of a flattened function by subtree shape and
+           classifies each shape once
+    @details The items are visited in reverse order, so that every item's
+             children are classified before the item itself. Two subtrees
+             have the same shape if their roots have the same type, flags
+             and variable, and their children have the same shapes, in the
+             same order; shapes are hash-consed on exactly that key, so
+             each distinct shape is classified once. A shape's class records
+             whether the subtree contains an item that is legitimate by
+             itself (see ITEM_CLASS_*), and the set of local variables it
+             reads.
+
+    @param[in] pMirror The flattened function
+    @param[in,out] pScratch The calling thread's working memory; receives
+                            the classes (anItemClasses, classes and
+                            classVariables), allocated from its arena
+*/
+void
+ClassifyMirrorItems (
+    const DETOX_MIRROR* pMirror,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    const MIRROR_ITEM* aItems = pMirror->items.begin();
+    uint32 nItems = (uint32)pMirror->items.size();
+    qvector<ITEM_CLASS>* pVectorClasses = &pScratch->classes;
+    qvector<uint32>* pVectorVariables = &pScratch->classVariables;
+    qvector<uint32>* pVectorMerged = &pScratch->mergedVariables;
+
+    //
+    // Every item gets a class below, so anItemClasses needs no initial
+    // value
+    //
+    uint32* anItemClasses = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        nItems * sizeof(uint32));
+    pScratch->anItemClasses = anItemClasses;
+    pVectorClasses->qclear();
+    pVectorVariables->qclear();
+
+    //
+    // Size the hash table for one class per item at most
+    //
+    size_t nTableSize = 64;
+    while (nTableSize < (size_t)nItems * 2)
+    {
+        nTableSize *= 2;
+    }
+    uint32* anTable = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        nTableSize * sizeof(uint32));
+    memset(
+        anTable,
+        0xFF,
+        nTableSize * sizeof(uint32));
+    pScratch->anClassTable = anTable;
+
+    for (uint32 n = nItems; n > 0; n--)
+    {
+        const MIRROR_ITEM* pItem = &aItems[n - 1];
+        uint8 bKeyFlags = pItem->bFlags &
+            (MIRROR_ITEM_LEGIT_CALL | MIRROR_ITEM_NOT_SINK);
+
+        //
+        // FNV-1a over the item's key and its children's classes
+        //
+        uint64 qwHash = 0xCBF29CE484222325ULL;
+        qwHash = (qwHash ^ pItem->bOp) * 0x100000001B3ULL;
+        qwHash = (qwHash ^ bKeyFlags) * 0x100000001B3ULL;
+        qwHash = (qwHash ^ (uint32)pItem->nVariable) * 0x100000001B3ULL;
+        for (uint32 nChild = n; nChild < pItem->nEnd;
+            nChild = aItems[nChild].nEnd)
+        {
+            qwHash = (qwHash ^ anItemClasses[nChild]) *
+                0x100000001B3ULL;
+        }
+
+        //
+        // Look for an identical shape
+        //
+        size_t nSlot = (size_t)qwHash & (nTableSize - 1);
+        for (; anTable[nSlot] != ITEM_CLASS_NONE;
+            nSlot = (nSlot + 1) & (nTableSize - 1))
+        {
+            const ITEM_CLASS& other =
+                pVectorClasses->at(anTable[nSlot]);
+            const MIRROR_ITEM* pOther = &aItems[other.nRepresentative];
+
+            if ((other.qwHash != qwHash) || (pOther->bOp != pItem->bOp) ||
+                ((pOther->bFlags &
+                    (MIRROR_ITEM_LEGIT_CALL | MIRROR_ITEM_NOT_SINK)) !=
+                    bKeyFlags) ||
+                (pOther->nVariable != pItem->nVariable))
+            {
+                continue;
+            }
+
+            uint32 nChild = n;
+            uint32 nOtherChild = other.nRepresentative + 1;
+            while ((nChild < pItem->nEnd) && (nOtherChild < pOther->nEnd) &&
+                (anItemClasses[nChild] ==
+                    anItemClasses[nOtherChild]))
+            {
+                nChild = aItems[nChild].nEnd;
+                nOtherChild = aItems[nOtherChild].nEnd;
+            }
+            if ((nChild == pItem->nEnd) && (nOtherChild == pOther->nEnd))
+            {
+                break;
+            }
+        }
+        if (anTable[nSlot] != ITEM_CLASS_NONE)
+        {
+            anItemClasses[n - 1] = anTable[nSlot];
+            continue;
+        }
+
+        //
+        // Classify the new shape from its root and its children's classes
+        //
+        ITEM_CLASS newClass;
+        newClass.qwHash = qwHash;
+        newClass.nRepresentative = n - 1;
+        newClass.bFlags = 0;
+        newClass.nFirstVariable = 0;
+        newClass.nVariables = 0;
+
+        pVectorMerged->qclear();
+        if (pItem->bOp == cot_var)
+        {
+            if (pMirror->variableFlags[pItem->nVariable] &
+                MIRROR_VARIABLE_CPPEH)
+            {
+                newClass.bFlags |= ITEM_CLASS_SINK;
+            }
+            else
+            {
+                pVectorMerged->push_back(
+                    (uint32)pItem->nVariable);
+            }
+        }
+        else if ((g_abItemOpProperties[pItem->bOp] & ITEM_OP_SINK) &&
+            !(bKeyFlags & MIRROR_ITEM_NOT_SINK))
+        {
+            newClass.bFlags |= ITEM_CLASS_SINK;
+        }
+        if (bKeyFlags & MIRROR_ITEM_LEGIT_CALL)
+        {
+            newClass.bFlags |= ITEM_CLASS_LEGIT_CALL;
+        }
+
+        for (uint32 nChild = n; nChild < pItem->nEnd;
+            nChild = aItems[nChild].nEnd)
+        {
+            const ITEM_CLASS& child =
+                pVectorClasses->at(anItemClasses[nChild]);
+
+            newClass.bFlags |= child.bFlags;
+            if (newClass.bFlags & ITEM_CLASS_MANY_VARIABLES)
+            {
+                continue;
+            }
+            for (uint32 i = 0; i < child.nVariables; i++)
+            {
+                pVectorMerged->push_back(
+                    pVectorVariables->at(child.nFirstVariable + i));
+            }
+            if (pVectorMerged->size() > CROWDDETOX_CLASS_MAX_VARIABLES * 2)
+            {
+                std::sort(
+                    pVectorMerged->begin(),
+                    pVectorMerged->end());
+                pVectorMerged->erase(
+                    std::unique(
+                        pVectorMerged->begin(),
+                        pVectorMerged->end()),
+                    pVectorMerged->end());
+            }
+            if (pVectorMerged->size() > CROWDDETOX_CLASS_MAX_VARIABLES * 2)
+            {
+                newClass.bFlags |= ITEM_CLASS_MANY_VARIABLES;
+            }
+        }
+
+        if (!(newClass.bFlags & ITEM_CLASS_MANY_VARIABLES))
+        {
+            std::sort(
+                pVectorMerged->begin(),
+                pVectorMerged->end());
+            pVectorMerged->erase(
+                std::unique(
+                    pVectorMerged->begin(),
+                    pVectorMerged->end()),
+                pVectorMerged->end());
+            if (pVectorMerged->size() > CROWDDETOX_CLASS_MAX_VARIABLES)
+            {
+                newClass.bFlags |= ITEM_CLASS_MANY_VARIABLES;
+            }
+            else
+            {
+                newClass.nFirstVariable = (uint32)pVectorVariables->size();
+                newClass.nVariables = (uint32)pVectorMerged->size();
+                for (size_t i = 0; i < pVectorMerged->size(); i++)
+                {
+                    pVectorVariables->push_back(
+                        pVectorMerged->at(i));
+                }
+            }
+        }
+
+        anTable[nSlot] = (uint32)pVectorClasses->size();
+        anItemClasses[n - 1] = (uint32)pVectorClasses->size();
+        pVectorClasses->push_back(
+            newClass);
+    }
+}
+
+/*! 
+    @brief Orders COPY_EDGE structures by destination, then by source
+
+    @param[in] a The first copy
+    @param[in] b The second copy
+    @return Returns true if a comes before b
+*/
+bool
+CompareCopyEdges (
+    const COPY_EDGE& a,
+    const COPY_EDGE& b
+    )
+{
+    if (a.nDestination != b.nDestination)
+    {
+        return a.nDestination < b.nDestination;
+    }
+
+    return a.nSource < b.nSource;
+}
+
+/*! 
+    @brief Finds the representative of a variable's copy class
+
+    @param[in,out] anParents The union-find parent of each variable; paths
+                             are halved along the way
+    @param[in] nVariable The variable
+    @return Returns the representative variable of the class
+*/
+uint32
+FindCopyClass (
+    uint32* anParents,
+    uint32 nVariable
+    )
+{
+    while (anParents[nVariable] != nVariable)
+    {
+        anParents[nVariable] = anParents[anParents[nVariable]];
+        nVariable = anParents[nVariable];
+    }
+
+    return nVariable;
+}
+
+/*! 
+    @brief Finds the pure copies between local variables of a flattened
+           function and groups the variables they connect
+    @details A pure copy is a statement of the form "a = b;" or
+             "a = (type)b;" outside of any statement that matched a junk
+             signature. A copy is legitimate as soon as either of its
+             variables is, since the cit_expr statement around a legitimate
+             variable makes everything under it legitimate; so all
+             variables connected by copies, in either direction, are
+             merged with union-find into classes whose members are all
+             legitimate as soon as one of them is. The copies are also
+             indexed by destination, so that AnalyzeMirror() can mark the
+             copy statements into a legitimate variable right away.
+
+    @param[in] pMirror The flattened function
+    @param[in,out] pScratch The calling thread's working memory; receives
+                            the copies (copyEdges and anCopyEdgeIndex)
+                            and the classes (anCopyParents and
+                            anCopyNext); the arrays are allocated from its
+                            arena
+*/
+void
+GroupCopiedVariables (
+    const DETOX_MIRROR* pMirror,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    const MIRROR_ITEM* aItems = pMirror->items.begin();
+    uint32 nItems = (uint32)pMirror->items.size();
+    uint32 nVariables = (uint32)pMirror->variableFlags.size();
+    qvector<COPY_EDGE>* pVectorEdges = &pScratch->copyEdges;
+    uint32* anIndex = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        (nVariables + 1) * sizeof(uint32));
+    uint32* anParents = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        nVariables * sizeof(uint32));
+    uint32* anNext = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        nVariables * sizeof(uint32));
+
+    pScratch->anCopyEdgeIndex = anIndex;
+    pScratch->anCopyParents = anParents;
+    pScratch->anCopyNext = anNext;
+
+    //
+    // Collect the copies
+    //
+    pVectorEdges->qclear();
+    for (uint32 n = 0; n + 3 < nItems; n++)
+    {
+        //
+        // Statements that matched a junk signature are removed no matter
+        // what, so their copies must not make anything legitimate
+        //
+        if (aItems[n].bFlags & MIRROR_ITEM_JUNK)
+        {
+            n = aItems[n].nEnd - 1;
+            continue;
+        }
+
+        if ((aItems[n].bOp != cit_expr) || (aItems[n + 1].bOp != cot_asg) ||
+            (aItems[n + 2].bOp != cot_var))
+        {
+            continue;
+        }
+
+        uint32 nSource = n + 3;
+        if ((aItems[nSource].bOp == cot_cast) && (nSource + 1 < nItems))
+        {
+            nSource++;
+        }
+        if ((aItems[nSource].bOp != cot_var) ||
+            (aItems[n].nEnd != nSource + 1) ||
+            (aItems[n + 2].nVariable == aItems[nSource].nVariable))
+        {
+            continue;
+        }
+
+        COPY_EDGE edge;
+        edge.nDestination = (uint32)aItems[n + 2].nVariable;
+        edge.nSource = (uint32)aItems[nSource].nVariable;
+        edge.nDestinationItem = n + 2;
+        pVectorEdges->push_back(
+            edge);
+    }
+    std::sort(
+        pVectorEdges->begin(),
+        pVectorEdges->end(),
+        CompareCopyEdges);
+
+    //
+    // Index them by destination: the copies into variable v are
+    // [anCopyEdgeIndex[v], anCopyEdgeIndex[v + 1])
+    //
+    for (size_t i = 0; i < pVectorEdges->size(); i++)
+    {
+        anIndex[pVectorEdges->at(i).nDestination + 1]++;
+    }
+    for (uint32 v = 0; v < nVariables; v++)
+    {
+        anIndex[v + 1] += anIndex[v];
+    }
+
+    //
+    // Merge the variables connected by copies; each class' members form a
+    // circular list through anCopyNext
+    //
+    for (uint32 v = 0; v < nVariables; v++)
+    {
+        anParents[v] = v;
+        anNext[v] = v;
+    }
+    for (size_t i = 0; i < pVectorEdges->size(); i++)
+    {
+        const COPY_EDGE& edge = pVectorEdges->at(i);
+        uint32 nRoot1 = FindCopyClass(
+            anParents,
+            edge.nDestination);
+        uint32 nRoot2 = FindCopyClass(
+            anParents,
+            edge.nSource);
+        if (nRoot1 != nRoot2)
+        {
+            anParents[nRoot2] = nRoot1;
+            std::swap(
+                anNext[nRoot1],
+                anNext[nRoot2]);
+        }
+    }
+}
+
+/*! 
+    @brief Finds the legitimate items and variables of a flattened function
+    @details Only touches the mirror and the edit list, so it may run on any
+             thread. The mirror's items are visited in the same order in
+             which a ctree_visitor_t visits the ctree, round after round,
+             until a round finds no new legitimate items. The per-item and
+             per-class arrays of the analysis live in the scratch arena,
+             which is reset on return.
+
+    @param[in] pMirror The flattened function
+    @param[out] pEdits Receives the legitimate items and variables, and the
+                       arena memory the analysis used
+    @param[in,out] pScratch The calling thread's working memory
+*/
+void
+AnalyzeMirror (
+    const DETOX_MIRROR* pMirror,
+    DETOX_EDITS* pEdits,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    //
+    // This structure holds the state of the legitimacy analysis
+    //
+    struct ida_local LEGIT_ANALYSIS
+    {
+        //
+        // The flattened function's items
+        //
+        const MIRROR_ITEM* aItems;
+
+        //
+        // Per-item flags: is the item legitimate, and have all of its
+        // descendants already been marked legitimate
+        //
+        uint8* abItemIsLegit;
+        uint8* abDescendantsMarkedLegit;
+
+        //
+        // Per-variable flags: is the variable legitimate
+        //
+        uint8* abVariableIsLegit;
+        const uint8* abVariableFlags;
+
+        //
+        // This flag keeps track of whether or not new legitimate items were
+        // found during the current round
+        //
+        bool fNewLegitItemFound;
+
+        //
+        // The items' shape classes (see ClassifyMirrorItems()), and the
+        // per-class liveness cache of the current round
+        //
+        const uint32* anItemClasses;
+        const ITEM_CLASS* aClasses;
+        const uint32* anClassVariables;
+        uint32* anClassRounds;
+        uint8* abClassIsLive;
+        uint32 nRound;
+
+        //
+        // The pure copies and copy classes (see GroupCopiedVariables()),
+        // and the variables whose copies have yet to be followed
+        //
+        const COPY_EDGE* aCopyEdges;
+        const uint32* anCopyEdgeIndex;
+        const uint32* anCopyNext;
+        qvector<uint32>* pVectorNewLegitVariables;
+
+        /*! 
+            @brief Follows the copies of the variables that became
+                   legitimate
+            @details The members of a legitimate variable's copy class are
+                     legitimate as well, whichever direction the copies
+                     between them go, so a chain of copies takes a single
+                     round however its statements are ordered. The copies
+                     into a legitimate variable are marked right away;
+                     the others are marked when they are visited, as they
+                     read a legitimate variable.
+        */
+        void
+        PropagateCopies (
+            void
+            )
+        {
+            while (!pVectorNewLegitVariables->empty())
+            {
+                uint32 nVariable = pVectorNewLegitVariables->back();
+                pVectorNewLegitVariables->pop_back();
+
+                for (uint32 nMember = anCopyNext[nVariable];
+                    nMember != nVariable;
+                    nMember = anCopyNext[nMember])
+                {
+                    if (!abVariableIsLegit[nMember])
+                    {
+                        //
+                        // No item is marked along with the member, so ask
+                        // for another round explicitly
+                        //
+                        abVariableIsLegit[nMember] = 1;
+                        fNewLegitItemFound = true;
+                        pVectorNewLegitVariables->push_back(
+                            nMember);
+                    }
+                }
+
+                for (uint32 i = anCopyEdgeIndex[nVariable];
+                    i < anCopyEdgeIndex[nVariable + 1];
+                    i++)
+                {
+                    if (!abItemIsLegit[aCopyEdges[i].nDestinationItem])
+                    {
+                        MarkAncestorsLegit(
+                            aCopyEdges[i].nDestinationItem);
+                    }
+                }
+            }
+        }
+
+        /*! 
+            @brief Determines whether visiting an item's subtree can find
+                   anything legitimate in the current round
+            @details A subtree can only contribute if it contains an item
+                     that is legitimate by itself, or reads a variable that
+                     is legitimate by now. The answer is computed once per
+                     shape and round; a shape found dead may come to life
+                     later in the round, but only along with a new
+                     legitimate item, which forces another round.
+
+            @param[in] n The ordinal of the subtree's root
+            @return Returns true if the subtree must be visited
+        */
+        bool
+        IsSubtreeLive (
+            uint32 n
+            )
+        {
+            uint32 nClass = anItemClasses[n];
+            const ITEM_CLASS* pClass = &aClasses[nClass];
+
+            if (pClass->bFlags != 0)
+            {
+                return true;
+            }
+
+            if (anClassRounds[nClass] != nRound)
+            {
+                anClassRounds[nClass] = nRound;
+                abClassIsLive[nClass] = 0;
+                for (uint32 i = 0; i < pClass->nVariables; i++)
+                {
+                    if (abVariableIsLegit[
+                        anClassVariables[pClass->nFirstVariable + i]])
+                    {
+                        abClassIsLive[nClass] = 1;
+                        break;
+                    }
+                }
+            }
+
+            return (0 != abClassIsLive[nClass]);
+        }
+
+        /*! 
+            @brief Marks an item, all of its descendants, and all variables
+                   referenced by them as legitimate
+
+            @param[in] nRoot The ordinal of the item
+        */
+        void
+        MarkDescendantsLegit (
+            uint32 nRoot
+            )
+        {
+            for (uint32 n = nRoot; n < aItems[nRoot].nEnd; )
+            {
+                //
+                // Don't descend through items through which we've already
+                // descended (and therefore through their descendants), nor
+                // into unused values
+                //
+                if (abDescendantsMarkedLegit[n] ||
+                    (aItems[n].bFlags & MIRROR_ITEM_UNUSED))
+                {
+                    n = aItems[n].nEnd;
+                    continue;
+                }
+
+                //
+                // If this is a variable, mark the variable legitimate
+                //
+                if ((aItems[n].bOp == cot_var) &&
+                    !abVariableIsLegit[aItems[n].nVariable])
+                {
+                    abVariableIsLegit[aItems[n].nVariable] = 1;
+                    pVectorNewLegitVariables->push_back(
+                        (uint32)aItems[n].nVariable);
+                }
+
+                //
+                // Mark the item itself legitimate
+                //
+                if (!abItemIsLegit[n])
+                {
+                    abItemIsLegit[n] = 1;
+                    fNewLegitItemFound = true;
+                }
+
+                abDescendantsMarkedLegit[n] = 1;
+                n++;
+            }
+        }
+
+        /*! 
+            @brief Determines if an item is legitimate; marks variables
+                   legitimate via abVariableIsLegit and items legitimate via
+                   abItemIsLegit
+
+            @param[in] n The ordinal of the item
+        */
+        void
+        VisitItem (
+            uint32 n
+            )
+        {
+            const MIRROR_ITEM* pItem = &aItems[n];
+
+            //
+            // If this item was already marked as legitimate...
+            //
+            if (abItemIsLegit[n])
+            {
+                //
+                // If we have a legitimate item that's an if/for/while/do/
+                // return statement then mark the expression parts of that
+                // node (for example, the "x" in "if(x)", or the
+                // initialization, condition and step of a for-loop) as
+                // legitimate as well
+                //
+                if (g_abItemOpProperties[pItem->bOp] & ITEM_OP_CONTROL_EXPRS)
+                {
+                    for (uint32 nChild = n + 1;
+                        nChild < pItem->nEnd;
+                        nChild = aItems[nChild].nEnd)
+                    {
+                        if ((aItems[nChild].bOp <= cot_last) &&
+                            !abDescendantsMarkedLegit[nChild])
+                        {
+                            MarkDescendantsLegit(
+                                nChild);
+                        }
+                    }
+                }
+
+                return;
+            }
+
+            //
+            // If this item is a legitimate variable and/or a CPPEH_RECORD
+            // variable, or a function (other than a pure callee), global
+            // variable (other than one that is never read), legit macro,
+            // goto, break, continue, or return then mark the ancestor
+            // expressions as legitimate. (asm-statements are never pruned,
+            // but they do not make their ancestors legitimate.)
+            //
+            if (pItem->bOp == cot_var)
+            {
+                if (!abVariableIsLegit[pItem->nVariable] &&
+                    !(abVariableFlags[pItem->nVariable] &
+                        MIRROR_VARIABLE_CPPEH))
+                {
+                    return;
+                }
+            }
+            else if (!((g_abItemOpProperties[pItem->bOp] & ITEM_OP_SINK) &&
+                !(pItem->bFlags & MIRROR_ITEM_NOT_SINK)) &&
+                !(pItem->bFlags & MIRROR_ITEM_LEGIT_CALL))
+            {
+                return;
+            }
+
+            MarkAncestorsLegit(
+                n);
+        }
+
+        /*! 
+            @brief Marks an item and all of its ancestors as legitimate,
+                   along with everything under the cit_expr statements,
+                   legitimate calls, and return statements among them
+
+            @param[in] n The ordinal of the item
+        */
+        void
+        MarkAncestorsLegit (
+            uint32 n
+            )
+        {
+            //
+            // Iterate through all ancestors
+            //
+            for (uint32 nCurrent = n;
+                nCurrent != MIRROR_NONE;
+                nCurrent = aItems[nCurrent].nParent)
+            {
+                const MIRROR_ITEM* pCurrent = &aItems[nCurrent];
+
+                if (!abItemIsLegit[nCurrent])
+                {
+                    abItemIsLegit[nCurrent] = 1;
+                    fNewLegitItemFound = true;
+                }
+
+                //
+                // Mark everything under a cit_expr statement, legitimate
+                // call, or return statement as legitimate
+                //
+                if (((g_abItemOpProperties[pCurrent->bOp] & ITEM_OP_CLOSURE) ||
+                    (pCurrent->bFlags & MIRROR_ITEM_LEGIT_CALL)) &&
+                    !abDescendantsMarkedLegit[nCurrent])
+                {
+                    MarkDescendantsLegit(
+                        nCurrent);
+                }
+
+                //
+                // An unused value doesn't make what it is passed to
+                // legitimate
+                //
+                if (pCurrent->bFlags & MIRROR_ITEM_UNUSED)
+                {
+                    break;
+                }
+            }
+        }
+    };
+
+    uint32 nItems = (uint32)pMirror->items.size();
+    uint32 nVariables = (uint32)pMirror->variableFlags.size();
+
+    pEdits->itemIsLegit.qclear();
+    pEdits->itemIsLegit.resize(
+        (nItems + 63) / 64,
+        0);
+
+    //
+    // Function arguments are always legitimate
+    //
+    pEdits->variableIsLegit.qclear();
+    pEdits->variableIsLegit.resize(
+        nVariables,
+        0);
+    for (uint32 i = 0; i < nVariables; i++)
+    {
+        if (pMirror->variableFlags[i] & MIRROR_VARIABLE_ARGUMENT)
+        {
+            pEdits->variableIsLegit[i] = 1;
+        }
+    }
+    pEdits->nRounds = 0;
+    pEdits->cbArenaUsed = 0;
+
+    if (nItems == 0)
+    {
+        return;
+    }
+
+    //
+    // The analysis marks items in a byte per item, which is packed into
+    // the edit list's bit vector once it has converged
+    //
+    uint8* abItemIsLegit = (uint8*)AllocateFromArena(
+        &pScratch->arena,
+        nItems);
+    pScratch->abDescendantsMarkedLegit = (uint8*)AllocateFromArena(
+        &pScratch->arena,
+        nItems);
+
+    //
+    // Classify the subtree shapes and find the copies once, up front
+    //
+    ClassifyMirrorItems(
+        pMirror,
+        pScratch);
+    GroupCopiedVariables(
+        pMirror,
+        pScratch);
+    pScratch->anClassRounds = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        pScratch->classes.size() * sizeof(uint32));
+    pScratch->abClassIsLive = (uint8*)AllocateFromArena(
+        &pScratch->arena,
+        pScratch->classes.size());
+
+    LEGIT_ANALYSIS analysis;
+    analysis.aItems = pMirror->items.begin();
+    analysis.abItemIsLegit = abItemIsLegit;
+    analysis.abDescendantsMarkedLegit = pScratch->abDescendantsMarkedLegit;
+    analysis.abVariableIsLegit = pEdits->variableIsLegit.begin();
+    analysis.abVariableFlags = pMirror->variableFlags.begin();
+    analysis.anItemClasses = pScratch->anItemClasses;
+    analysis.aClasses = pScratch->classes.begin();
+    analysis.anClassVariables = pScratch->classVariables.begin();
+    analysis.anClassRounds = pScratch->anClassRounds;
+    analysis.abClassIsLive = pScratch->abClassIsLive;
+    analysis.aCopyEdges = pScratch->copyEdges.begin();
+    analysis.anCopyEdgeIndex = pScratch->anCopyEdgeIndex;
+    analysis.anCopyNext = pScratch->anCopyNext;
+    analysis.pVectorNewLegitVariables = &pScratch->newLegitVariables;
+
+    //
+    // Follow the copies of the function arguments
+    //
+    pScratch->newLegitVariables.qclear();
+    for (uint32 i = 0; i < nVariables; i++)
+    {
+        if (pEdits->variableIsLegit[i])
+        {
+            pScratch->newLegitVariables.push_back(
+                i);
+        }
+    }
+    analysis.fNewLegitItemFound = false;
+    analysis.PropagateCopies();
+
+    //
+    // Keep visiting the function's items until no new legitimate items are
+    // found
+    //
+    do
+    {
+        analysis.fNewLegitItemFound = false;
+        analysis.nRound = pEdits->nRounds + 1;
+        for (uint32 n = 0; n < nItems; n++)
+        {
+            //
+            // Statements that matched a junk signature are junk no matter
+            // what they contain
+            //
+            if (pMirror->items[n].bFlags & MIRROR_ITEM_JUNK)
+            {
+                n = pMirror->items[n].nEnd - 1;
+                continue;
+            }
+
+            //
+            // Skip subtrees that cannot find anything legitimate
+            //
+            if (!analysis.IsSubtreeLive(n))
+            {
+                n = pMirror->items[n].nEnd - 1;
+                continue;
+            }
+
+            analysis.VisitItem(
+                n);
+            analysis.PropagateCopies();
+        }
+        pEdits->nRounds++;
+    } while (analysis.fNewLegitItemFound);
+
+    for (uint32 n = 0; n < nItems; n++)
+    {
+        if (abItemIsLegit[n])
+        {
+            pEdits->itemIsLegit[n / 64] |= (uint64)1 << (n % 64);
+        }
+    }
+
+    pEdits->cbArenaUsed = ResetArena(
+        &pScratch->arena);
+}
+
+/*! 
+    @brief Finds the ordinal of a ctree item of a flattened function
+
+    @param[in] pMirror The flattened function
+    @param[in] anOrdinalsByItem The function's ordinals, sorted by the
+                                address of their ctree items
+    @param[in] pItem The ctree item
+    @return Returns the item's ordinal, or MIRROR_NONE if the item was not
+            flattened
+*/
+uint32
+FindItemOrdinal (
+    const DETOX_MIRROR* pMirror,
+    const uint32* anOrdinalsByItem,
+    const citem_t* pItem
+    )
+{
+    const citem_t* const* apItems = pMirror->itemPointers.begin();
+    uint32 nLow = 0;
+    uint32 nHigh = (uint32)pMirror->itemPointers.size();
+
+    while (nLow < nHigh)
+    {
+        uint32 nMiddle = nLow + (nHigh - nLow) / 2;
+
+        if (apItems[anOrdinalsByItem[nMiddle]] < pItem)
+        {
+            nLow = nMiddle + 1;
+        }
+        else
+        {
+            nHigh = nMiddle;
+        }
+    }
+
+    if ((nLow < pMirror->itemPointers.size()) &&
+        (apItems[anOrdinalsByItem[nLow]] == pItem))
+    {
+        return anOrdinalsByItem[nLow];
+    }
+
+    return MIRROR_NONE;
+}
+
+/*! 
+    @brief Removes the junk found by AnalyzeMirror() from the given function
+
+    @param[in] pFunction The function from which to remove junk code and
+                         variables
+    @param[in] pMirror The function's mirror, as built by FlattenFunction()
+    @param[in] pEdits The legitimate items and variables found by
+                      AnalyzeMirror()
+    @param[in,out] pScratch The calling thread's working memory
+    @param[out] pStats Optional; receives statistics about the junk removal
+*/
+void
+ApplyDetoxEdits (
+    cfunc_t* pFunction,
+    const DETOX_MIRROR* pMirror,
+    const DETOX_EDITS* pEdits,
+    DETOX_SCRATCH* pScratch,
+    DETOX_STATS* pStats
+    )
+{
+    lvars_t* pVariables;
+
+    if (pStats != NULL)
+    {
+        memset(
+            pStats,
+            0,
+            sizeof(*pStats));
+        pStats->nItemsBefore = pMirror->nItemsBeforeFolding;
+        pStats->nRounds = pEdits->nRounds;
+        pStats->nPredicatesFolded = pMirror->nPredicatesFolded;
+        pStats->nExpressionsSimplified = pMirror->nExpressionsSimplified;
+        pStats->nSignatureMatches = pMirror->nSignatureMatches;
+        pStats->cbAnalyzeArena = pEdits->cbArenaUsed;
+    }
+
+    //
+    // Index the ordinals by ctree item, so that the items visited below
+    // can be looked up in the edit list's bit vector
+    //
+    uint32 nItems = (uint32)pMirror->itemPointers.size();
+    pScratch->anOrdinalsByItem = (uint32*)AllocateFromArena(
+        &pScratch->arena,
+        nItems * sizeof(uint32));
+    for (uint32 n = 0; n < nItems; n++)
+    {
+        pScratch->anOrdinalsByItem[n] = n;
+    }
+    ITEM_ORDINAL_ORDER order;
+    order.apItems = pMirror->itemPointers.begin();
+    std::sort(
+        pScratch->anOrdinalsByItem,
+        pScratch->anOrdinalsByItem + nItems,
+        order);
+
+    //
+    // This structure is derived from ctree_visitor_t. It is used to prune
+    // junk ctree_t items from the decompilation graph.
+    //
+    struct ida_local PRUNE_ITEMS_VISITOR : public ctree_visitor_t
+    {
+        private:
+
+        //
+        // The function's mirror, its ordinals sorted by ctree item, and
+        // the legitimate ordinals found by AnalyzeMirror()
+        //
+        const DETOX_MIRROR* pMirror;
+        const uint32* anOrdinalsByItem;
+        const uint64* aqwItemIsLegit;
+
+        //
+        // This variable keeps track of the function being decompiled
+        //
+        cfunc_t* pFunction;
+
+        //
+        // The modes in which the decompilation tree will be traversed
+        //
+        enum VisitingMode
+        {
+            Pruning,
+            CleaningUpGotoLabels,
+            ChangingGotos,
+            FindingChildrenOfParent
+        };
+        VisitingMode visitingMode;
+
+        //
+        // Used in FindingChildrenOfParent visiting mode. Parent currently
+        // being analyzed.
+        //
+        citem_t* pCurrentParent;
+
+        //
+        // Used in FindingChildrenOfParent visiting mode. This vector tracks
+        // children of the currently analyzed parent block.
+        //
+        qvector<citem_t*> vectorChildrenOfParentBlock;
+
+        //
+        // Used in ChangingGotos visiting mode. Stores original goto
+        // destination label number.
+        //
+        int nOldLabelNumber;
+
+        //
+        // Used in ChangingGotos visiting mode. Stores new goto destination
+        // label number. If -1, change gotos to return.
+        //
+        int nNewLabelNumber;
+
+        //
+        // If this item and all of its descendants contain no goto-labels,
+        // this is false (no cleaning up done). If a goto label was cleaned up,
+        // this is true.
+        bool fGotoCleaned;
+
+        /*! 
+            @brief This function, called by Hex-Rays when the ctree visitor
+                   visits an expresison item, is a stub for visit_item()
+
+            @param[in] pExpression The visited expression item
+            @return Returns 0 to continue the traversal, returns 1 to stop
+                    the traversal
+        */
+        int
+        idaapi
+        visit_expr (
+            cexpr_t* pExpression
+            )
+        {
+            return visit_item(
+                pExpression);
+        }
+
+        /*! 
+            @brief This function, called by Hex-Rays when the ctree visitor
+                   visits a statement item, is a stub for visit_item()
+
+            @param[in] pExpression The visited statement item
+            @return Returns 0 to continue the traversal, returns 1 to stop
+                    the traversal
+        */
+        int
+        idaapi
+        visit_insn (
+            cinsn_t* pInstruction
+            )
+        {
+            return visit_item(
+                pInstruction);
+        }
+
+        /*! 
+            @brief This function prunes junk items from the decompilation graph
+
+            @param[in] pItem The visited ctree item
+            @return Returns 0 to continue the traversal, returns 1 to stop
+                    the traversal
+        */
+        int
+        visit_item (
+            citem_t* pItem
+            )
+        {
+            cblock_t* pBlock;
+            citem_t* pParent;
+            citem_t* pNewDestination;
+
+            //
             // If we're in the (default) Pruning mode...
             //
-            if (visitingMode == Pruning)
+            if (visitingMode == Pruning)
+            {
+                //
+                // Erase all unlabeled empty items from cit_block items
+                //
+                if (pItem->op == cit_block)
+                {
+                    pBlock = ((cinsn_t*)pItem)->cblock;
+                    for (
+                        cblock_t::iterator pIterator = pBlock->begin();
+                        pIterator != pBlock->end();
+                        pIterator++)
+                    {
+                        if ((g_abItemOpProperties[pIterator->op] &
+                            ITEM_OP_EMPTY) && (pIterator->label_num == -1))
+                        {
+                            pBlock->erase(
+                                pIterator);
+                            fPruned = true;
+                            return 1;
+                        }
+                    }
+                    return 0;
+                }
+
+                //
+                // Don't cleanup cit_break, cit_continue, cit_goto, cit_empty,
+                // cot_empty, cit_asm, or cit_return items
+                //
+                if (g_abItemOpProperties[pItem->op] & ITEM_OP_PRUNE_BARRIER)
+                {
+                    //
+                    // Don't cleanup descendants of these items, either
+                    //
+                    prune_now();
+
+                    return 0;
+                }
+
+                //
+                // Cleanup everything else unless it's marked as legitimate
+                //
+                uint32 nOrdinal = FindItemOrdinal(
+                    pMirror,
+                    anOrdinalsByItem,
+                    pItem);
+                if ((nOrdinal != MIRROR_NONE) &&
+                    (aqwItemIsLegit[nOrdinal / 64] &
+                        ((uint64)1 << (nOrdinal % 64))))
+                {
+                    return 0;
+                }
+
+                //
+                // Only cleanup statements, not expressions
+                //
+                if (pItem->is_expr())
+                {
+                    return 0;
+                }
+
+                //
+                // Keep cleaning up goto labels under this item until no labels
+                // remain
+                //
+                visitingMode = CleaningUpGotoLabels;
+                fGotoCleaned = true;
+                while (fGotoCleaned)
+                {
+                    fGotoCleaned = false;
+                    apply_to(
+                        pItem,
+                        NULL);
+                }
+                visitingMode = Pruning;
+
+                //
+                // Execute the actual cleanup() call
+                //
+                ((cinsn_t*)pItem)->cleanup();
+                nStatementsPruned++;
+
+                fPruned = true;
+                return 1;
+            }
+
+            //
+            // If we're in CleaningUpGotoLabels mode...
+            //
+            else if (visitingMode == CleaningUpGotoLabels)
+            {
+                //
+                // Keep searching this tree branch until we find a goto label
+                //
+                if (pItem->label_num == -1)
+                {
+                    return 0;
+                }
+
+                //
+                // We found an item with a goto label, so save its old label
+                // number
+                //
+                nOldLabelNumber = pItem->label_num;
+
+                //
+                // Find a new place to assign this label
+                //
+                pParent = pItem;
+                pNewDestination = NULL;
+                while (pNewDestination == NULL)
+                {
+                    while (NULL != (pParent = pFunction->body.find_parent_of(pParent)))
+                    {
+                        if (pParent->op == cit_block)
+                        {
+                            break;
+                        }
+                    }
+
+                    if (pParent == NULL)
+                    {
+                        //
+                        // We couldn't find any parent block, which means we
+                        // can't move the goto label. Instead, change the gotos
+                        // that point to this label into returns.
+                        //
+
+                        //
+                        // Change gotos that jump to nOldLabelNumber to instead
+                        // be returns
+                        //
+                        nNewLabelNumber = -1;
+                        visitingMode = ChangingGotos;
+                        apply_to(
+                            &pFunction->body,
+                            NULL);
+                    
+                        fGotoCleaned = true;
+                        return 1;
+                    }
+
+                    //
+                    // The parent block was found. See if there are any
+                    // children of that parent block whose EA is greater than
+                    // that of the current label's item.
+                    //
+                    pCurrentParent = pParent;
+                    vectorChildrenOfParentBlock.clear();
+                    visitingMode = FindingChildrenOfParent;
+                    apply_to(
+                        pParent,
+                        NULL);
+                    visitingMode = CleaningUpGotoLabels;
+
+                    for (size_t i = 0;
+                        i < vectorChildrenOfParentBlock.size();
+                        i++)
+                    {
+                        if (!(vectorChildrenOfParentBlock[i]->ea > pItem->ea))
+                        {
+                            continue;
+                        }
+
+                        if ((pNewDestination == NULL) ||
+                            (vectorChildrenOfParentBlock[i]->ea <
+                            pNewDestination->ea))
+                        {
+                            pNewDestination = vectorChildrenOfParentBlock[i];
+                        }
+                    }
+                }
+
+                //
+                // We now have a pNewDestination for our label
+                //
+
+                //
+                // If the new destination already has a label number...
+                //
+                if (pNewDestination->label_num != -1)
+                {
+                    //
+                    // Update all goto items in the graph that originally
+                    // pointed to the old label to now point to
+                    // pNewDestination's label
+                    //
+                    nNewLabelNumber = pNewDestination->label_num;
+                    visitingMode = ChangingGotos;
+                    apply_to(
+                        &pFunction->body,
+                        NULL);
+                    nLabelsRelocated++;
+                    
+                    fGotoCleaned = true;
+                    return 1;
+                }
+
+                //
+                // Otherwise, just move the label
+                //
+                pNewDestination->label_num = pItem->label_num;
+                pItem->label_num = -1;
+                nLabelsRelocated++;
+
+                fGotoCleaned = true;
+
+                return 1;
+            }
+
+            //
+            // If we're in FindingChildrenOfParent mode...
+            //
+            else if (visitingMode == FindingChildrenOfParent)
+            {
+                //
+                // If the item is a child of the current parent, add it to the
+                // vectorChildrenOfParentBlock vector
+                //
+                if (parents.back() == pCurrentParent)
+                {
+                    vectorChildrenOfParentBlock.push_back(pItem);
+                }
+
+                return 0;
+            }
+
+            //
+            // If we're in the ChaningGotos mode...
+            //
+            else if (visitingMode == ChangingGotos)
+            {
+                //
+                // Change cit_goto items to either point to a new goto label or
+                // to be a cit_return instead.
+                //
+
+                if (!((pItem->op == cit_goto) &&
+                    (((cinsn_t*)pItem)->cgoto->label_num == nOldLabelNumber)))
+                {
+                    return 0;
+                }
+
+                if (nNewLabelNumber != -1)
+                {
+                    //
+                    // Change the destination label of the goto
+                    //
+                    ((cinsn_t*)pItem)->cgoto->label_num = nNewLabelNumber;
+                    return 0;
+                }
+
+                //
+                // Change the goto to a return
+                //
+                cinsn_t* pRet = new cinsn_t();
+                pRet->ea = pItem->ea;
+                pRet->op = cit_return;
+                pRet->label_num = pItem->label_num;
+                pRet->index = pItem->index;
+                pRet->creturn = new creturn_t();
+
+                ((cinsn_t*)pItem)->replace_by(pRet);
+                ((cinsn_t*)pItem)->cleanup();
+                nGotosConverted++;
+
+                return 0;
+            }
+
+            return 1;
+        }
+
+
+        public:
+
+        //
+        // This flag keeps track of whether or not any ctree items were pruned
+        // during the ctree traversal
+        //
+        bool fPruned;
+
+        //
+        // Statistics: statements cleaned up, goto labels moved, and gotos
+        // changed into returns
+        //
+        uint32 nStatementsPruned;
+        uint32 nLabelsRelocated;
+        uint32 nGotosConverted;
+
+        //
+        // PRUNE_ITEMS_VISITOR constructor
+        //
+        PRUNE_ITEMS_VISITOR(cfunc_t* _pFunction, const DETOX_MIRROR* _pMirror, const uint32* _anOrdinalsByItem, const uint64* _aqwItemIsLegit):
+            ctree_visitor_t(CV_PARENTS),
+            pFunction(_pFunction),
+            pMirror(_pMirror),
+            anOrdinalsByItem(_anOrdinalsByItem),
+            aqwItemIsLegit(_aqwItemIsLegit),
+            visitingMode(Pruning),
+            fGotoCleaned(false),
+            fPruned(false),
+            nOldLabelNumber(-1),
+            nNewLabelNumber(-1),
+            nStatementsPruned(0),
+            nLabelsRelocated(0),
+            nGotosConverted(0)
+        {
+        }
+    };
+
+    //
+    // Keep traversing the function's ctree until there are no items left to
+    // prune
+    //
+    PRUNE_ITEMS_VISITOR piv(pFunction, pMirror, pScratch->anOrdinalsByItem, pEdits->itemIsLegit.begin());
+    do
+    {
+        piv.fPruned = false;
+        piv.apply_to(
+            &pFunction->body,
+            NULL);
+    } while (piv.fPruned);
+
+    if (pStats != NULL)
+    {
+        pStats->nStatementsPruned = piv.nStatementsPruned;
+        pStats->nLabelsRelocated = piv.nLabelsRelocated;
+        pStats->nGotosConverted = piv.nGotosConverted;
+    }
+
+    //
+    // Clear the CVAR_USED flag from all variables not found to be legitimate
+    //
+    pVariables = pFunction->get_lvars();
+    for (size_t i = 0; i < pVariables->size(); i++)
+    {
+        if ((i >= pEdits->variableIsLegit.size()) ||
+            !pEdits->variableIsLegit[i])
+        {
+            pVariables->at(i).clear_used();
+
+            if (pStats != NULL)
+            {
+                pStats->nVariablesCleared++;
+            }
+        }
+    }
+
+    if (pStats != NULL)
+    {
+        pStats->nItemsAfter = CountItems(
+            pFunction);
+    }
+
+    RecordUsedParameters(
+        pFunction);
+
+    //
+    // The ordinal index was only needed for pruning
+    //
+    size_t cbArenaUsed = ResetArena(
+        &pScratch->arena);
+    if (pStats != NULL)
+    {
+        pStats->cbApplyArena = cbArenaUsed;
+    }
+}
+
+/*! 
+    @brief Removes junk code and variables from the given function
+
+    @param[in] pFunction The function from which to remove junk code and
+                         variables
+    @param[out] pStats Optional; receives statistics about the junk removal
+*/
+void
+Detox (
+    cfunc_t* pFunction,
+    DETOX_STATS* pStats = NULL
+    )
+{
+    DETOX_SCRATCH scratch;
+    DETOX_MIRROR mirror;
+    DETOX_EDITS edits;
+
+    FlattenFunction(
+        pFunction,
+        &mirror,
+        &scratch);
+    AnalyzeMirror(
+        &mirror,
+        &edits,
+        &scratch);
+    ApplyDetoxEdits(
+        pFunction,
+        &mirror,
+        &edits,
+        &scratch,
+        pStats);
+}
+
+/*! 
+    @brief Hex-Rays callback function, where CrowdDetox hooks into
+           decompilation process
+
+    @param[in] pUserData Optional; the BATCH_OPTIONS whose nMaturity gives
+                         the maturity at which to detox (default: CMAT_FINAL)
+    @param[in] event Hex-Rays decompiler event code
+    @param[in] va Additional arguments
+    @return Always returns 0
+*/
+int
+idaapi
+HexRaysEventCallback (
+    void* pUserData,
+    hexrays_event_t event,
+    va_list va
+    )
+{
+    const BATCH_OPTIONS* pOptions = (const BATCH_OPTIONS*)pUserData;
+    cfunc_t* pFunction;
+    ctree_maturity_t maturity;
+
+    //
+    // If the event wasn't a change in the maturity level of the decompilation
+    // then disregard the event
+    //
+    if (event != hxe_maturity)
+    {
+        return 0;
+    }
+
+    //
+    // Get the new maturity level of the decompilation
+    //
+    pFunction = va_arg(
+        va,
+        cfunc_t*);
+    maturity = va_argi(
+        va,
+        ctree_maturity_t);
+
+    //
+    // If Hex-Rays has not yet reached the configured maturity then disregard
+    // the event
+    //
+    if (maturity != ((pOptions != NULL) ? pOptions->nMaturity : CMAT_FINAL))
+    {
+        return 0;
+    }
+
+    //
+    // Hex-Rays has reached the configured maturity (by default, it has
+    // finalized its decompilation of the function), so now remove the junk
+    // code and variables from the decompiled function
+    //
+    Detox(
+        pFunction);
+
+    return 0;
+}
+
+/*! 
+    @brief Removes junk statements from a function's ctree as soon as
+           Hex-Rays has built it
+    @details Hex-Rays' ctree transformations, copy propagation, type casting
+             and structuring then run on the smaller tree. Variables are left
+             alone; their CVAR_USED flags are only cleared by the final
+             Detox() pass, once Hex-Rays is done rewriting the ctree.
+
+    @param[in] pFunction The function whose ctree was just built
+    @param[out] pStats Optional; receives statistics about the junk removal
+*/
+void
+DetoxEarly (
+    cfunc_t* pFunction,
+    DETOX_STATS* pStats
+    )
+{
+    DETOX_SCRATCH scratch;
+    DETOX_MIRROR mirror;
+    DETOX_EDITS edits;
+
+    FlattenFunction(
+        pFunction,
+        &mirror,
+        &scratch);
+    AnalyzeMirror(
+        &mirror,
+        &edits,
+        &scratch);
+
+    edits.variableIsLegit.qclear();
+    edits.variableIsLegit.resize(
+        pFunction->get_lvars()->size(),
+        1);
+
+    ApplyDetoxEdits(
+        pFunction,
+        &mirror,
+        &edits,
+        &scratch,
+        pStats);
+}
+
+/*! 
+    @brief Hex-Rays callback function that runs DetoxEarly() while a
+           function is being decompiled
+    @details Installed alongside HexRaysEventCallback (or around a batch
+             run's decompilations) when the "early" option is set.
+
+    @param[in] pUserData Optional; the BATCH_SUMMARY that accumulates the
+                         early pass' statistics
+    @param[in] event Hex-Rays decompiler event code
+    @param[in] va Additional arguments
+    @return Always returns 0
+*/
+int
+idaapi
+EarlyDetoxEventCallback (
+    void* pUserData,
+    hexrays_event_t event,
+    va_list va
+    )
+{
+    BATCH_SUMMARY* pSummary = (BATCH_SUMMARY*)pUserData;
+    cfunc_t* pFunction;
+    ctree_maturity_t maturity;
+    DETOX_STATS stats;
+
+    if (event != hxe_maturity)
+    {
+        return 0;
+    }
+
+    pFunction = va_arg(
+        va,
+        cfunc_t*);
+    maturity = va_argi(
+        va,
+        ctree_maturity_t);
+    if (maturity != CROWDDETOX_EARLY_MATURITY)
+    {
+        return 0;
+    }
+
+    memset(
+        &stats,
+        0,
+        sizeof(stats));
+
+    uint64 qwStart = get_nsec_stamp();
+    DetoxEarly(
+        pFunction,
+        &stats);
+
+    if (pSummary != NULL)
+    {
+        pSummary->nEarlyStatementsPruned += stats.nStatementsPruned;
+        pSummary->qwEarlyDetoxNs += get_nsec_stamp() - qwStart;
+    }
+
+    return 0;
+}
+
+/*! 
+    @brief Gets the triage register mask of a processor register
+    @details On x86, the 8-bit registers are mapped to the registers that
+             contain them, so that a write to al is seen as a partial write
+             to eax. Registers that the triage pass does not track (such as
+             the segment and floating point registers on x86, or any
+             register numbered 64 or above) are not mapped.
+
+    @param[in] nRegister The processor register number
+    @param[in] fX86 Whether the database's processor is x86
+    @return Returns the register's bit mask, or 0 if it is not tracked
+*/
+uint64
+GetTriageRegisterMask (
+    int nRegister,
+    bool fX86
+    )
+{
+    if (fX86)
+    {
+        if ((nRegister >= TRIAGE_X86_AL) && (nRegister < TRIAGE_X86_SPL))
+        {
+            nRegister = (nRegister - TRIAGE_X86_AL) & 3;
+        }
+        else if ((nRegister >= TRIAGE_X86_SPL) &&
+            (nRegister <= TRIAGE_X86_DIL))
+        {
+            nRegister = nRegister - TRIAGE_X86_SPL + TRIAGE_X86_SP;
+        }
+        else if (nRegister > TRIAGE_X86_DIL)
+        {
+            return 0;
+        }
+    }
+
+    if ((nRegister < 0) || (nRegister >= 64))
+    {
+        return 0;
+    }
+
+    return (uint64)1 << nRegister;
+}
+
+/*! 
+    @brief Determines whether an x86 register operand only covers part of a
+           general purpose register
+    @details Hex-Rays renders such accesses in 32-bit and 64-bit code with
+             the LOBYTE(), BYTE1(), LOWORD() and similar helper macros.
+
+    @param[in] op The register operand
+    @return Returns true if the operand is an 8-bit or 16-bit register
+*/
+bool
+IsPartialX86Register (
+    const op_t& op
+    )
+{
+    if ((op.reg >= TRIAGE_X86_AL) && (op.reg <= TRIAGE_X86_DIL))
+    {
+        return true;
+    }
+
+    return (op.reg < TRIAGE_X86_AL) &&
+        ((op.dtyp == dt_byte) || (op.dtyp == dt_word));
+}
+
+/*! 
+    @brief Records a reference to the stack frame for the triage pass
+    @details The frame is tracked in TRIAGE_SLOT_SIZE-byte slots. A write
+             that does not cover its slots completely keeps the rest of them,
+             just like a partial register write.
+
+    @param[in] nOffset The offset of the reference in the function's frame
+    @param[in] cbSize The size of the reference in bytes
+    @param[in] fUse Whether the instruction reads the referenced memory
+    @param[in] fChange Whether the instruction writes the referenced memory
+    @param[in,out] pScratch Receives the slot references
+*/
+void
+AddTriageSlotReferences (
+    sval_t nOffset,
+    size_t cbSize,
+    bool fUse,
+    bool fChange,
+    TRIAGE_SCRATCH* pScratch
+    )
+{
+    TRIAGE_SLOT_REF ref;
+    sval_t nFirst = nOffset / TRIAGE_SLOT_SIZE;
+    sval_t nLast = (nOffset + (sval_t)qmax(cbSize, (size_t)1) - 1) /
+        TRIAGE_SLOT_SIZE;
+    bool fPartial = ((nOffset % TRIAGE_SLOT_SIZE) != 0) ||
+        ((cbSize % TRIAGE_SLOT_SIZE) != 0);
+
+    for (sval_t nSlot = nFirst; nSlot <= nLast; nSlot++)
+    {
+        ref.nSlot = nSlot;
+        if (!fUse && !fChange)
+        {
+            //
+            // The slot's address is taken (lea)
+            //
+            ref.nKind = TRIAGE_SLOT_ESCAPE;
+            pScratch->slotRefs.push_back(
+                ref);
+            continue;
+        }
+        if (fChange)
+        {
+            ref.nKind = fPartial ? TRIAGE_SLOT_PARTIAL_DEF : TRIAGE_SLOT_DEF;
+            pScratch->slotRefs.push_back(
+                ref);
+        }
+        if (fUse)
+        {
+            ref.nKind = TRIAGE_SLOT_USE;
+            pScratch->slotRefs.push_back(
+                ref);
+        }
+    }
+}
+
+/*! 
+    @brief Decodes an instruction for the triage pass
+    @details Registers and, on x86, the slots of the function's stack frame
+             are tracked. Instructions that write to any other memory, call
+             a function, or define nothing that is tracked (such as compares
+             and branches, whose results flow into the processor's flags) are
+             sinks whose operands are always used. The implicit operands of
+             the common x86 instructions that have any are added to the
+             explicit ones; any other implicit operand is ignored.
+
+    @param[in] pFunc The function that contains the instruction
+    @param[in] ea The address of the instruction
+    @param[in] fX86 Whether the database's processor is x86
+    @param[in] nBitness The bitness of the instruction's segment (0: 16-bit,
+                        1: 32-bit, 2: 64-bit)
+    @param[in,out] pScratch Receives the instruction's stack slot references
+                            (as frame offsets divided by TRIAGE_SLOT_SIZE)
+    @param[out] pInsn Receives the decoded instruction
+    @return Returns the size of the instruction, returns 0 if there is no
+            instruction at ea
+*/
+int
+DecodeTriageInstruction (
+    func_t* pFunc,
+    ea_t ea,
+    bool fX86,
+    int nBitness,
+    TRIAGE_SCRATCH* pScratch,
+    TRIAGE_INSN* pInsn
+    )
+{
+    int cbInsn = decode_insn(
+        ea);
+    if (cbInsn <= 0)
+    {
+        return 0;
+    }
+
+    uint32 dwFeature = ph.instruc[cmd.itype].feature;
+
+    pInsn->ea = ea;
+    pInsn->qwUses = 0;
+    pInsn->qwDefs = 0;
+    pInsn->dwFlags = 0;
+    pInsn->nFirstSlotRef = (uint32)pScratch->slotRefs.size();
+
+    for (int i = 0; i < UA_MAXOP; i++)
+    {
+        const op_t& op = cmd.Operands[i];
+        bool fUse = (dwFeature & (CF_USE1 << i)) != 0;
+        bool fChange = (dwFeature & (CF_CHG1 << i)) != 0;
+
+        if (op.type == o_void)
+        {
+            break;
+        }
+
+        switch (op.type)
+        {
+        case o_reg:
+        {
+            uint64 qwRegister = GetTriageRegisterMask(
+                op.reg,
+                fX86);
+            bool fPartial = fX86 && IsPartialX86Register(op);
+
+            if (fUse)
+            {
+                pInsn->qwUses |= qwRegister;
+            }
+            if (fChange)
+            {
+                pInsn->qwDefs |= qwRegister;
+
+                //
+                // A partial write keeps the rest of the register
+                //
+                if (fPartial)
+                {
+                    pInsn->qwUses |= qwRegister;
+                }
+            }
+            if (fPartial && (nBitness != 0))
+            {
+                pInsn->dwFlags |= TRIAGE_INSN_HELPER;
+            }
+            break;
+        }
+        case o_mem:
+            if (fChange)
+            {
+                pInsn->dwFlags |= TRIAGE_INSN_SINK;
+            }
+            break;
+        case o_phrase:
+        case o_displ:
+        {
+            int nBase = op.phrase;
+
+            pInsn->qwUses |= GetTriageRegisterMask(
+                op.phrase,
+                fX86);
+
+            //
+            // With a SIB byte (specflag1), the base and index registers are
+            // taken from the SIB byte (specflag2). REX prefixes are not
+            // decoded, so in 64-bit code both register banks are used.
+            //
+            if (fX86 && (op.specflag1 != 0))
+            {
+                int nIndex = (op.specflag2 >> 3) & 7;
+
+                nBase = op.specflag2 & 7;
+                pInsn->qwUses |= GetTriageRegisterMask(nBase, fX86) |
+                    GetTriageRegisterMask(nIndex, fX86);
+                if (nBitness == 2)
+                {
+                    pInsn->qwUses |= GetTriageRegisterMask(nBase + 8, fX86) |
+                        GetTriageRegisterMask(nIndex + 8, fX86);
+                }
+            }
+
+            //
+            // References to the stack frame are tracked slot by slot
+            //
+            ea_t frameOffset = fX86 ?
+                calc_stkvar_struc_offset(pFunc, ea, i) : BADADDR;
+            if (frameOffset != BADADDR)
+            {
+                bool fAddressTaken = (cmd.itype == NN_lea);
+
+                AddTriageSlotReferences(
+                    (sval_t)frameOffset,
+                    get_dtyp_size(op.dtyp),
+                    fUse && !fAddressTaken,
+                    fChange && !fAddressTaken,
+                    pScratch);
+                break;
+            }
+
+            //
+            // A stack reference that IDA cannot place in the frame may read
+            // any slot
+            //
+            if (fX86 && !fChange &&
+                ((nBase == TRIAGE_X86_SP) || (nBase == TRIAGE_X86_BP)))
+            {
+                pInsn->dwFlags |= TRIAGE_INSN_READS_FRAME;
+            }
+            if (fChange)
+            {
+                pInsn->dwFlags |= TRIAGE_INSN_SINK;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    if (fX86)
+    {
+        uint64 qwAX = (uint64)1 << TRIAGE_X86_AX;
+        uint64 qwCX = (uint64)1 << TRIAGE_X86_CX;
+        uint64 qwDX = (uint64)1 << TRIAGE_X86_DX;
+
+        switch (cmd.itype)
+        {
+        case NN_cbw:
+        case NN_cwde:
+        case NN_cdqe:
+            pInsn->qwUses |= qwAX;
+            pInsn->qwDefs |= qwAX;
+            break;
+        case NN_cwd:
+        case NN_cdq:
+        case NN_cqo:
+            pInsn->qwUses |= qwAX;
+            pInsn->qwDefs |= qwDX;
+            break;
+        case NN_mul:
+        case NN_imul:
+        case NN_div:
+        case NN_idiv:
+            pInsn->qwUses |= qwAX | qwDX;
+            pInsn->qwDefs |= qwAX | qwDX;
+            break;
+        case NN_movs:
+        case NN_stos:
+        case NN_lods:
+        case NN_scas:
+        case NN_cmps:
+        case NN_ins:
+        case NN_outs:
+            pInsn->qwUses |= qwAX | qwCX |
+                ((uint64)1 << TRIAGE_X86_SI) | ((uint64)1 << TRIAGE_X86_DI);
+            pInsn->dwFlags |= TRIAGE_INSN_SINK | TRIAGE_INSN_READS_FRAME;
+            break;
+        case NN_leave:
+            pInsn->qwUses |= (uint64)1 << TRIAGE_X86_BP;
+            break;
+        case NN_loop:
+        case NN_loope:
+        case NN_loopne:
+        case NN_jcxz:
+        case NN_jecxz:
+        case NN_jrcxz:
+            pInsn->qwUses |= qwCX;
+            break;
+        case NN_rol:
+        case NN_ror:
+        case NN_rcl:
+        case NN_rcr:
+        case NN_shld:
+        case NN_shrd:
+        case NN_adc:
+        case NN_sbb:
+        case NN_bswap:
+            //
+            // Decompiled to __ROL4__(), __CFADD__(), _byteswap_ulong(), ...
+            //
+            pInsn->dwFlags |= TRIAGE_INSN_HELPER;
+            break;
+        default:
+            break;
+        }
+    }
+
+    //
+    // Calls use their arguments, including any passed on the stack. Only
+    // the x86 register calling conventions are known; on other processors,
+    // a call uses every register.
+    //
+    if ((dwFeature & CF_CALL) != 0)
+    {
+        pInsn->dwFlags |= TRIAGE_INSN_SINK | TRIAGE_INSN_READS_FRAME |
+            TRIAGE_INSN_CALL;
+        if (!fX86)
+        {
+            pInsn->qwUses = ~(uint64)0;
+        }
+        else
+        {
+            pInsn->qwUses |= ((uint64)1 << TRIAGE_X86_CX) |
+                ((uint64)1 << TRIAGE_X86_DX);
+            if (nBitness == 2)
+            {
+                pInsn->qwUses |= ((uint64)1 << TRIAGE_X86_SI) |
+                    ((uint64)1 << TRIAGE_X86_DI) |
+                    ((uint64)1 << TRIAGE_X86_R8) |
+                    ((uint64)1 << TRIAGE_X86_R9);
+            }
+        }
+    }
+
+    pInsn->nSlotRefs = (uint32)pScratch->slotRefs.size() -
+        pInsn->nFirstSlotRef;
+
+    bool fDefinesSlot = false;
+    for (uint32 i = 0; i < pInsn->nSlotRefs; i++)
+    {
+        if (pScratch->slotRefs[pInsn->nFirstSlotRef + i].nKind !=
+            TRIAGE_SLOT_USE)
+        {
+            fDefinesSlot = true;
+        }
+    }
+    if ((pInsn->qwDefs == 0) && !fDefinesSlot)
+    {
+        pInsn->dwFlags |= TRIAGE_INSN_SINK;
+    }
+
+    //
+    // Check for a jump to the very next instruction
+    //
+    xrefblk_t xref;
+    for (bool fOk = xref.first_from(ea, XREF_FAR); fOk; fOk = xref.next_from())
+    {
+        if (xref.iscode && ((xref.type == fl_JN) || (xref.type == fl_JF)) &&
+            (xref.to == ea + cbInsn))
+        {
+            pInsn->dwFlags |= TRIAGE_INSN_TRIVIAL_JUMP;
+        }
+    }
+
+    return cbInsn;
+}
+
+/*! 
+    @brief Numbers the stack slots referenced by a function's instructions
+    @details Replaces the frame offsets of the slot references with dense
+             slot numbers, which index the slot bits of the liveness bit
+             vectors. A slot whose address is taken may be accessed through
+             any pointer, so it is not tracked: writes to it are sinks.
+
+    @param[in,out] pScratch The decoded instructions and their slot
+                            references
+    @return Returns the number of tracked stack slots
+*/
+uint32
+NumberTriageSlots (
+    TRIAGE_SCRATCH* pScratch
+    )
+{
+    pScratch->slotOffsets.qclear();
+    for (size_t i = 0; i < pScratch->slotRefs.size(); i++)
+    {
+        pScratch->slotOffsets.push_back(
+            pScratch->slotRefs[i].nSlot);
+    }
+    std::sort(
+        pScratch->slotOffsets.begin(),
+        pScratch->slotOffsets.end());
+    pScratch->slotOffsets.resize(
+        std::unique(pScratch->slotOffsets.begin(),
+            pScratch->slotOffsets.end()) - pScratch->slotOffsets.begin());
+
+    uint32 nSlots = (uint32)pScratch->slotOffsets.size();
+
+    pScratch->escaped.qclear();
+    pScratch->escaped.resize(
+        nSlots,
+        false);
+    for (size_t i = 0; i < pScratch->slotRefs.size(); i++)
+    {
+        TRIAGE_SLOT_REF* pRef = &pScratch->slotRefs[i];
+
+        pRef->nSlot = (sval_t)(std::lower_bound(
+            pScratch->slotOffsets.begin(),
+            pScratch->slotOffsets.end(),
+            pRef->nSlot) - pScratch->slotOffsets.begin());
+        if (pRef->nKind == TRIAGE_SLOT_ESCAPE)
+        {
+            pScratch->escaped[pRef->nSlot] = true;
+        }
+    }
+
+    for (size_t i = 0; i < pScratch->instructions.size(); i++)
+    {
+        TRIAGE_INSN* pInsn = &pScratch->instructions[i];
+
+        for (uint32 j = 0; j < pInsn->nSlotRefs; j++)
+        {
+            TRIAGE_SLOT_REF* pRef =
+                &pScratch->slotRefs[pInsn->nFirstSlotRef + j];
+
+            if (!pScratch->escaped[pRef->nSlot])
+            {
+                continue;
+            }
+            if ((pRef->nKind == TRIAGE_SLOT_DEF) ||
+                (pRef->nKind == TRIAGE_SLOT_PARTIAL_DEF))
+            {
+                pInsn->dwFlags |= TRIAGE_INSN_SINK;
+            }
+            pRef->nKind = TRIAGE_SLOT_NONE;
+        }
+    }
+
+    return nSlots;
+}
+
+/*! 
+    @brief Computes the locations live before an instruction for the triage
+           pass
+    @details A location is live if its value may reach a sink. The operands
+             of an instruction whose results are all dead are therefore not
+             used, so that whole chains of junk computations are found dead.
+             The first word of the bit vector holds the registers, the
+             following words hold the stack slots.
+
+    @param[in] pScratch The slot references of the function's instructions
+    @param[in] pInsn The instruction
+    @param[in] nWords The number of words in the bit vector
+    @param[in,out] pLive The locations live after the instruction; receives
+                         the locations live before it
+    @return Returns true if the instruction is live, returns false if none
+            of its results is used
+*/
+bool
+TransferTriageLiveness (
+    const TRIAGE_SCRATCH* pScratch,
+    const TRIAGE_INSN* pInsn,
+    uint32 nWords,
+    uint64* pLive
+    )
+{
+    const TRIAGE_SLOT_REF* pRefs = pScratch->slotRefs.begin() +
+        pInsn->nFirstSlotRef;
+    bool fLive = ((pInsn->dwFlags & TRIAGE_INSN_SINK) != 0) ||
+        ((pInsn->qwDefs & pLive[0]) != 0);
+
+    for (uint32 i = 0; !fLive && (i < pInsn->nSlotRefs); i++)
+    {
+        if (((pRefs[i].nKind == TRIAGE_SLOT_DEF) ||
+            (pRefs[i].nKind == TRIAGE_SLOT_PARTIAL_DEF)) &&
+            ((pLive[1 + pRefs[i].nSlot / 64] &
+                ((uint64)1 << (pRefs[i].nSlot % 64))) != 0))
+        {
+            fLive = true;
+        }
+    }
+    if (!fLive)
+    {
+        return false;
+    }
+
+    pLive[0] = (pLive[0] & ~pInsn->qwDefs) | pInsn->qwUses;
+
+    for (uint32 i = 0; i < pInsn->nSlotRefs; i++)
+    {
+        if (pRefs[i].nKind == TRIAGE_SLOT_DEF)
+        {
+            pLive[1 + pRefs[i].nSlot / 64] &=
+                ~((uint64)1 << (pRefs[i].nSlot % 64));
+        }
+    }
+    if ((pInsn->dwFlags & TRIAGE_INSN_READS_FRAME) != 0)
+    {
+        for (uint32 i = 1; i < nWords; i++)
+        {
+            pLive[i] = ~(uint64)0;
+        }
+    }
+    for (uint32 i = 0; i < pInsn->nSlotRefs; i++)
+    {
+        if ((pRefs[i].nKind == TRIAGE_SLOT_USE) ||
+            (pRefs[i].nKind == TRIAGE_SLOT_PARTIAL_DEF))
+        {
+            pLive[1 + pRefs[i].nSlot / 64] |=
+                (uint64)1 << (pRefs[i].nSlot % 64);
+        }
+    }
+
+    return true;
+}
+
+/*! 
+    @brief Computes the locations live at the end of a block for the triage
+           pass
+    @details Every register is live on exit from the function, so return
+             values and callee-saved registers are never considered dead.
+             The stack frame is dead on exit.
+
+    @param[in] pScratch The live-in bit vectors of the function's blocks
+    @param[in] pFlowChart The function's flow chart
+    @param[in] nBlock The block
+    @param[in] nWords The number of words in each bit vector
+    @param[out] pLive Receives the locations live at the end of the block
+*/
+void
+GetTriageLiveOut (
+    const TRIAGE_SCRATCH* pScratch,
+    const qflow_chart_t* pFlowChart,
+    int nBlock,
+    uint32 nWords,
+    uint64* pLive
+    )
+{
+    pLive[0] = (pFlowChart->nsucc(nBlock) == 0) ? ~(uint64)0 : 0;
+    for (uint32 i = 1; i < nWords; i++)
+    {
+        pLive[i] = 0;
+    }
+
+    for (int i = 0; i < pFlowChart->nsucc(nBlock); i++)
+    {
+        const uint64* pSuccessorLive = pScratch->liveIn.begin() +
+            (size_t)pFlowChart->succ(nBlock, i) * nWords;
+
+        for (uint32 j = 0; j < nWords; j++)
+        {
+            pLive[j] |= pSuccessorLive[j];
+        }
+    }
+}
+
+/*! 
+    @brief Adds the functions called by an instruction to a list
+
+    @param[in] ea The call instruction
+    @param[in,out] pCallees Receives the start addresses of its callees
+*/
+void
+AddCallees (
+    ea_t ea,
+    eavec_t* pCallees
+    )
+{
+    xrefblk_t xref;
+
+    for (bool fOk = xref.first_from(ea, XREF_FAR); fOk;
+        fOk = xref.next_from())
+    {
+        if (xref.iscode &&
+            ((xref.type == fl_CN) || (xref.type == fl_CF)))
+        {
+            pCallees->push_back(
+                xref.to);
+        }
+    }
+}
+
+/*! 
+    @brief Computes a function's junk indicators without decompiling it
+    @details The function's instructions are decoded once. A backward data
+             flow analysis over the function's flow chart, with a bit vector
+             of registers and stack slots per block, then finds the register
+             definitions and stack stores that never reach a store to other
+             memory, a call, a branch or the function's exit.
+
+    @param[in] pFunc The function
+    @param[in] fX86 Whether the database's processor is x86
+    @param[in,out] pScratch Working memory, reused from one call to the next
+    @param[out] pResult Receives the function's junk indicators
+    @param[out] pUsedResults If not NULL, receives the start addresses of
+                             the functions called by x86 calls after which
+                             the return value registers are live, and of
+                             those called from blocks without a flow chart
+                             path from the entry (such as exception
+                             handlers), whose liveness is unknown
+    @return Returns true on success, returns false if the function has no
+            instructions
+*/
+bool
+TriageFunction (
+    func_t* pFunc,
+    bool fX86,
+    TRIAGE_SCRATCH* pScratch,
+    TRIAGE_RESULT* pResult,
+    eavec_t* pUsedResults
+    )
+{
+    segment_t* pSegment = getseg(
+        pFunc->startEA);
+    int nBitness = (pSegment != NULL) ? pSegment->bitness : 1;
+
+    memset(
+        pResult,
+        0,
+        sizeof(*pResult));
+    pResult->startEA = pFunc->startEA;
+
+    qflow_chart_t flowChart(
+        NULL,
+        pFunc,
+        BADADDR,
+        BADADDR,
+        FC_NOEXT);
+    int nBlocks = flowChart.size();
+
+    //
+    // Decode the function's instructions, block by block
+    //
+    pScratch->instructions.qclear();
+    pScratch->slotRefs.qclear();
+    pScratch->blockStarts.qclear();
+    for (int i = 0; i < nBlocks; i++)
+    {
+        pScratch->blockStarts.push_back(
+            (uint32)pScratch->instructions.size());
+        for (ea_t ea = flowChart.blocks[i].startEA;
+            ea < flowChart.blocks[i].endEA; )
+        {
+            TRIAGE_INSN insn;
+            int cbInsn = DecodeTriageInstruction(
+                pFunc,
+                ea,
+                fX86,
+                nBitness,
+                pScratch,
+                &insn);
+            if (cbInsn == 0)
+            {
+                break;
+            }
+            pScratch->instructions.push_back(
+                insn);
+            ea += cbInsn;
+        }
+    }
+    pScratch->blockStarts.push_back(
+        (uint32)pScratch->instructions.size());
+
+    if (pScratch->instructions.empty())
+    {
+        return false;
+    }
+
+    pResult->nStackSlots = NumberTriageSlots(
+        pScratch);
+    uint32 nWords = 1 + (pResult->nStackSlots + 63) / 64;
+
+    //
+    // Find the blocks reachable from the entry block
+    //
+    pScratch->reachable.qclear();
+    pScratch->reachable.resize(
+        nBlocks,
+        false);
+    pScratch->worklist.qclear();
+    for (int i = 0; i < nBlocks; i++)
+    {
+        if (flowChart.blocks[i].startEA == pFunc->startEA)
+        {
+            pScratch->reachable[i] = true;
+            pScratch->worklist.push_back(
+                i);
+        }
+    }
+    while (!pScratch->worklist.empty())
+    {
+        int nBlock = pScratch->worklist.back();
+        pScratch->worklist.pop_back();
+
+        for (int i = 0; i < flowChart.nsucc(nBlock); i++)
+        {
+            int nSuccessor = flowChart.succ(
+                nBlock,
+                i);
+            if (!pScratch->reachable[nSuccessor])
+            {
+                pScratch->reachable[nSuccessor] = true;
+                pScratch->worklist.push_back(
+                    nSuccessor);
+            }
+        }
+    }
+
+    //
+    // Iterate the liveness analysis to a fixpoint. Blocks are visited in
+    // reverse order, which follows the flow of liveness through most of a
+    // function's blocks in one sweep.
+    //
+    pScratch->liveIn.qclear();
+    pScratch->liveIn.resize(
+        (size_t)nBlocks * nWords,
+        0);
+    pScratch->live.qclear();
+    pScratch->live.resize(
+        nWords,
+        0);
+    uint64* pLive = pScratch->live.begin();
+    for (bool fChanged = true; fChanged; )
+    {
+        fChanged = false;
+        for (int i = nBlocks - 1; i >= 0; i--)
+        {
+            GetTriageLiveOut(
+                pScratch,
+                &flowChart,
+                i,
+                nWords,
+                pLive);
+            for (uint32 j = pScratch->blockStarts[i + 1];
+                j > pScratch->blockStarts[i]; j--)
+            {
+                TransferTriageLiveness(
+                    pScratch,
+                    &pScratch->instructions[j - 1],
+                    nWords,
+                    pLive);
+            }
+
+            uint64* pLiveIn = pScratch->liveIn.begin() + (size_t)i * nWords;
+            if (0 != memcmp(pLive, pLiveIn, nWords * sizeof(uint64)))
+            {
+                memcpy(
+                    pLiveIn,
+                    pLive,
+                    nWords * sizeof(uint64));
+                fChanged = true;
+            }
+        }
+    }
+
+    //
+    // Count the indicators
+    //
+    pResult->nInstructions = (uint32)pScratch->instructions.size();
+    pResult->nBlocks = nBlocks;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        uint32 nFirst = pScratch->blockStarts[i];
+        uint32 nEnd = pScratch->blockStarts[i + 1];
+
+        if (!pScratch->reachable[i])
+        {
+            pResult->nDeadLabels++;
+            pResult->nUnreachable += nEnd - nFirst;
+
+            for (uint32 j = nFirst; (pUsedResults != NULL) && fX86 &&
+                (j < nEnd); j++)
+            {
+                if ((pScratch->instructions[j].dwFlags &
+                    TRIAGE_INSN_CALL) != 0)
+                {
+                    AddCallees(
+                        pScratch->instructions[j].ea,
+                        pUsedResults);
+                }
+            }
+            continue;
+        }
+
+        GetTriageLiveOut(
+            pScratch,
+            &flowChart,
+            i,
+            nWords,
+            pLive);
+        for (uint32 j = nEnd; j > nFirst; j--)
+        {
+            const TRIAGE_INSN* pInsn = &pScratch->instructions[j - 1];
+
+            if ((pInsn->dwFlags & TRIAGE_INSN_HELPER) != 0)
+            {
+                pResult->nHelpers++;
+            }
+            if ((pInsn->dwFlags & TRIAGE_INSN_TRIVIAL_JUMP) != 0)
+            {
+                pResult->nDeadLabels++;
+            }
+            if ((pUsedResults != NULL) && fX86 &&
+                ((pInsn->dwFlags & TRIAGE_INSN_CALL) != 0) &&
+                ((pLive[0] & (((uint64)1 << TRIAGE_X86_AX) |
+                    ((uint64)1 << TRIAGE_X86_DX))) != 0))
+            {
+                AddCallees(
+                    pInsn->ea,
+                    pUsedResults);
+            }
+
+            bool fLive = TransferTriageLiveness(
+                pScratch,
+                pInsn,
+                nWords,
+                pLive);
+            if ((pInsn->dwFlags & TRIAGE_INSN_SINK) != 0)
+            {
+                continue;
+            }
+
+            pResult->nDefs++;
+            if (!fLive)
+            {
+                if (pInsn->qwDefs != 0)
+                {
+                    pResult->nDeadDefs++;
+                }
+                else
+                {
+                    pResult->nDeadStackStores++;
+                }
+            }
+        }
+    }
+
+    pResult->nScore = pResult->nDeadDefs + pResult->nDeadStackStores +
+        pResult->nHelpers + pResult->nDeadLabels + pResult->nUnreachable;
+
+    return true;
+}
+
+/*! 
+    @brief Determines, for every function in the database, whether any of
+           its callers uses its return value, and caches the result in the
+           CROWDDETOX_NETNODE netnode
+    @details Each caller's liveness is computed once with TriageFunction();
+             a call uses the callee's return value if eax or edx is live
+             after it, or if it sits in a block that the flow chart does
+             not connect to the entry (such as an exception handler). A
+             function that is referenced other than by direct
+             calls (through a pointer, by a jump, or as an export), or that
+             has no callers at all, may be called from anywhere, so its
+             return value is considered used. Only x86 is supported. The
+             index is rebuilt by every run that uses it, as the callers may
+             have changed since the last one.
+*/
+void
+BuildReturnIndex (
+    void
+    )
+{
+    size_t nFunctions = get_func_qty();
+    qvector<bool> used;
+    eavec_t usedResults;
+    TRIAGE_SCRATCH scratch;
+    TRIAGE_RESULT result;
+    uint32 nUnused = 0;
+
+    if (ph.id != PLFM_386)
+    {
+        msg(
+            "CrowdDetox error: Return value usage is only indexed for x86.\n");
+        return;
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+
+    if (nFunctions == 0)
+    {
+        return;
+    }
+
+    uint64 qwStart = get_nsec_stamp();
+
+    used.resize(
+        nFunctions,
+        false);
+    for (size_t i = 0; i < nFunctions; i++)
+    {
+        func_t* pFunc = getn_func(
+            i);
+        uint32 nCalls = 0;
+        xrefblk_t xref;
+
+        //
+        // Look for references other than direct calls
+        //
+        for (bool fOk = xref.first_to(pFunc->startEA, XREF_ALL); fOk;
+            fOk = xref.next_to())
+        {
+            if (xref.iscode &&
+                ((xref.type == fl_CN) || (xref.type == fl_CF)) &&
+                (get_func(xref.from) != NULL))
+            {
+                nCalls++;
+            }
+            else
+            {
+                used[i] = true;
+            }
+        }
+        if ((nCalls == 0) || is_public_name(pFunc->startEA))
+        {
+            used[i] = true;
+        }
+
+        //
+        // Mark the callees whose return values this function uses
+        //
+        usedResults.clear();
+        if (!TriageFunction(
+            pFunc,
+            true,
+            &scratch,
+            &result,
+            &usedResults))
+        {
+            continue;
+        }
+        for (size_t j = 0; j < usedResults.size(); j++)
+        {
+            int nCallee = get_func_num(
+                usedResults[j]);
+            if (nCallee >= 0)
+            {
+                used[nCallee] = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nFunctions; i++)
+    {
+        nodeCache.altset(
+            getn_func(i)->startEA,
+            RETURN_INDEXED | (used[i] ? RETURN_USED : 0),
+            CROWDDETOX_RETURN_TAG);
+        if (!used[i])
+        {
+            nUnused++;
+        }
+    }
+
+    msg(
+        "CrowdDetox: Indexed the return values of %u functions (%u never "
+        "used) in %.1f ms.\n",
+        (uint32)nFunctions,
+        nUnused,
+        (get_nsec_stamp() - qwStart) / 1e6);
+}
+
+/*! 
+    @brief Parses a hexadecimal address
+
+    @param[in] szText The text to parse
+    @param[out] pEA Receives the parsed address
+    @return Returns a pointer to the first unparsed character, or NULL if
+            szText does not begin with a hexadecimal digit
+*/
+const char*
+ParseHexAddress (
+    const char* szText,
+    ea_t* pEA
+    )
+{
+    ea_t ea = 0;
+    const char* pCurrent = szText;
+
+    //
+    // Skip an optional "0x" prefix
+    //
+    if ((pCurrent[0] == '0') && ((pCurrent[1] == 'x') || (pCurrent[1] == 'X')))
+    {
+        pCurrent += 2;
+    }
+
+    for (const char* pStart = pCurrent; ; pCurrent++)
+    {
+        if ((*pCurrent >= '0') && (*pCurrent <= '9'))
+        {
+            ea = (ea << 4) | (*pCurrent - '0');
+        }
+        else if ((*pCurrent >= 'a') && (*pCurrent <= 'f'))
+        {
+            ea = (ea << 4) | (*pCurrent - 'a' + 10);
+        }
+        else if ((*pCurrent >= 'A') && (*pCurrent <= 'F'))
+        {
+            ea = (ea << 4) | (*pCurrent - 'A' + 10);
+        }
+        else
+        {
+            if (pCurrent == pStart)
+            {
+                return NULL;
+            }
+            break;
+        }
+    }
+
+    *pEA = ea;
+    return pCurrent;
+}
+
+/*! 
+    @brief Parses the CrowdDetox plugin options given on the IDA command line
+    @details Options are given as -OCrowdDetox:key=value;key=value where the
+             supported keys are:
+             range=<start>-<end>  Only process functions in [start, end)
+             list=<path>          Only process the functions listed in a file
+             out=<path>           Write detoxed pseudocode to this file
+             workers=<n>          Number of worker processes (coordinator)
+             shard=<n>            Functions per shard (coordinator)
+             ida=<path>           IDA executable to launch as a worker
+             checkpoint=<n>       Functions between checkpoints (0: none)
+             threads=<n>          Analysis threads alongside the decompiler
+             export=<path>        Stream pseudocode and statistics to a file
+             format=<jsonl|binary> Format of the export file (default: jsonl)
+             memory=<MB>          Memory budget of the pipeline (0: none)
+             stats=<path>         Write per-function statistics as CSV
+             early=<0|1>          Also detox each ctree as soon as it is built
+             deadstores=<0|1>     Time the dead-store analysis of each function
+             maturity=<name>      Ctree maturity at which to detox (built,
+                                  trans1, nice, trans2, cpa, trans3, casted
+                                  or final; default: final)
+             signatures=<path>    Load junk signatures from a file
+             arena=<KB>           Block size of the Detox() scratch arenas
+             worker=<n>           Set by the coordinator on its workers
+
+    @param[in] szOptions The option string, or NULL if no options were given
+    @param[out] pOptions Receives the parsed options
+    @return Returns true on success, returns false if the options are invalid
+*/
+bool
+ParseBatchOptions (
+    const char* szOptions,
+    BATCH_OPTIONS* pOptions
+    )
+{
+    qstring strKey;
+    qstring strValue;
+
+    pOptions->startEA = 0;
+    pOptions->endEA = BADADDR;
+    pOptions->strListPath.clear();
+    pOptions->strOutputPath.clear();
+    pOptions->nWorkers = 0;
+    pOptions->nShardSize = CROWDDETOX_DEFAULT_SHARD_SIZE;
+    pOptions->strIdaPath.clear();
+    pOptions->nWorkerIndex = -1;
+    pOptions->nCheckpointInterval = CROWDDETOX_DEFAULT_CHECKPOINT_INTERVAL;
+    pOptions->nThreads = -1;
+    pOptions->strExportPath.clear();
+    pOptions->nExportFormat = CROWDDETOX_EXPORT_JSONL;
+    pOptions->nMemoryBudgetMB = CROWDDETOX_DEFAULT_MEMORY_BUDGET_MB;
+    pOptions->strStatsPath.clear();
+    pOptions->fEarlyDetox = false;
+    pOptions->fDeadStores = false;
+    pOptions->nMaturity = CMAT_FINAL;
+    pOptions->strSignaturesPath.clear();
+    pOptions->fPurity = false;
+    pOptions->fGlobals = false;
+    pOptions->fReturns = false;
+    pOptions->fParameters = false;
+    pOptions->nArenaBlockKB = CROWDDETOX_DEFAULT_ARENA_BLOCK_KB;
+
+    if (szOptions == NULL)
+    {
+        return true;
+    }
+
+    while (*szOptions != '\0')
+    {
+        //
+        // Split the next "key=value" pair
+        //
+        strKey.clear();
+        strValue.clear();
+        while ((*szOptions != '\0') && (*szOptions != '=') &&
+            (*szOptions != ';'))
+        {
+            strKey.append(*szOptions++);
+        }
+        if (*szOptions == '=')
+        {
+            szOptions++;
+            while ((*szOptions != '\0') && (*szOptions != ';'))
+            {
+                strValue.append(*szOptions++);
+            }
+        }
+        if (*szOptions == ';')
+        {
+            szOptions++;
+        }
+
+        if (strKey.empty())
+        {
+            continue;
+        }
+        else if (strKey == "range")
+        {
+            const char* pEnd = ParseHexAddress(
+                strValue.c_str(),
+                &pOptions->startEA);
+            if ((pEnd == NULL) || (*pEnd != '-') ||
+                (NULL == ParseHexAddress(pEnd + 1, &pOptions->endEA)))
+            {
+                msg(
+                    "CrowdDetox error: Invalid range \"%s\".\n",
+                    strValue.c_str());
+                return false;
+            }
+        }
+        else if (strKey == "list")
+        {
+            pOptions->strListPath = strValue;
+        }
+        else if (strKey == "out")
+        {
+            pOptions->strOutputPath = strValue;
+        }
+        else if (strKey == "workers")
+        {
+            pOptions->nWorkers = atoi(
+                strValue.c_str());
+        }
+        else if (strKey == "shard")
+        {
+            pOptions->nShardSize = atoi(
+                strValue.c_str());
+            if (pOptions->nShardSize == 0)
+            {
+                pOptions->nShardSize = CROWDDETOX_DEFAULT_SHARD_SIZE;
+            }
+        }
+        else if (strKey == "ida")
+        {
+            pOptions->strIdaPath = strValue;
+        }
+        else if (strKey == "checkpoint")
+        {
+            pOptions->nCheckpointInterval = atoi(
+                strValue.c_str());
+        }
+        else if (strKey == "threads")
+        {
+            pOptions->nThreads = atoi(
+                strValue.c_str());
+        }
+        else if (strKey == "export")
+        {
+            pOptions->strExportPath = strValue;
+        }
+        else if (strKey == "format")
+        {
+            if (strValue == "jsonl")
+            {
+                pOptions->nExportFormat = CROWDDETOX_EXPORT_JSONL;
+            }
+            else if (strValue == "binary")
+            {
+                pOptions->nExportFormat = CROWDDETOX_EXPORT_BINARY;
+            }
+            else
+            {
+                msg(
+                    "CrowdDetox error: Invalid export format \"%s\".\n",
+                    strValue.c_str());
+                return false;
+            }
+        }
+        else if (strKey == "memory")
+        {
+            pOptions->nMemoryBudgetMB = atoi(
+                strValue.c_str());
+        }
+        else if (strKey == "stats")
+        {
+            pOptions->strStatsPath = strValue;
+        }
+        else if (strKey == "early")
+        {
+            pOptions->fEarlyDetox = (0 != atoi(
+                strValue.c_str()));
+        }
+        else if (strKey == "deadstores")
+        {
+            pOptions->fDeadStores = (0 != atoi(
+                strValue.c_str()));
+        }
+        else if (strKey == "maturity")
+        {
+            size_t i = CMAT_BUILT;
+            while ((i < _countof(g_aszMaturityNames)) &&
+                (0 != strcmp(strValue.c_str(), g_aszMaturityNames[i])))
+            {
+                i++;
+            }
+            if (i == _countof(g_aszMaturityNames))
+            {
+                msg(
+                    "CrowdDetox error: Invalid maturity \"%s\".\n",
+                    strValue.c_str());
+                return false;
+            }
+            pOptions->nMaturity = (ctree_maturity_t)i;
+        }
+        else if (strKey == "signatures")
+        {
+            pOptions->strSignaturesPath = strValue;
+        }
+        else if (strKey == "purity")
+        {
+            pOptions->fPurity = (0 != atoi(
+                strValue.c_str()));
+        }
+        else if (strKey == "globals")
+        {
+            pOptions->fGlobals = (0 != atoi(
+                strValue.c_str()));
+        }
+        else if (strKey == "returns")
+        {
+            pOptions->fReturns = (0 != atoi(
+                strValue.c_str()));
+        }
+        else if (strKey == "params")
+        {
+            pOptions->fParameters = (0 != atoi(
+                strValue.c_str()));
+        }
+        else if (strKey == "arena")
+        {
+            pOptions->nArenaBlockKB = atoi(
+                strValue.c_str());
+            if (pOptions->nArenaBlockKB == 0)
+            {
+                msg(
+                    "CrowdDetox error: Invalid arena block size \"%s\".\n",
+                    strValue.c_str());
+                return false;
+            }
+        }
+        else if (strKey == "worker")
+        {
+            pOptions->nWorkerIndex = atoi(
+                strValue.c_str());
+        }
+        else
+        {
+            msg(
+                "CrowdDetox error: Unknown option \"%s\".\n",
+                strKey.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*! 
+    @brief Applies the parsed options that configure the Detox() steps
+           themselves, whatever runs them
+    @details Loads the junk signatures file, if any, sets the block size
+             of the scratch arenas, and selects the database-wide indexes
+             that the Detox() steps use.
+
+    @param[in] pOptions The parsed options
+    @return Returns true on success, returns false if the junk signatures
+            cannot be loaded
+*/
+bool
+ApplyBatchOptions (
+    const BATCH_OPTIONS* pOptions
+    )
+{
+    if (!pOptions->strSignaturesPath.empty() && !LoadJunkSignatures(
+        pOptions->strSignaturesPath.c_str()))
+    {
+        return false;
+    }
+    g_cbArenaBlockSize = (size_t)pOptions->nArenaBlockKB << 10;
+    g_fPurity = pOptions->fPurity;
+    g_fGlobalIndex = pOptions->fGlobals;
+    g_fReturnIndex = pOptions->fReturns;
+    g_fParameterIndex = pOptions->fParameters;
+
+    return true;
+}
+
+/*! 
+    @brief Builds the list of functions that a batch run should process
+
+    @param[in] pOptions The batch options
+    @param[out] pFunctions Receives the start addresses of the functions
+    @return Returns true on success, returns false on error
+*/
+bool
+CollectBatchFunctions (
+    const BATCH_OPTIONS* pOptions,
+    eavec_t* pFunctions
+    )
+{
+    pFunctions->clear();
+
+    //
+    // If no list file was given, process every function in the range
+    //
+    if (pOptions->strListPath.empty())
+    {
+        for (size_t i = 0; i < get_func_qty(); i++)
+        {
+            func_t* pFunc = getn_func(
+                i);
+            if ((pFunc != NULL) &&
+                (pFunc->startEA >= pOptions->startEA) &&
+                (pFunc->startEA < pOptions->endEA))
+            {
+                pFunctions->push_back(
+                    pFunc->startEA);
+            }
+        }
+
+        return true;
+    }
+
+    //
+    // Otherwise, read one hexadecimal function address per line
+    //
+    FILE* pListFile = qfopen(
+        pOptions->strListPath.c_str(),
+        "r");
+    if (pListFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot open function list \"%s\".\n",
+            pOptions->strListPath.c_str());
+        return false;
+    }
+
+    char szLine[MAXSTR];
+    while (NULL != qfgets(szLine, sizeof(szLine), pListFile))
+    {
+        ea_t ea;
+        const char* pLine = szLine;
+
+        while ((*pLine == ' ') || (*pLine == '\t'))
+        {
+            pLine++;
+        }
+        if (NULL == ParseHexAddress(pLine, &ea))
+        {
+            continue;
+        }
+
+        func_t* pFunc = get_func(
+            ea);
+        if (pFunc == NULL)
+        {
+            msg(
+                "CrowdDetox: %a is not in a function; skipping it.\n",
+                ea);
+            continue;
+        }
+        pFunctions->add_unique(
+            pFunc->startEA);
+    }
+
+    qfclose(
+        pListFile);
+
+    return true;
+}
+
+/*! 
+    @brief Sorts a batch run's functions so that callees come before their
+           callers
+    @details The functions are sorted in depth-first post-order of the call
+             graph of their direct calls, so that each function is detoxed
+             after the functions it calls and can use their parameter
+             bitmaps. Recursive calls are broken where the search meets
+             them.
+
+    @param[in,out] pFunctions The start addresses of the functions to sort
+*/
+void
+SortFunctionsBottomUp (
+    eavec_t* pFunctions
+    )
+{
+    eavec_t sorted;
+    eavec_t order;
+    eavec_t callees;
+    qvector<bool> visited;
+    qvector<uint32> nodeStack;
+    qvector<uint32> positionStack;
+    qvector<uint32> firstStack;
+
+    for (size_t i = 0; i < pFunctions->size(); i++)
+    {
+        sorted.push_back(
+            pFunctions->at(i));
+    }
+    std::sort(
+        sorted.begin(),
+        sorted.end());
+    visited.resize(
+        sorted.size(),
+        false);
+
+    for (size_t i = 0; i < pFunctions->size(); i++)
+    {
+        ea_t ea = pFunctions->at(i);
+
+        for (;;)
+        {
+            //
+            // Visit ea if it is one of the functions to sort
+            //
+            ea_t* pFound = std::lower_bound(
+                sorted.begin(),
+                sorted.end(),
+                ea);
+            if ((pFound != sorted.end()) && (*pFound == ea) &&
+                !visited[pFound - sorted.begin()])
+            {
+                uint32 nFunction = (uint32)(pFound - sorted.begin());
+                func_t* pFunc = get_func(
+                    ea);
+                func_item_iterator_t items;
+                xrefblk_t xref;
+
+                visited[nFunction] = true;
+                nodeStack.push_back(
+                    nFunction);
+                firstStack.push_back(
+                    (uint32)callees.size());
+                positionStack.push_back(
+                    (uint32)callees.size());
+                for (bool fOk = (pFunc != NULL) && items.set(pFunc); fOk;
+                    fOk = items.next_code())
+                {
+                    for (bool fRef = xref.first_from(items.current(),
+                        XREF_FAR); fRef; fRef = xref.next_from())
+                    {
+                        if (xref.iscode &&
+                            ((xref.type == fl_CN) || (xref.type == fl_CF)))
+                        {
+                            callees.push_back(
+                                xref.to);
+                        }
+                    }
+                }
+            }
+            if (nodeStack.empty())
+            {
+                break;
+            }
+
+            //
+            // Continue with the next callee of the innermost function, or
+            // finish that function once all of its callees are done
+            //
+            if (positionStack.back() < callees.size())
+            {
+                ea = callees[positionStack.back()++];
+                continue;
+            }
+            order.push_back(
+                sorted[nodeStack.back()]);
+            callees.resize(
+                firstStack.back());
+            nodeStack.pop_back();
+            positionStack.pop_back();
+            firstStack.pop_back();
+            if (nodeStack.empty())
+            {
+                break;
+            }
+            ea = BADADDR;
+        }
+    }
+
+    pFunctions->swap(
+        order);
+}
+
+/*! 
+    @brief Writes the given function's pseudocode to a file
+
+    @param[in] pOutputFile The file to write to
+    @param[in] pFunction The decompiled function
+*/
+void
+WriteFunctionPseudocode (
+    FILE* pOutputFile,
+    cfunc_t* pFunction
+    )
+{
+    char szLine[MAXSTR * 4];
+
+    qfprintf(
+        pOutputFile,
+        "//----- (%a) ----------------------------------------------------\n",
+        pFunction->entry_ea);
+
+    const strvec_t& lines = pFunction->get_pseudocode();
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        tag_remove(
+            lines[i].line.c_str(),
+            szLine,
+            sizeof(szLine) - 1);
+        qfprintf(
+            pOutputFile,
+            "%s\n",
+            szLine);
+    }
+
+    qfprintf(
+        pOutputFile,
+        "\n");
+}
+
+/*! 
+    @brief Builds the path of the batch output file
+
+    @param[in] pOptions The batch options
+    @param[out] szOutputPath Receives the output path
+    @param[in] cbOutputPath The size of the szOutputPath buffer
+*/
+void
+GetBatchOutputPath (
+    const BATCH_OPTIONS* pOptions,
+    char* szOutputPath,
+    size_t cbOutputPath
+    )
+{
+    //
+    // Default to <database>.detox.c
+    //
+    if (pOptions->strOutputPath.empty())
+    {
+        set_file_ext(
+            szOutputPath,
+            cbOutputPath,
+            database_idb,
+            "detox.c");
+    }
+    else
+    {
+        qstrncpy(
+            szOutputPath,
+            pOptions->strOutputPath.c_str(),
+            cbOutputPath);
+    }
+}
+
+/*! 
+    @brief Entry point of a batch run's export writer thread
+    @details Writes each buffer handed over by the main thread until fStop
+             is set.
+
+    @param[in] pContext The EXPORT_WRITER
+    @return Always returns 0
+*/
+int
+idaapi
+ExportWriterThreadMain (
+    void* pContext
+    )
+{
+    EXPORT_WRITER* pWriter = (EXPORT_WRITER*)pContext;
+
+    for (;;)
+    {
+        qsem_wait(
+            pWriter->hBufferReady,
+            -1);
+        if (pWriter->fStop)
+        {
+            break;
+        }
+
+        size_t cbUsed = pWriter->acbUsed[pWriter->nWriting];
+        if (cbUsed != (size_t)qfwrite(
+            pWriter->pFile,
+            pWriter->apBuffers[pWriter->nWriting],
+            cbUsed))
+        {
+            pWriter->fFailed = true;
+        }
+
+        qsem_post(
+            pWriter->hBufferWritten);
+    }
+
+    return 0;
+}
+
+/*! 
+    @brief Waits until the export writer thread has written the buffer that
+           was last handed over to it, if any
+
+    @param[in,out] pWriter The export writer
+*/
+void
+WaitForExportWriter (
+    EXPORT_WRITER* pWriter
+    )
+{
+    if (pWriter->fWriting)
+    {
+        qsem_wait(
+            pWriter->hBufferWritten,
+            -1);
+        pWriter->fWriting = false;
+    }
+}
+
+/*! 
+    @brief Hands the buffer being filled over to the export writer thread
+           and continues with the other buffer
+
+    @param[in,out] pWriter The export writer
+*/
+void
+HandOffExportBuffer (
+    EXPORT_WRITER* pWriter
+    )
+{
+    if (pWriter->acbUsed[pWriter->nFilling] == 0)
+    {
+        return;
+    }
+
+    //
+    // The other buffer must have been written before it can be refilled
+    //
+    WaitForExportWriter(
+        pWriter);
+
+    pWriter->nWriting = pWriter->nFilling;
+    pWriter->fWriting = true;
+    qsem_post(
+        pWriter->hBufferReady);
+
+    pWriter->nFilling ^= 1;
+    pWriter->acbUsed[pWriter->nFilling] = 0;
+}
+
+/*! 
+    @brief Appends data to a batch run's export stream
+
+    @param[in,out] pWriter The export writer
+    @param[in] pData The data to append
+    @param[in] cbData The size of the data
+*/
+void
+AppendExportData (
+    EXPORT_WRITER* pWriter,
+    const void* pData,
+    size_t cbData
+    )
+{
+    if (pWriter->acbUsed[pWriter->nFilling] + cbData >
+        CROWDDETOX_EXPORT_BUFFER_SIZE)
+    {
+        HandOffExportBuffer(
+            pWriter);
+    }
+
+    //
+    // Data that does not fit into an empty buffer is written right here,
+    // once the writer thread is idle
+    //
+    if (cbData > CROWDDETOX_EXPORT_BUFFER_SIZE)
+    {
+        WaitForExportWriter(
+            pWriter);
+        if (cbData != (size_t)qfwrite(pWriter->pFile, pData, cbData))
+        {
+            pWriter->fFailed = true;
+        }
+        return;
+    }
+
+    memcpy(
+        pWriter->apBuffers[pWriter->nFilling] +
+            pWriter->acbUsed[pWriter->nFilling],
+        pData,
+        cbData);
+    pWriter->acbUsed[pWriter->nFilling] += cbData;
+}
+
+/*! 
+    @brief Writes everything appended to a batch run's export stream so far
+           to disk
+
+    @param[in,out] pWriter The export writer
+    @return Returns the size of the export file
+*/
+uint64
+SyncExportWriter (
+    EXPORT_WRITER* pWriter
+    )
+{
+    if (pWriter->pFile == NULL)
+    {
+        return 0;
+    }
+
+    HandOffExportBuffer(
+        pWriter);
+    WaitForExportWriter(
+        pWriter);
+    qflush(
+        pWriter->pFile);
+
+    return qftell(
+        pWriter->pFile);
+}
+
+/*! 
+    @brief Stops a batch run's export writer and closes its file
+
+    @param[in,out] pWriter The export writer
+    @return Returns true on success, returns false if a write failed
+*/
+bool
+StopExportWriter (
+    EXPORT_WRITER* pWriter
+    )
+{
+    bool fSucceeded = true;
+
+    if (pWriter->hThread != NULL)
+    {
+        SyncExportWriter(
+            pWriter);
+
+        pWriter->fStop = true;
+        qsem_post(
+            pWriter->hBufferReady);
+        qthread_join(
+            pWriter->hThread);
+        qthread_free(
+            pWriter->hThread);
+        pWriter->hThread = NULL;
+
+        if (pWriter->fFailed)
+        {
+            msg(
+                "CrowdDetox error: Cannot write to \"%s\".\n",
+                pWriter->szPath);
+            fSucceeded = false;
+        }
+    }
+
+    if (pWriter->hBufferReady != NULL)
+    {
+        qsem_free(
+            pWriter->hBufferReady);
+        pWriter->hBufferReady = NULL;
+    }
+    if (pWriter->hBufferWritten != NULL)
+    {
+        qsem_free(
+            pWriter->hBufferWritten);
+        pWriter->hBufferWritten = NULL;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        qfree(
+            pWriter->apBuffers[i]);
+        pWriter->apBuffers[i] = NULL;
+    }
+    if (pWriter->pFile != NULL)
+    {
+        qfclose(
+            pWriter->pFile);
+        pWriter->pFile = NULL;
+    }
+    pWriter->strRecord.qclear();
+
+    return fSucceeded;
+}
+
+/*! 
+    @brief Opens a batch run's export file and starts its writer thread
+
+    @param[out] pWriter Receives the export writer
+    @param[in] szExportPath The path of the export file
+    @param[in] nFormat The CROWDDETOX_EXPORT_* format of the export file
+    @param[in] fAppend If true, records are appended to an existing file
+    @return Returns true on success, returns false on error
+*/
+bool
+StartExportWriter (
+    EXPORT_WRITER* pWriter,
+    const char* szExportPath,
+    int nFormat,
+    bool fAppend
+    )
+{
+    qstrncpy(
+        pWriter->szPath,
+        szExportPath,
+        sizeof(pWriter->szPath));
+    pWriter->nFormat = nFormat;
+    pWriter->nFilling = 0;
+    pWriter->nWriting = 0;
+    pWriter->fWriting = false;
+    pWriter->fStop = false;
+    pWriter->fFailed = false;
+    pWriter->acbUsed[0] = 0;
+    pWriter->acbUsed[1] = 0;
+    pWriter->apBuffers[0] = (char*)qalloc(
+        CROWDDETOX_EXPORT_BUFFER_SIZE);
+    pWriter->apBuffers[1] = (char*)qalloc(
+        CROWDDETOX_EXPORT_BUFFER_SIZE);
+    pWriter->hBufferReady = qsem_create(
+        NULL,
+        0);
+    pWriter->hBufferWritten = qsem_create(
+        NULL,
+        0);
+    pWriter->hThread = NULL;
+    pWriter->pFile = qfopen(
+        szExportPath,
+        fAppend ? "ab" : "wb");
+
+    if ((pWriter->pFile != NULL) && fAppend)
+    {
+        qfseek(
+            pWriter->pFile,
+            0,
+            SEEK_END);
+    }
+
+    if ((pWriter->pFile != NULL) && (pWriter->apBuffers[0] != NULL) &&
+        (pWriter->apBuffers[1] != NULL) && (pWriter->hBufferReady != NULL) &&
+        (pWriter->hBufferWritten != NULL))
+    {
+        pWriter->hThread = qthread_create(
+            ExportWriterThreadMain,
+            pWriter);
+    }
+
+    if (pWriter->hThread == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot start exporting to \"%s\".\n",
+            szExportPath);
+        StopExportWriter(
+            pWriter);
+        return false;
+    }
+
+    return true;
+}
+
+/*! 
+    @brief Appends a string to a JSON string literal, escaping it as needed
+
+    @param[in,out] pJson The JSON document
+    @param[in] szText The string to append
+*/
+void
+AppendJsonEscaped (
+    qstring* pJson,
+    const char* szText
+    )
+{
+    for (const uchar* p = (const uchar*)szText; *p != '\0'; p++)
+    {
+        switch (*p)
+        {
+        case '"':
+            pJson->append("\\\"");
+            break;
+        case '\\':
+            pJson->append("\\\\");
+            break;
+        case '\n':
+            pJson->append("\\n");
+            break;
+        case '\r':
+            pJson->append("\\r");
+            break;
+        case '\t':
+            pJson->append("\\t");
+            break;
+        default:
+            if (*p < 0x20)
+            {
+                pJson->cat_sprnt(
+                    "\\u%04x",
+                    *p);
+            }
+            else
+            {
+                pJson->append(
+                    (char)*p);
+            }
+            break;
+        }
+    }
+}
+
+/*! 
+    @brief Streams a detoxed function's pseudocode and statistics to a
+           batch run's export file
+    @details In CROWDDETOX_EXPORT_JSONL format, each function is one line
+             holding a JSON object; in CROWDDETOX_EXPORT_BINARY format, it
+             is an EXPORT_RECORD_HEADER followed by the function's name and
+             pseudocode.
+
+    @param[in,out] pWriter The export writer
+    @param[in] pFunction The detoxed function
+    @param[in] ea The function's start address
+    @param[in] pEntry The function's results
+*/
+void
+ExportFunction (
+    EXPORT_WRITER* pWriter,
+    cfunc_t* pFunction,
+    ea_t ea,
+    const DETOX_CACHE_ENTRY* pEntry
+    )
+{
+    char szName[MAXSTR];
+    char szLine[MAXSTR * 4];
+    qstring* pRecord = &pWriter->strRecord;
+
+    if (NULL == get_func_name(ea, szName, sizeof(szName)))
+    {
+        szName[0] = '\0';
+    }
+
+    pRecord->qclear();
+    if (pWriter->nFormat == CROWDDETOX_EXPORT_JSONL)
+    {
+        pRecord->sprnt(
+            "{\"ea\":\"0x%a\",\"name\":\"",
+            ea);
+        AppendJsonEscaped(
+            pRecord,
+            szName);
+        pRecord->cat_sprnt(
+            "\",\"items_before\":%u,\"items_after\":%u,"
+            "\"lvars_cleared\":%u,\"decompile_ns\":%" FMT_64 "u,"
+            "\"detox_ns\":%" FMT_64 "u,\"code\":\"",
+            pEntry->nItemsBefore,
+            pEntry->nItemsAfter,
+            pEntry->nVariablesCleared,
+            pEntry->qwDecompileNs,
+            pEntry->qwDetoxNs);
+
+        const strvec_t& lines = pFunction->get_pseudocode();
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            tag_remove(
+                lines[i].line.c_str(),
+                szLine,
+                sizeof(szLine) - 1);
+            if (i != 0)
+            {
+                pRecord->append(
+                    "\\n");
+            }
+            AppendJsonEscaped(
+                pRecord,
+                szLine);
+        }
+
+        pRecord->append(
+            "\"}\n");
+    }
+    else
+    {
+        EXPORT_RECORD_HEADER header;
+
+        //
+        // Reserve room for the header, which is filled in once the
+        // record's size is known
+        //
+        pRecord->resize(
+            sizeof(header));
+        pRecord->append(
+            szName);
+
+        size_t cbCodeStart = pRecord->length();
+        const strvec_t& lines = pFunction->get_pseudocode();
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            tag_remove(
+                lines[i].line.c_str(),
+                szLine,
+                sizeof(szLine) - 1);
+            if (i != 0)
+            {
+                pRecord->append(
+                    '\n');
+            }
+            pRecord->append(
+                szLine);
+        }
+
+        header.cbRecord = (uint32)pRecord->length();
+        header.qwEA = ea;
+        header.nItemsBefore = pEntry->nItemsBefore;
+        header.nItemsAfter = pEntry->nItemsAfter;
+        header.nVariablesCleared = pEntry->nVariablesCleared;
+        header.qwDecompileNs = pEntry->qwDecompileNs;
+        header.qwDetoxNs = pEntry->qwDetoxNs;
+        header.cbName = (uint32)strlen(szName);
+        header.cbCode = (uint32)(pRecord->length() - cbCodeStart);
+        memcpy(
+            pRecord->begin(),
+            &header,
+            sizeof(header));
+    }
+
+    AppendExportData(
+        pWriter,
+        pRecord->c_str(),
+        pRecord->length());
+}
+
+/*! 
+    @brief Writes the header line of a batch statistics CSV file
+
+    @param[in] pStatsFile The CSV file
+*/
+void
+WriteStatsHeader (
+    FILE* pStatsFile
+    )
+{
+    qfprintf(
+        pStatsFile,
+        "ea,name,items_before,items_after,junk_pct,statements_pruned,"
+        "lvars_cleared,labels_relocated,gotos_to_returns,rounds,"
+        "predicates_folded,mba_simplified,signature_matches,decompile_us,"
+        "detox_us,analyze_arena_bytes,apply_arena_bytes\n");
+}
+
+/*! 
+    @brief Appends a quoted CSV field to a string
+    @details Any quotes inside of the field are doubled.
+
+    @param[in,out] pString The string to append to
+    @param[in] szField The field's text
+*/
+void
+AppendCsvQuoted (
+    qstring* pString,
+    const char* szField
+    )
+{
+    pString->append(
+        '"');
+    for (const char* p = szField; *p != '\0'; p++)
+    {
+        if (*p == '"')
+        {
+            pString->append(
+                '"');
+        }
+        pString->append(
+            *p);
+    }
+    pString->append(
+        '"');
+}
+
+/*! 
+    @brief Writes one line of a batch statistics CSV file
+
+    @param[in] pStatsFile The CSV file
+    @param[in] szEA The line's first column: a function's start address or
+                    "total"
+    @param[in] szName The function (or database) name
+    @param[in] pStats The Detox() statistics
+    @param[in] qwDecompileNs The time spent decompiling
+    @param[in] qwDetoxNs The time spent detoxing
+*/
+void
+WriteStatsLine (
+    FILE* pStatsFile,
+    const char* szEA,
+    const char* szName,
+    const DETOX_STATS* pStats,
+    uint64 qwDecompileNs,
+    uint64 qwDetoxNs
+    )
+{
+    qstring strName;
+
+    AppendCsvQuoted(
+        &strName,
+        szName);
+
+    qfprintf(
+        pStatsFile,
+        "%s,%s,%u,%u,%.1f,%u,%u,%u,%u,%u,%u,%u,%u,%" FMT_64 "u,%" FMT_64
+            "u,%u,%u\n",
+        szEA,
+        strName.c_str(),
+        pStats->nItemsBefore,
+        pStats->nItemsAfter,
+        pStats->nItemsBefore != 0 ?
+            100.0 * (pStats->nItemsBefore - pStats->nItemsAfter) /
+                pStats->nItemsBefore : 0.0,
+        pStats->nStatementsPruned,
+        pStats->nVariablesCleared,
+        pStats->nLabelsRelocated,
+        pStats->nGotosConverted,
+        pStats->nRounds,
+        pStats->nPredicatesFolded,
+        pStats->nExpressionsSimplified,
+        pStats->nSignatureMatches,
+        qwDecompileNs / 1000,
+        qwDetoxNs / 1000,
+        (uint32)pStats->cbAnalyzeArena,
+        (uint32)pStats->cbApplyArena);
+}
+
+/*! 
+    @brief Appends a "total" line, summing up every function of the
+           database, to a batch statistics CSV file
+    @details The totals are read back from the file itself, so that they
+             include functions resumed from a checkpoint or detoxed by
+             worker processes. The arena columns of the total are the
+             largest of any function rather than sums.
+
+    @param[in] szStatsPath The path of the CSV file
+*/
+void
+AppendStatsRollup (
+    const char* szStatsPath
+    )
+{
+    char szLine[MAXSTR];
+    DETOX_STATS totals;
+    uint64 qwDecompileUs = 0;
+    uint64 qwDetoxUs = 0;
+    uint32 nFunctions = 0;
+
+    memset(
+        &totals,
+        0,
+        sizeof(totals));
+
+    FILE* pStatsFile = qfopen(
+        szStatsPath,
+        "r");
+    if (pStatsFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot open \"%s\".\n",
+            szStatsPath);
+        return;
+    }
+
+    while (NULL != qfgets(szLine, sizeof(szLine), pStatsFile))
+    {
+        uint64 aqwColumns[15];
+        const char* p = szLine;
+
+        //
+        // Skip the header line, any earlier total, and the address column
+        //
+        if (((*p < '0') || (*p > '9')) && ((*p < 'A') || (*p > 'F')) &&
+            ((*p < 'a') || (*p > 'f')))
+        {
+            continue;
+        }
+        if (0 == strncmp(p, "ea,", 3))
+        {
+            continue;
+        }
+        p = strchr(
+            p,
+            ',');
+        if ((p == NULL) || (p[1] != '"'))
+        {
+            continue;
+        }
+
+        //
+        // Skip the quoted name
+        //
+        for (p += 2; *p != '\0'; p++)
+        {
+            if (*p == '"')
+            {
+                if (p[1] != '"')
+                {
+                    break;
+                }
+                p++;
+            }
+        }
+        if (*p != '"')
+        {
+            continue;
+        }
+        p++;
+
+        //
+        // Read the numeric columns; junk_pct (the third) is recomputed
+        //
+        size_t nColumns = 0;
+        while ((*p == ',') && (nColumns < _countof(aqwColumns)))
+        {
+            uint64 qwValue = 0;
+
+            for (p++; (*p >= '0') && (*p <= '9'); p++)
+            {
+                qwValue = qwValue * 10 + (*p - '0');
+            }
+            if (*p == '.')
+            {
+                for (p++; (*p >= '0') && (*p <= '9'); p++)
+                {
+                }
+            }
+            aqwColumns[nColumns++] = qwValue;
+        }
+        if (nColumns != _countof(aqwColumns))
+        {
+            continue;
+        }
+
+        totals.nItemsBefore += (uint32)aqwColumns[0];
+        totals.nItemsAfter += (uint32)aqwColumns[1];
+        totals.nStatementsPruned += (uint32)aqwColumns[3];
+        totals.nVariablesCleared += (uint32)aqwColumns[4];
+        totals.nLabelsRelocated += (uint32)aqwColumns[5];
+        totals.nGotosConverted += (uint32)aqwColumns[6];
+        totals.nRounds += (uint32)aqwColumns[7];
+        totals.nPredicatesFolded += (uint32)aqwColumns[8];
+        totals.nExpressionsSimplified += (uint32)aqwColumns[9];
+        totals.nSignatureMatches += (uint32)aqwColumns[10];
+        qwDecompileUs += aqwColumns[11];
+        qwDetoxUs += aqwColumns[12];
+        totals.cbAnalyzeArena = qmax(
+            totals.cbAnalyzeArena,
+            (size_t)aqwColumns[13]);
+        totals.cbApplyArena = qmax(
+            totals.cbApplyArena,
+            (size_t)aqwColumns[14]);
+        nFunctions++;
+    }
+    qfclose(
+        pStatsFile);
+
+    pStatsFile = qfopen(
+        szStatsPath,
+        "a");
+    if (pStatsFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot open \"%s\".\n",
+            szStatsPath);
+        return;
+    }
+    WriteStatsLine(
+        pStatsFile,
+        "total",
+        qbasename(database_idb),
+        &totals,
+        qwDecompileUs * 1000,
+        qwDetoxUs * 1000);
+    qfclose(
+        pStatsFile);
+
+    msg(
+        "CrowdDetox: %u functions hold %u items, %u of which (%.1f%%) are "
+        "junk; %u statements and %u variables were pruned.\n",
+        nFunctions,
+        totals.nItemsBefore,
+        totals.nItemsBefore - totals.nItemsAfter,
+        totals.nItemsBefore != 0 ?
+            100.0 * (totals.nItemsBefore - totals.nItemsAfter) /
+                totals.nItemsBefore : 0.0,
+        totals.nStatementsPruned,
+        totals.nVariablesCleared);
+}
+
+/*! 
+    @brief Appends a record to a batch run's journal
+
+    @param[in] pRun The batch run
+    @param[in] pRecord The record to append
+    @param[in] fFlush If true, the journal is flushed to disk
+*/
+void
+AppendJournalRecord (
+    BATCH_RUN* pRun,
+    const JOURNAL_RECORD* pRecord,
+    bool fFlush
+    )
+{
+    if (pRun->pJournalFile == NULL)
+    {
+        return;
+    }
+
+    qfwrite(
+        pRun->pJournalFile,
+        pRecord,
+        sizeof(*pRecord));
+
+    if (fFlush)
+    {
+        qflush(
+            pRun->pJournalFile);
+    }
+}
+
+/*! 
+    @brief Writes a checkpoint to a batch run's journal
+    @details The output files (including the export stream) are flushed
+             first, then the results of every
+             function completed since the previous checkpoint are journaled,
+             followed by a JOURNAL_CHECKPOINT record holding the output
+             files' sizes.
+
+    @param[in,out] pRun The batch run
+*/
+void
+CheckpointBatchRun (
+    BATCH_RUN* pRun
+    )
+{
+    JOURNAL_RECORD record;
+
+    if (pRun->pJournalFile == NULL)
+    {
+        return;
+    }
+
+    qflush(
+        pRun->pOutputFile);
+    if (pRun->pRecordFile != NULL)
+    {
+        qflush(
+            pRun->pRecordFile);
+    }
+    if (pRun->pStatsFile != NULL)
+    {
+        qflush(
+            pRun->pStatsFile);
+    }
+
+    for (size_t i = 0; i < pRun->pending.size(); i++)
+    {
+        AppendJournalRecord(
+            pRun,
+            &pRun->pending[i],
+            false);
+    }
+    pRun->pending.qclear();
+
+    memset(
+        &record,
+        0,
+        sizeof(record));
+    record.bType = JOURNAL_CHECKPOINT;
+    record.qwOutputSize = qftell(
+        pRun->pOutputFile);
+    record.qwRecordSize = (pRun->pRecordFile != NULL) ?
+        qftell(pRun->pRecordFile) : 0;
+    record.qwExportSize = SyncExportWriter(
+        &pRun->exportWriter);
+    record.qwStatsSize = (pRun->pStatsFile != NULL) ?
+        qftell(pRun->pStatsFile) : 0;
+    AppendJournalRecord(
+        pRun,
+        &record,
+        true);
+}
+
+/*! 
+    @brief Truncates a file to the given size
+
+    @param[in] szPath The path of the file
+    @param[in] qwSize The new size of the file
+    @return Returns true on success, returns false on error
+*/
+bool
+TruncateFile (
+    const char* szPath,
+    uint64 qwSize
+    )
+{
+    int hFile = qopen(
+        szPath,
+        O_RDWR | O_BINARY);
+    if (hFile == -1)
+    {
+        return qwSize == 0;
+    }
+
+    bool fTruncated = (0 == qchsize(hFile, qwSize));
+    qclose(
+        hFile);
+
+    return fTruncated;
+}
+
+/*! 
+    @brief Closes the output files of a batch run
+
+    @param[in,out] pRun The batch run
+    @param[in] fCompleted If true, a final checkpoint is written and the
+                          journal is deleted, since there is nothing left to
+                          resume
+*/
+void
+EndBatchRun (
+    BATCH_RUN* pRun,
+    bool fCompleted
+    )
+{
+    if (fCompleted)
+    {
+        CheckpointBatchRun(
+            pRun);
+    }
+
+    if (pRun->pJournalFile != NULL)
+    {
+        qfclose(
+            pRun->pJournalFile);
+        pRun->pJournalFile = NULL;
+
+        if (fCompleted)
+        {
+            qunlink(
+                pRun->szJournalPath);
+        }
+    }
+    StopExportWriter(
+        &pRun->exportWriter);
+    if (pRun->pStatsFile != NULL)
+    {
+        qfclose(
+            pRun->pStatsFile);
+        pRun->pStatsFile = NULL;
+    }
+    if (pRun->pRecordFile != NULL)
+    {
+        qfclose(
+            pRun->pRecordFile);
+        pRun->pRecordFile = NULL;
+    }
+    if (pRun->pOutputFile != NULL)
+    {
+        qfclose(
+            pRun->pOutputFile);
+        pRun->pOutputFile = NULL;
+    }
+}
+
+/*! 
+    @brief Opens the output files of a batch run, resuming from the last
+           checkpoint of an interrupted run if its journal exists
+
+    @details The journal is an append-only file of JOURNAL_RECORD structures
+             stored next to the output file. Results journaled before the
+             last checkpoint are kept and the corresponding functions are
+             removed from pFunctions; everything written after that
+             checkpoint is discarded. A function that was being decompiled
+             when the interrupted run died is recorded as known-crashing and
+             is skipped as well.
+
+    @param[in] szOutputPath The path of the pseudocode output file
+    @param[in] szRecordPath If not NULL, the path of the DETOX_RESULT_RECORD
+                            output file; otherwise, results are cached in the
+                            CROWDDETOX_NETNODE netnode
+    @param[in] szExportPath If not NULL, the path of the export file
+    @param[in] nExportFormat The CROWDDETOX_EXPORT_* format of the export
+                             file
+    @param[in] szStatsPath If not NULL, the path of the CSV statistics file
+    @param[in] nCheckpointInterval Number of functions between checkpoints;
+                                   0 disables checkpointing
+    @param[in,out] pFunctions The functions to process; on return, functions
+                              completed or known to crash in an earlier run
+                              have been removed
+    @param[out] pRun Receives the batch run's state
+    @param[in,out] pSummary Receives the number of resumed and skipped
+                            functions
+    @return Returns true on success, returns false on error
+*/
+bool
+BeginBatchRun (
+    const char* szOutputPath,
+    const char* szRecordPath,
+    const char* szExportPath,
+    int nExportFormat,
+    const char* szStatsPath,
+    uint32 nCheckpointInterval,
+    eavec_t* pFunctions,
+    BATCH_RUN* pRun,
+    BATCH_SUMMARY* pSummary
+    )
+{
+    JOURNAL_RECORD record;
+    qvector<JOURNAL_RECORD> committed;
+    qvector<JOURNAL_RECORD> uncommitted;
+    eavec_t skip;
+    uint64 qwJournalSize = 0;
+    uint64 qwOutputSize = 0;
+    uint64 qwRecordSize = 0;
+    uint64 qwExportSize = 0;
+    uint64 qwStatsSize = 0;
+    ea_t eaInFlight = BADADDR;
+    bool fResuming = false;
+
+    pRun->pOutputFile = NULL;
+    pRun->pRecordFile = NULL;
+    pRun->pJournalFile = NULL;
+    pRun->pStatsFile = NULL;
+    pRun->nCheckpointInterval = nCheckpointInterval;
+    pRun->pending.clear();
+    pRun->exportWriter.pFile = NULL;
+    pRun->exportWriter.szPath[0] = '\0';
+    pRun->exportWriter.hThread = NULL;
+    pRun->exportWriter.hBufferReady = NULL;
+    pRun->exportWriter.hBufferWritten = NULL;
+    pRun->exportWriter.apBuffers[0] = NULL;
+    pRun->exportWriter.apBuffers[1] = NULL;
+    qsnprintf(
+        pRun->szJournalPath,
+        sizeof(pRun->szJournalPath),
+        "%s.journal",
+        szOutputPath);
+
+    //
+    // Replay the journal of an interrupted run, if any
+    //
+    FILE* pJournalFile = (nCheckpointInterval != 0) ?
+        qfopen(pRun->szJournalPath, "rb") : NULL;
+    if (pJournalFile != NULL)
+    {
+        uint64 qwOffset = 0;
+
+        fResuming = true;
+        while (sizeof(record) == qfread(pJournalFile, &record, sizeof(record)))
+        {
+            qwOffset += sizeof(record);
+
+            switch (record.bType)
+            {
+            case JOURNAL_STARTED:
+                eaInFlight = record.ea;
+                break;
+            case JOURNAL_DONE:
+                if (record.ea == eaInFlight)
+                {
+                    eaInFlight = BADADDR;
+                }
+                uncommitted.push_back(
+                    record);
+                break;
+            case JOURNAL_CRASHED:
+                uncommitted.push_back(
+                    record);
+                break;
+            case JOURNAL_CHECKPOINT:
+                for (size_t i = 0; i < uncommitted.size(); i++)
+                {
+                    committed.push_back(
+                        uncommitted[i]);
+                }
+                uncommitted.clear();
+                qwJournalSize = qwOffset;
+                qwOutputSize = record.qwOutputSize;
+                qwRecordSize = record.qwRecordSize;
+                qwExportSize = record.qwExportSize;
+                qwStatsSize = record.qwStatsSize;
+                break;
+            default:
+                break;
+            }
+        }
+        qfclose(
+            pJournalFile);
+
+        //
+        // Discard everything written after the last checkpoint
+        //
+        if (!TruncateFile(pRun->szJournalPath, qwJournalSize) ||
+            !TruncateFile(szOutputPath, qwOutputSize) ||
+            ((szRecordPath != NULL) &&
+                !TruncateFile(szRecordPath, qwRecordSize)) ||
+            ((szExportPath != NULL) &&
+                !TruncateFile(szExportPath, qwExportSize)) ||
+            ((szStatsPath != NULL) &&
+                !TruncateFile(szStatsPath, qwStatsSize)))
+        {
+            msg(
+                "CrowdDetox error: Cannot roll back \"%s\" to its last "
+                "checkpoint.\n",
+                szOutputPath);
+            return false;
+        }
+    }
+
+    //
+    // Open the output files, appending to them when resuming
+    //
+    pRun->pOutputFile = qfopen(
+        szOutputPath,
+        fResuming ? "ab" : "wb");
+    if ((pRun->pOutputFile != NULL) && (szRecordPath != NULL))
+    {
+        pRun->pRecordFile = qfopen(
+            szRecordPath,
+            fResuming ? "ab" : "wb");
+    }
+    if ((pRun->pOutputFile != NULL) && (szStatsPath != NULL))
+    {
+        pRun->pStatsFile = qfopen(
+            szStatsPath,
+            fResuming ? "ab" : "wb");
+    }
+    if ((nCheckpointInterval != 0) && (pRun->pOutputFile != NULL))
+    {
+        pRun->pJournalFile = qfopen(
+            pRun->szJournalPath,
+            fResuming ? "ab" : "wb");
+    }
+    if ((pRun->pOutputFile == NULL) ||
+        ((szRecordPath != NULL) && (pRun->pRecordFile == NULL)) ||
+        ((szStatsPath != NULL) && (pRun->pStatsFile == NULL)) ||
+        ((nCheckpointInterval != 0) && (pRun->pJournalFile == NULL)))
+    {
+        msg(
+            "CrowdDetox error: Cannot create \"%s\" or its journal.\n",
+            szOutputPath);
+        EndBatchRun(
+            pRun,
+            false);
+        return false;
+    }
+    if ((szExportPath != NULL) && !StartExportWriter(
+        &pRun->exportWriter,
+        szExportPath,
+        nExportFormat,
+        fResuming))
+    {
+        EndBatchRun(
+            pRun,
+            false);
+        return false;
+    }
+
+    if (!fResuming)
+    {
+        return true;
+    }
+
+    //
+    // Checkpoints record qftell() positions, so make sure that they start
+    // at the (rolled back) end of each file
+    //
+    qfseek(
+        pRun->pOutputFile,
+        0,
+        SEEK_END);
+    if (pRun->pRecordFile != NULL)
+    {
+        qfseek(
+            pRun->pRecordFile,
+            0,
+            SEEK_END);
+    }
+    if (pRun->pStatsFile != NULL)
+    {
+        qfseek(
+            pRun->pStatsFile,
+            0,
+            SEEK_END);
+    }
+
+    //
+    // Restore the committed results and skip their functions
+    //
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+    for (size_t i = 0; i < committed.size(); i++)
+    {
+        skip.push_back(
+            committed[i].ea);
+
+        if (committed[i].bType == JOURNAL_CRASHED)
+        {
+            pSummary->nCrashing++;
+            continue;
+        }
+
+        if (szRecordPath == NULL)
+        {
+            nodeCache.supset(
+                committed[i].ea,
+                &committed[i].entry,
+                sizeof(committed[i].entry));
+        }
+        pSummary->nResumed++;
+    }
+
+    //
+    // The function that was being decompiled when the previous run died is
+    // presumed to crash the decompiler; commit that finding right away
+    //
+    if (eaInFlight != BADADDR)
+    {
+        msg(
+            "CrowdDetox: %a was being processed when the previous run died; "
+            "skipping it.\n",
+            eaInFlight);
+
+        memset(
+            &record,
+            0,
+            sizeof(record));
+        record.bType = JOURNAL_CRASHED;
+        record.ea = eaInFlight;
+        pRun->pending.push_back(
+            record);
+        CheckpointBatchRun(
+            pRun);
+
+        skip.push_back(
+            eaInFlight);
+        pSummary->nCrashing++;
+    }
+
+    //
+    // Remove the completed and crashing functions from the work list
+    //
+    std::sort(
+        skip.begin(),
+        skip.end());
+    size_t nKept = 0;
+    for (size_t i = 0; i < pFunctions->size(); i++)
+    {
+        if (!std::binary_search(skip.begin(), skip.end(), pFunctions->at(i)))
+        {
+            pFunctions->at(nKept++) = pFunctions->at(i);
+        }
+    }
+    pFunctions->resize(
+        nKept);
+
+    msg(
+        "CrowdDetox: Resuming \"%s\": %u functions already done, %u known to "
+        "crash.\n",
+        szOutputPath,
+        pSummary->nResumed,
+        pSummary->nCrashing);
+
+    return true;
+}
+
+/*! 
+    @brief Entry point of a Detox analysis thread
+    @details Runs AnalyzeMirror() on every job submitted to the thread until
+             a NULL job is received.
+
+    @param[in] pContext The thread's DETOX_THREAD
+    @return Always returns 0
+*/
+int
+idaapi
+DetoxThreadMain (
+    void* pContext
+    )
+{
+    DETOX_THREAD* pThread = (DETOX_THREAD*)pContext;
+    DETOX_JOB* pJob;
+
+    for (;;)
+    {
+        qsem_wait(
+            pThread->hJobsAvailable,
+            -1);
+        if (!pThread->jobs.Pop(&pJob))
+        {
+            continue;
+        }
+        if (pJob == NULL)
+        {
+            break;
+        }
+
+        uint64 qwStart = get_nsec_stamp();
+        AnalyzeMirror(
+            &pJob->mirror,
+            &pJob->edits,
+            &pThread->scratch);
+        pJob->qwAnalyzeNs = get_nsec_stamp() - qwStart;
+        pThread->qwBusyNs += pJob->qwAnalyzeNs;
+
+        //
+        // The results queue holds at least as many entries as may be
+        // outstanding on this thread, so this never fails
+        //
+        pThread->results.Push(
+            pJob);
+        qsem_post(
+            pThread->hResultsAvailable);
+    }
+
+    return 0;
+}
+
+/*! 
+    @brief Starts the Detox analysis threads of a batch run
+
+    @param[out] pPool Receives the started threads
+    @param[in] nThreads The number of threads to start
+    @return Returns true on success, returns false on error
+*/
+bool
+StartDetoxThreads (
+    DETOX_THREAD_POOL* pPool,
+    int nThreads
+    )
+{
+    pPool->hResultsAvailable = qsem_create(
+        NULL,
+        0);
+    if (pPool->hResultsAvailable == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < nThreads; i++)
+    {
+        DETOX_THREAD* pThread = new DETOX_THREAD();
+        pThread->hResultsAvailable = pPool->hResultsAvailable;
+        pThread->hJobsAvailable = qsem_create(
+            NULL,
+            0);
+        if (pThread->hJobsAvailable != NULL)
+        {
+            pThread->hThread = qthread_create(
+                DetoxThreadMain,
+                pThread);
+        }
+        if (pThread->hThread == NULL)
+        {
+            if (pThread->hJobsAvailable != NULL)
+            {
+                qsem_free(
+                    pThread->hJobsAvailable);
+            }
+            delete pThread;
+            break;
+        }
+
+        pPool->threads.push_back(
+            pThread);
+    }
+
+    return !pPool->threads.empty();
+}
+
+/*! 
+    @brief Stops the Detox analysis threads of a batch run; all submitted
+           jobs must have been collected first
+
+    @param[in,out] pPool The threads to stop
+    @return Returns the total time the threads spent analyzing
+*/
+uint64
+StopDetoxThreads (
+    DETOX_THREAD_POOL* pPool
+    )
+{
+    uint64 qwBusyNs = 0;
+
+    for (size_t i = 0; i < pPool->threads.size(); i++)
+    {
+        DETOX_THREAD* pThread = pPool->threads[i];
+
+        pThread->jobs.Push(
+            NULL);
+        qsem_post(
+            pThread->hJobsAvailable);
+        qthread_join(
+            pThread->hThread);
+        qthread_free(
+            pThread->hThread);
+        qsem_free(
+            pThread->hJobsAvailable);
+
+        qwBusyNs += pThread->qwBusyNs;
+        delete pThread;
+    }
+    pPool->threads.clear();
+
+    if (pPool->hResultsAvailable != NULL)
+    {
+        qsem_free(
+            pPool->hResultsAvailable);
+        pPool->hResultsAvailable = NULL;
+    }
+
+    return qwBusyNs;
+}
+
+/*! 
+    @brief Hands a flattened function to the least busy analysis thread
+
+    @param[in,out] pPool The analysis threads
+    @param[in] pJob The job to submit
+    @return Returns true if the job was submitted, returns false if every
+            thread already has CROWDDETOX_JOBS_PER_THREAD outstanding jobs
+*/
+bool
+SubmitDetoxJob (
+    DETOX_THREAD_POOL* pPool,
+    DETOX_JOB* pJob
+    )
+{
+    DETOX_THREAD* pIdlest = NULL;
+
+    for (size_t i = 0; i < pPool->threads.size(); i++)
+    {
+        DETOX_THREAD* pThread = pPool->threads[i];
+        if ((pThread->nOutstanding < CROWDDETOX_JOBS_PER_THREAD) &&
+            ((pIdlest == NULL) ||
+                (pThread->nOutstanding < pIdlest->nOutstanding)))
+        {
+            pIdlest = pThread;
+        }
+    }
+    if (pIdlest == NULL)
+    {
+        return false;
+    }
+
+    pIdlest->nOutstanding++;
+    pIdlest->jobs.Push(
+        pJob);
+    qsem_post(
+        pIdlest->hJobsAvailable);
+
+    return true;
+}
+
+/*! 
+    @brief Collects the jobs that the analysis threads have finished
+
+    @param[in,out] pPool The analysis threads
+    @param[in] fWait If true, blocks until at least one job is collected
+*/
+void
+CollectDetoxJobs (
+    DETOX_THREAD_POOL* pPool,
+    bool fWait
+    )
+{
+    DETOX_JOB* pJob;
+
+    if (pPool->threads.empty())
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        bool fCollected = false;
+
+        for (size_t i = 0; i < pPool->threads.size(); i++)
+        {
+            DETOX_THREAD* pThread = pPool->threads[i];
+            while (pThread->results.Pop(&pJob))
+            {
+                pThread->nOutstanding--;
+                pJob->fAnalyzed = true;
+                fCollected = true;
+            }
+        }
+
+        if (fCollected || !fWait)
+        {
+            return;
+        }
+
+        qsem_wait(
+            pPool->hResultsAvailable,
+            -1);
+    }
+}
+
+/*! 
+    @brief Writes a batch function's results once its junk has been removed
+
+    @param[in,out] pRun The batch run
+    @param[in] pJob The detoxed function
+    @param[in] pStats The function's Detox() statistics
+    @param[in] pNodeCache The CROWDDETOX_NETNODE netnode
+    @param[in,out] pSummary Accumulates the batch totals
+*/
+void
+FinishBatchFunction (
+    BATCH_RUN* pRun,
+    const DETOX_JOB* pJob,
+    const DETOX_STATS* pStats,
+    netnode* pNodeCache,
+    BATCH_SUMMARY* pSummary
+    )
+{
+    DETOX_RESULT_RECORD record;
+    JOURNAL_RECORD journalRecord;
+
+    WriteFunctionPseudocode(
+        pRun->pOutputFile,
+        pJob->pFunction);
+
+    //
+    // Record this function's results
+    //
+    record.ea = pJob->ea;
+    record.entry.nItemsBefore = pStats->nItemsBefore;
+    record.entry.nItemsAfter = pStats->nItemsAfter;
+    record.entry.nVariablesCleared = pStats->nVariablesCleared;
+    record.entry.qwDecompileNs = pJob->qwDecompileNs;
+    record.entry.qwDetoxNs =
+        pJob->qwFlattenNs + pJob->qwAnalyzeNs + pJob->qwApplyNs;
+    record.dwParameters = (uint32)pNodeCache->altval(
+        record.ea,
+        CROWDDETOX_PARAMETER_TAG);
+    if (pRun->pRecordFile != NULL)
+    {
+        qfwrite(
+            pRun->pRecordFile,
+            &record,
+            sizeof(record));
+    }
+    else
+    {
+        pNodeCache->supset(
+            record.ea,
+            &record.entry,
+            sizeof(record.entry));
+    }
+    if (pRun->exportWriter.pFile != NULL)
+    {
+        ExportFunction(
+            &pRun->exportWriter,
+            pJob->pFunction,
+            record.ea,
+            &record.entry);
+    }
+    if (pRun->pStatsFile != NULL)
+    {
+        char szEA[32];
+        char szName[MAXSTR];
+
+        qsnprintf(
+            szEA,
+            sizeof(szEA),
+            "%a",
+            record.ea);
+        if (NULL == get_func_name(record.ea, szName, sizeof(szName)))
+        {
+            szName[0] = '\0';
+        }
+        WriteStatsLine(
+            pRun->pStatsFile,
+            szEA,
+            szName,
+            pStats,
+            record.entry.qwDecompileNs,
+            record.entry.qwDetoxNs);
+    }
+
+    pSummary->qwDecompileNs += record.entry.qwDecompileNs;
+    pSummary->qwDetoxNs += record.entry.qwDetoxNs;
+    pSummary->nDetoxed++;
+    pSummary->cbPeakAnalyzeArena = qmax(
+        pSummary->cbPeakAnalyzeArena,
+        pStats->cbAnalyzeArena);
+    pSummary->cbPeakApplyArena = qmax(
+        pSummary->cbPeakApplyArena,
+        pStats->cbApplyArena);
+
+    //
+    // Journal the result and checkpoint periodically
+    //
+    if (pRun->pJournalFile != NULL)
+    {
+        memset(
+            &journalRecord,
+            0,
+            sizeof(journalRecord));
+        journalRecord.bType = JOURNAL_DONE;
+        journalRecord.ea = record.ea;
+        journalRecord.entry = record.entry;
+        pRun->pending.push_back(
+            journalRecord);
+        if (pRun->pending.size() >= pRun->nCheckpointInterval)
+        {
+            CheckpointBatchRun(
+                pRun);
+        }
+    }
+}
+
+/*! 
+    @brief Journals that the main thread is about to work on a function in
+           the decompiler, so that a run resumed after a crash knows to skip
+           that function
+
+    @param[in,out] pRun The batch run
+    @param[in] ea The function's start address
+*/
+void
+JournalFunctionStarted (
+    BATCH_RUN* pRun,
+    ea_t ea
+    )
+{
+    JOURNAL_RECORD journalRecord;
+
+    memset(
+        &journalRecord,
+        0,
+        sizeof(journalRecord));
+    journalRecord.bType = JOURNAL_STARTED;
+    journalRecord.ea = ea;
+    AppendJournalRecord(
+        pRun,
+        &journalRecord,
+        true);
+}
+
+/*! 
+    @brief Hex-Rays callback function that runs the Detox() steps on a batch
+           run's function while it is being decompiled
+    @details Only installed when Detox() runs at a maturity other than
+             CMAT_FINAL; Hex-Rays' remaining passes then run on the detoxed
+             ctree, so the steps cannot be handed to an analysis thread.
+
+    @param[in] pUserData The DETOX_HOOK
+    @param[in] event Hex-Rays decompiler event code
+    @param[in] va Additional arguments
+    @return Always returns 0
+*/
+int
+idaapi
+BatchDetoxEventCallback (
+    void* pUserData,
+    hexrays_event_t event,
+    va_list va
+    )
+{
+    DETOX_HOOK* pHook = (DETOX_HOOK*)pUserData;
+    cfunc_t* pFunction;
+    ctree_maturity_t maturity;
+
+    if (event != hxe_maturity)
+    {
+        return 0;
+    }
+
+    pFunction = va_arg(
+        va,
+        cfunc_t*);
+    maturity = va_argi(
+        va,
+        ctree_maturity_t);
+    if ((maturity != pHook->maturity) || (pHook->pJob == NULL) ||
+        pHook->pJob->fDetoxed)
+    {
+        return 0;
+    }
+
+    DETOX_JOB* pJob = pHook->pJob;
+
+    uint64 qwStart = get_nsec_stamp();
+    FlattenFunction(
+        pFunction,
+        &pJob->mirror,
+        pHook->pScratch);
+    uint64 qwFlattened = get_nsec_stamp();
+    AnalyzeMirror(
+        &pJob->mirror,
+        &pJob->edits,
+        pHook->pScratch);
+    uint64 qwAnalyzed = get_nsec_stamp();
+    ApplyDetoxEdits(
+        pFunction,
+        &pJob->mirror,
+        &pJob->edits,
+        pHook->pScratch,
+        &pJob->stats);
+
+    pJob->qwFlattenNs = qwFlattened - qwStart;
+    pJob->qwAnalyzeNs = qwAnalyzed - qwFlattened;
+    pJob->qwApplyNs = get_nsec_stamp() - qwAnalyzed;
+    pJob->fDetoxed = true;
+
+    return 0;
+}
+
+/*! 
+    @brief Takes a job from a batch run's pool of recycled jobs, creating a
+           new one if the pool is empty
+
+    @param[in,out] pFreeJobs The recycled jobs
+    @param[in] ea The start address of the function to process
+    @return Returns the job
+*/
+DETOX_JOB*
+AcquireDetoxJob (
+    qvector<DETOX_JOB*>* pFreeJobs,
+    ea_t ea
+    )
+{
+    DETOX_JOB* pJob;
+
+    if (pFreeJobs->empty())
+    {
+        pJob = new DETOX_JOB();
+    }
+    else
+    {
+        pJob = pFreeJobs->back();
+        pFreeJobs->pop_back();
+    }
+
+    pJob->ea = ea;
+    pJob->fAnalyzed = false;
+    pJob->fDetoxed = false;
+    pJob->qwDecompileNs = 0;
+    pJob->qwFlattenNs = 0;
+    pJob->qwAnalyzeNs = 0;
+    pJob->qwApplyNs = 0;
+    pJob->qwMemoryBytes = 0;
+
+    return pJob;
+}
+
+/*! 
+    @brief Returns a finished job to a batch run's pool of recycled jobs
+    @details The job's decompilation is released; its mirror and edit list
+             keep their memory for the next function.
+
+    @param[in,out] pFreeJobs The recycled jobs
+    @param[in] pJob The finished job
+*/
+void
+ReleaseDetoxJob (
+    qvector<DETOX_JOB*>* pFreeJobs,
+    DETOX_JOB* pJob
+    )
+{
+    pJob->pFunction = cfuncptr_t(NULL);
+    pFreeJobs->push_back(
+        pJob);
+}
+
+/*! 
+    @brief Estimates the memory held by a flattened batch job
+    @details Counts the job's mirror and edit list, and the decompilation
+             itself at CROWDDETOX_BYTES_PER_CTREE_ITEM per item.
+
+    @param[in] pJob The job
+    @return Returns the estimated size of the job in bytes
+*/
+uint64
+EstimateJobMemory (
+    const DETOX_JOB* pJob
+    )
+{
+    uint64 nItems = pJob->mirror.items.size();
+    uint64 nVariables = pJob->mirror.variableFlags.size();
+
+    return
+        nItems * (sizeof(MIRROR_ITEM) + sizeof(citem_t*) +
+            CROWDDETOX_BYTES_PER_CTREE_ITEM) +
+        (nItems + 63) / 64 * sizeof(uint64) +
+        nVariables * (2 * sizeof(uint8) + sizeof(lvar_t));
+}
+
+/*! 
+    @brief Sums the estimated memory of a batch run's in-flight jobs
+
+    @param[in] pInFlight The in-flight jobs
+    @return Returns the estimated size of the jobs in bytes
+*/
+uint64
+GetQueuedMemory (
+    const qvector<DETOX_JOB*>* pInFlight
+    )
+{
+    uint64 qwBytes = 0;
+
+    for (size_t i = 0; i < pInFlight->size(); i++)
+    {
+        qwBytes += pInFlight->at(i)->qwMemoryBytes;
+    }
+
+    return qwBytes;
+}
+
+/*! 
+    @brief Returns the memory kept for reuse by a batch run to the heap,
+           after a function that was too large to be kept around
+
+    @param[in,out] pFreeJobs The recycled jobs, which are deleted
+    @param[in,out] pScratch The main thread's working memory
+*/
+void
+TrimDetoxMemory (
+    qvector<DETOX_JOB*>* pFreeJobs,
+    DETOX_SCRATCH* pScratch
+    )
+{
+    for (size_t i = 0; i < pFreeJobs->size(); i++)
+    {
+        delete pFreeJobs->at(i);
+    }
+    pFreeJobs->clear();
+
+    pScratch->openItems.clear();
+    FreeArena(
+        &pScratch->arena);
+}
+
+/*! 
+    @brief Returns the peak resident set size of the IDA process
+
+    @return Returns the peak resident set size in bytes, or 0 if unknown
+*/
+uint64
+GetPeakResidentSetSize (
+    void
+    )
+{
+#ifdef __NT__
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (!GetProcessMemoryInfo(
+        GetCurrentProcess(),
+        &counters,
+        sizeof(counters)))
+    {
+        return 0;
+    }
+
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+
+    if (0 != getrusage(RUSAGE_SELF, &usage))
+    {
+        return 0;
+    }
+
+    //
+    // ru_maxrss is in bytes on Mac OS and in kilobytes on Linux
+    //
+#ifdef __MAC__
+    return (uint64)usage.ru_maxrss;
+#else
+    return (uint64)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+/*! 
+    @brief Applies and writes the results of the oldest in-flight jobs whose
+           analysis has finished, preserving submission order
+
+    @param[in,out] pRun The batch run
+    @param[in,out] pInFlight The in-flight jobs, oldest first
+    @param[in,out] pFreeJobs Receives the finished jobs for recycling
+    @param[in,out] pScratch The main thread's working memory
+    @param[in] pNodeCache The CROWDDETOX_NETNODE netnode
+    @param[in,out] pSummary Accumulates the batch totals
+*/
+void
+FinishAnalyzedJobs (
+    BATCH_RUN* pRun,
+    qvector<DETOX_JOB*>* pInFlight,
+    qvector<DETOX_JOB*>* pFreeJobs,
+    DETOX_SCRATCH* pScratch,
+    netnode* pNodeCache,
+    BATCH_SUMMARY* pSummary
+    )
+{
+    size_t nFinished = 0;
+
+    while ((nFinished < pInFlight->size()) &&
+        pInFlight->at(nFinished)->fAnalyzed)
+    {
+        DETOX_JOB* pJob = pInFlight->at(nFinished++);
+
+        JournalFunctionStarted(
+            pRun,
+            pJob->ea);
+
+        if (!pJob->fDetoxed)
+        {
+            uint64 qwStart = get_nsec_stamp();
+            ApplyDetoxEdits(
+                pJob->pFunction,
+                &pJob->mirror,
+                &pJob->edits,
+                pScratch,
+                &pJob->stats);
+            pJob->qwApplyNs = get_nsec_stamp() - qwStart;
+        }
+
+        FinishBatchFunction(
+            pRun,
+            pJob,
+            &pJob->stats,
+            pNodeCache,
+            pSummary);
+
+        ReleaseDetoxJob(
+            pFreeJobs,
+            pJob);
+    }
+
+    if (nFinished != 0)
+    {
+        pInFlight->erase(
+            pInFlight->begin(),
+            pInFlight->begin() + nFinished);
+    }
+}
+
+/*! 
+    @brief Waits for in-flight jobs and finishes them, oldest first, until
+           the estimated memory of the remaining jobs fits a limit
+
+    @param[in,out] pPool The analysis threads
+    @param[in,out] pRun The batch run
+    @param[in,out] pInFlight The in-flight jobs, oldest first
+    @param[in,out] pFreeJobs Receives the finished jobs for recycling
+    @param[in,out] pScratch The main thread's working memory
+    @param[in] pNodeCache The CROWDDETOX_NETNODE netnode
+    @param[in,out] pSummary Accumulates the batch totals
+    @param[in] qwLimit The memory limit in bytes; 0 finishes every job
+*/
+void
+DrainDetoxJobs (
+    DETOX_THREAD_POOL* pPool,
+    BATCH_RUN* pRun,
+    qvector<DETOX_JOB*>* pInFlight,
+    qvector<DETOX_JOB*>* pFreeJobs,
+    DETOX_SCRATCH* pScratch,
+    netnode* pNodeCache,
+    BATCH_SUMMARY* pSummary,
+    uint64 qwLimit
+    )
+{
+    while (!pInFlight->empty() &&
+        ((qwLimit == 0) || (GetQueuedMemory(pInFlight) > qwLimit)))
+    {
+        CollectDetoxJobs(
+            pPool,
+            true);
+        FinishAnalyzedJobs(
+            pRun,
+            pInFlight,
+            pFreeJobs,
+            pScratch,
+            pNodeCache,
+            pSummary);
+    }
+}
+
+/*! 
+    @brief Decompiles and detoxes a list of functions without any UI
+           interaction
+    @details With analysis threads, the work is pipelined: while the main
+             thread decompiles and flattens the next function, the threads
+             run AnalyzeMirror() on the previous ones; finished edit lists
+             come back through each thread's lock-free results queue and are
+             applied on the main thread in submission order. Jobs and each
+             thread's working memory are reused from one function to the
+             next, so that the steady state does not allocate.
+
+             The pipeline only decompiles the next function while the
+             queued functions fit the memory budget. A function that
+             exceeds the budget on its own is processed alone, after the
+             pipeline has been drained.
+
+    @param[in] pFunctions The start addresses of the functions to process
+    @param[in] nThreads The number of analysis threads; 0 runs every step on
+                        the calling thread
+    @param[in] qwMemoryBudget The memory budget of the queued functions in
+                              bytes; 0 means unlimited
+    @param[in] fEarlyDetox Whether to also run DetoxEarly() on each function
+                           while it is decompiled
+    @param[in] fDeadStores Whether to run TriageFunction()'s dead-store
+                           analysis on each function before decompiling it
+    @param[in] maturity The ctree maturity at which to detox; at any other
+                        maturity than CMAT_FINAL, every function is detoxed
+                        on the main thread while it is decompiled
+    @param[in,out] pRun The batch run whose files receive the results; if it
+                        has no record file, a DETOX_CACHE_ENTRY is stored in
+                        the CROWDDETOX_NETNODE netnode for each function
+    @param[in,out] pSummary Accumulates the batch totals
+*/
+void
+DetoxFunctionList (
+    const eavec_t* pFunctions,
+    int nThreads,
+    uint64 qwMemoryBudget,
+    bool fEarlyDetox,
+    bool fDeadStores,
+    ctree_maturity_t maturity,
+    BATCH_RUN* pRun,
+    BATCH_SUMMARY* pSummary
+    )
+{
+    DETOX_THREAD_POOL pool;
+    DETOX_SCRATCH scratch;
+    TRIAGE_SCRATCH triageScratch;
+    TRIAGE_RESULT triageResult;
+    DETOX_HOOK hook;
+    qvector<DETOX_JOB*> inFlight;
+    qvector<DETOX_JOB*> freeJobs;
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+
+    pool.hResultsAvailable = NULL;
+    if ((nThreads > 0) && !StartDetoxThreads(&pool, nThreads))
+    {
+        msg(
+            "CrowdDetox: Cannot start analysis threads; detoxing on the "
+            "main thread.\n");
+    }
+    pSummary->qwMemoryBudget = qwMemoryBudget;
+
+    hook.maturity = maturity;
+    hook.pJob = NULL;
+    hook.pScratch = &scratch;
+    pSummary->nMaturity = maturity;
+    if ((maturity != CMAT_FINAL) && !install_hexrays_callback(
+        BatchDetoxEventCallback,
+        &hook))
+    {
+        msg(
+            "CrowdDetox: Cannot install the batch detox callback; detoxing "
+            "final ctrees.\n");
+        hook.maturity = CMAT_FINAL;
+        pSummary->nMaturity = CMAT_FINAL;
+    }
+
+    if (fEarlyDetox && !install_hexrays_callback(
+        EarlyDetoxEventCallback,
+        pSummary))
+    {
+        msg(
+            "CrowdDetox: Cannot install the early detox callback; detoxing "
+            "final ctrees only.\n");
+        fEarlyDetox = false;
+    }
+
+    for (size_t i = 0; i < pFunctions->size(); i++)
+    {
+        hexrays_failure_t failure;
+
+        //
+        // Apply pressure back onto the decompiler: don't decompile another
+        // function while the queued ones exceed the memory budget
+        //
+        if (qwMemoryBudget != 0)
+        {
+            DrainDetoxJobs(
+                &pool,
+                pRun,
+                &inFlight,
+                &freeJobs,
+                &scratch,
+                &nodeCache,
+                pSummary,
+                qwMemoryBudget);
+        }
+
+        func_t* pFunc = get_func(
+            pFunctions->at(i));
+        if (pFunc == NULL)
+        {
+            pSummary->nFailed++;
+            continue;
+        }
+
+        JournalFunctionStarted(
+            pRun,
+            pFunc->startEA);
+
+        //
+        // Time the dead-store analysis, which needs no decompilation, for
+        // comparison with the Detox() steps
+        //
+        if (fDeadStores)
+        {
+            uint64 qwTriageStart = get_nsec_stamp();
+            if (TriageFunction(
+                pFunc,
+                ph.id == PLFM_386,
+                &triageScratch,
+                &triageResult,
+                NULL))
+            {
+                pSummary->nDeadStoreFunctions++;
+                pSummary->nDeadStores += triageResult.nDeadDefs +
+                    triageResult.nDeadStackStores;
+            }
+            pSummary->qwDeadStoreNs += get_nsec_stamp() - qwTriageStart;
+        }
+
+        //
+        // Decompile the function. HexRaysEventCallback is not installed
+        // here, so the Detox() steps are invoked explicitly below.
+        //
+        DETOX_JOB* pJob = AcquireDetoxJob(
+            &freeJobs,
+            pFunc->startEA);
+
+        hook.pJob = pJob;
+        uint64 qwStart = get_nsec_stamp();
+        pJob->pFunction = decompile(
+            pFunc,
+            &failure);
+        uint64 qwDecompiled = get_nsec_stamp();
+        pJob->qwDecompileNs = qwDecompiled - qwStart;
+        hook.pJob = NULL;
+        if (pJob->pFunction == NULL)
+        {
+            msg(
+                "CrowdDetox: Cannot decompile %a: %s\n",
+                pFunc->startEA,
+                failure.desc().c_str());
+            pSummary->nFailed++;
+            ReleaseDetoxJob(
+                &freeJobs,
+                pJob);
+            continue;
+        }
+
+        //
+        // A function detoxed by BatchDetoxEventCallback() only needs to be
+        // written out. The time spent detoxing is not counted twice.
+        //
+        if (pJob->fDetoxed)
+        {
+            pJob->qwDecompileNs -= pJob->qwFlattenNs + pJob->qwAnalyzeNs +
+                pJob->qwApplyNs;
+            pJob->fAnalyzed = true;
+            inFlight.push_back(
+                pJob);
+            FinishAnalyzedJobs(
+                pRun,
+                &inFlight,
+                &freeJobs,
+                &scratch,
+                &nodeCache,
+                pSummary);
+            continue;
+        }
+
+        FlattenFunction(
+            pJob->pFunction,
+            &pJob->mirror,
+            &scratch);
+        pJob->qwFlattenNs = get_nsec_stamp() - qwDecompiled;
+        pJob->qwMemoryBytes = EstimateJobMemory(
+            pJob);
+
+        //
+        // A function that exceeds the memory budget on its own is processed
+        // alone: everything queued before it is finished first
+        //
+        bool fAlone = (qwMemoryBudget != 0) &&
+            (pJob->qwMemoryBytes > qwMemoryBudget);
+        if (fAlone)
+        {
+            msg(
+                "CrowdDetox: %a needs about %u MB, more than the memory "
+                "budget; processing it alone.\n",
+                pJob->ea,
+                (uint32)(pJob->qwMemoryBytes >> 20));
+            DrainDetoxJobs(
+                &pool,
+                pRun,
+                &inFlight,
+                &freeJobs,
+                &scratch,
+                &nodeCache,
+                pSummary,
+                0);
+            pSummary->nOversize++;
+        }
+
+        if (pool.threads.empty() || fAlone)
+        {
+            //
+            // No analysis threads (or none to spare); run the remaining
+            // steps right here
+            //
+            pJob->fAnalyzed = true;
+            qwStart = get_nsec_stamp();
+            AnalyzeMirror(
+                &pJob->mirror,
+                &pJob->edits,
+                &scratch);
+            pJob->qwAnalyzeNs = get_nsec_stamp() - qwStart;
+            inFlight.push_back(
+                pJob);
+        }
+        else
+        {
+            //
+            // Hand the mirror to an analysis thread, first applying
+            // finished jobs if every thread is saturated
+            //
+            while (!SubmitDetoxJob(&pool, pJob))
             {
-                //
-                // Erase all empty items from cit_block items
-                //
-                if (pItem->op == cit_block)
-                {
-                    pBlock = ((cinsn_t*)pItem)->cblock;
-                    for (
-                        cblock_t::iterator pIterator = pBlock->begin();
-                        pIterator != pBlock->end();
-                        pIterator++)
-                    {
-                        if ((pIterator->op == cit_empty) ||
-                            (pIterator->op == cot_empty))
-                        {
-                            pBlock->erase(
-                                pIterator);
-                            fPruned = true;
-                            return 1;
-                        }
-                    }
-                    return 0;
-                }
+                CollectDetoxJobs(
+                    &pool,
+                    true);
+                FinishAnalyzedJobs(
+                    pRun,
+                    &inFlight,
+                    &freeJobs,
+                    &scratch,
+                    &nodeCache,
+                    pSummary);
+            }
+            inFlight.push_back(
+                pJob);
+
+            CollectDetoxJobs(
+                &pool,
+                false);
+        }
+
+        pSummary->qwPeakQueuedBytes = qmax(
+            pSummary->qwPeakQueuedBytes,
+            GetQueuedMemory(&inFlight));
+
+        FinishAnalyzedJobs(
+            pRun,
+            &inFlight,
+            &freeJobs,
+            &scratch,
+            &nodeCache,
+            pSummary);
+
+        //
+        // Don't keep the memory of an oversize function around for reuse
+        //
+        if (fAlone)
+        {
+            TrimDetoxMemory(
+                &freeJobs,
+                &scratch);
+        }
+    }
+
+    //
+    // Drain the pipeline
+    //
+    DrainDetoxJobs(
+        &pool,
+        pRun,
+        &inFlight,
+        &freeJobs,
+        &scratch,
+        &nodeCache,
+        pSummary,
+        0);
+
+    if (fEarlyDetox)
+    {
+        remove_hexrays_callback(
+            EarlyDetoxEventCallback,
+            pSummary);
+    }
+    if (hook.maturity != CMAT_FINAL)
+    {
+        remove_hexrays_callback(
+            BatchDetoxEventCallback,
+            &hook);
+    }
+
+    pSummary->nThreads = (uint32)pool.threads.size();
+    pSummary->qwThreadBusyNs += StopDetoxThreads(
+        &pool);
+
+    for (size_t i = 0; i < freeJobs.size(); i++)
+    {
+        delete freeJobs[i];
+    }
+}
+
+/*! 
+    @brief Resolves the "threads" batch option
+
+    @param[in] nThreads The number of analysis threads requested, or -1
+    @return Returns the number of analysis threads to use
+*/
+int
+GetAnalysisThreadCount (
+    int nThreads
+    )
+{
+    //
+    // By default, leave one CPU to the decompiler
+    //
+    if (nThreads < 0)
+    {
+        nThreads = qgetnumcpus() - 1;
+    }
+
+    return nThreads > 0 ? nThreads : 0;
+}
+
+/*! 
+    @brief Reports the throughput of a batch run
+
+    @param[in] pSummary The batch totals
+    @param[in] qwElapsedNs The wall-clock duration of the batch run
+*/
+void
+ReportBatchSummary (
+    const BATCH_SUMMARY* pSummary,
+    uint64 qwElapsedNs
+    )
+{
+    double dElapsed = qwElapsedNs / 1e9;
+
+    msg(
+        "CrowdDetox: Detoxed %u functions (%u failed) in %.2f s "
+        "(%.1f functions/s; %.2f s decompiling, %.2f s detoxing).\n",
+        pSummary->nDetoxed,
+        pSummary->nFailed,
+        dElapsed,
+        dElapsed > 0 ? pSummary->nDetoxed / dElapsed : 0.0,
+        pSummary->qwDecompileNs / 1e9,
+        pSummary->qwDetoxNs / 1e9);
+
+    //
+    // Detoxing at an earlier maturity shifts work between Hex-Rays and
+    // Detox(), so the two are compared end to end
+    //
+    if ((pSummary->nMaturity != CMAT_ZERO) && (pSummary->nDetoxed != 0))
+    {
+        msg(
+            "CrowdDetox: Detoxed at maturity %s: %.0f us per function "
+            "end to end (decompile + detox).\n",
+            g_aszMaturityNames[pSummary->nMaturity],
+            (pSummary->qwDecompileNs + pSummary->qwDetoxNs) / 1e3 /
+                pSummary->nDetoxed);
+    }
+
+    //
+    // With analysis threads, the batch can go no faster than the decompiler
+    // itself; report how close it came
+    //
+    if ((pSummary->nThreads != 0) && (qwElapsedNs != 0))
+    {
+        msg(
+            "CrowdDetox: Pipeline with %u analysis threads: decompiler busy "
+            "%.0f%% of the time, analysis threads busy %.0f%%.\n",
+            pSummary->nThreads,
+            100.0 * pSummary->qwDecompileNs / qwElapsedNs,
+            100.0 * pSummary->qwThreadBusyNs /
+                ((double)qwElapsedNs * pSummary->nThreads));
+    }
+
+    //
+    // With worker processes, compare the time the workers spent decompiling
+    // and detoxing against the time they had. No schedule can finish before
+    // the longest function or before each worker has done its fair share.
+    //
+    if ((pSummary->nWorkers != 0) && (qwElapsedNs != 0))
+    {
+        uint64 qwWorkNs = pSummary->qwDecompileNs + pSummary->qwDetoxNs;
+        uint64 qwBoundNs = qmax(
+            qwWorkNs / pSummary->nWorkers,
+            pSummary->qwLongestNs);
+
+        msg(
+            "CrowdDetox: Parallel efficiency with %u workers: %.0f%% "
+            "(ideal run time %.2f s; longest function %.2f s).\n",
+            pSummary->nWorkers,
+            100.0 * qwWorkNs / ((double)qwElapsedNs * pSummary->nWorkers),
+            qwBoundNs / 1e9,
+            pSummary->qwLongestNs / 1e9);
+    }
+
+    //
+    // Report the process' peak memory use against the pipeline's budget
+    //
+    if (pSummary->qwMemoryBudget != 0)
+    {
+        msg(
+            "CrowdDetox: Peak RSS %u MB with a memory budget of %u MB "
+            "(queued functions peaked at about %u MB; %u functions were "
+            "processed alone).\n",
+            (uint32)(GetPeakResidentSetSize() >> 20),
+            (uint32)(pSummary->qwMemoryBudget >> 20),
+            (uint32)(pSummary->qwPeakQueuedBytes >> 20),
+            pSummary->nOversize);
+    }
+
+    //
+    // Report the arena high-water marks against the block size, which
+    // should be large enough for most functions to fit in one block
+    //
+    if (pSummary->cbPeakAnalyzeArena != 0)
+    {
+        msg(
+            "CrowdDetox: Arena high-water marks: %u KB analyzing, %u KB "
+            "applying edits (block size %u KB).\n",
+            (uint32)((pSummary->cbPeakAnalyzeArena + 1023) >> 10),
+            (uint32)((pSummary->cbPeakApplyArena + 1023) >> 10),
+            (uint32)(g_cbArenaBlockSize >> 10));
+    }
+
+    //
+    // The early pass runs inside the decompiler, so its time is part of the
+    // decompile time that it is meant to bring down
+    //
+    if (pSummary->qwEarlyDetoxNs != 0)
+    {
+        msg(
+            "CrowdDetox: The early detox pass removed %u statements in "
+            "%.2f s of the decompile time.\n",
+            pSummary->nEarlyStatementsPruned,
+            pSummary->qwEarlyDetoxNs / 1e9);
+    }
+
+    //
+    // Compare the cost of the dead-store analysis, which runs on the
+    // disassembly, with that of detoxing the decompiled ctree
+    //
+    if (pSummary->nDeadStoreFunctions != 0)
+    {
+        msg(
+            "CrowdDetox: The dead-store analysis found %u dead stores in "
+            "%.2f s (%.0f us per function); ctree detox took %.2f s (%.0f us "
+            "per function).\n",
+            pSummary->nDeadStores,
+            pSummary->qwDeadStoreNs / 1e9,
+            pSummary->qwDeadStoreNs / 1e3 / pSummary->nDeadStoreFunctions,
+            pSummary->qwDetoxNs / 1e9,
+            (pSummary->nDetoxed != 0) ?
+                pSummary->qwDetoxNs / 1e3 / pSummary->nDetoxed : 0.0);
+    }
+
+    if ((pSummary->nResumed != 0) || (pSummary->nCrashing != 0))
+    {
+        msg(
+            "CrowdDetox: %u functions were resumed from a checkpoint and %u "
+            "known-crashing functions were skipped.\n",
+            pSummary->nResumed,
+            pSummary->nCrashing);
+    }
+}
+
+/*! 
+    @brief Decompiles and detoxes a set of functions without any UI
+           interaction
+    @details The detoxed pseudocode is written to a text file and a
+             DETOX_CACHE_ENTRY for each function is stored in the
+             CROWDDETOX_NETNODE netnode. Progress is checkpointed to a
+             journal next to the output file, so that an interrupted run
+             resumes where it left off. Safe to call from a script running
+             in a headless IDA instance.
+
+    @param[in] pOptions Describes which functions to process and where to
+                        write the results
+    @return Returns the number of functions detoxed, returns -1 on error
+*/
+int
+DetoxDatabase (
+    const BATCH_OPTIONS* pOptions
+    )
+{
+    eavec_t functions;
+    char szOutputPath[QMAXPATH];
+    BATCH_SUMMARY summary;
+    BATCH_RUN run;
+
+    if (!g_fInitialized)
+    {
+        msg(
+            "CrowdDetox error: Hex-Rays is not available.\n");
+        return -1;
+    }
+
+    if (!CollectBatchFunctions(pOptions, &functions))
+    {
+        return -1;
+    }
+    if (pOptions->fPurity)
+    {
+        SummarizeSideEffects();
+    }
+    if (pOptions->fGlobals)
+    {
+        BuildGlobalIndex();
+    }
+    if (pOptions->fReturns)
+    {
+        BuildReturnIndex();
+    }
+    if (pOptions->fParameters)
+    {
+        SortFunctionsBottomUp(
+            &functions);
+    }
+
+    memset(
+        &summary,
+        0,
+        sizeof(summary));
+
+    GetBatchOutputPath(
+        pOptions,
+        szOutputPath,
+        sizeof(szOutputPath));
+    if (!BeginBatchRun(
+        szOutputPath,
+        NULL,
+        pOptions->strExportPath.empty() ?
+            NULL : pOptions->strExportPath.c_str(),
+        pOptions->nExportFormat,
+        pOptions->strStatsPath.empty() ?
+            NULL : pOptions->strStatsPath.c_str(),
+        pOptions->nCheckpointInterval,
+        &functions,
+        &run,
+        &summary))
+    {
+        return -1;
+    }
+
+    msg(
+        "CrowdDetox: Detoxing %u functions into \"%s\".\n",
+        (uint32)functions.size(),
+        szOutputPath);
+
+    if ((run.pStatsFile != NULL) && (0 == qftell(run.pStatsFile)))
+    {
+        WriteStatsHeader(
+            run.pStatsFile);
+    }
+
+    uint64 qwBatchStart = get_nsec_stamp();
+
+    //
+    // A function's parameters are only recorded once its edits have been
+    // applied, so with the parameter index, a caller must not be flattened
+    // while one of its callees is still in the pipeline
+    //
+    DetoxFunctionList(
+        &functions,
+        pOptions->fParameters ?
+            0 : GetAnalysisThreadCount(pOptions->nThreads),
+        (uint64)pOptions->nMemoryBudgetMB << 20,
+        pOptions->fEarlyDetox,
+        pOptions->fDeadStores,
+        pOptions->nMaturity,
+        &run,
+        &summary);
+
+    EndBatchRun(
+        &run,
+        true);
+
+    ReportBatchSummary(
+        &summary,
+        get_nsec_stamp() - qwBatchStart);
+
+    if (!pOptions->strStatsPath.empty())
+    {
+        AppendStatsRollup(
+            pOptions->strStatsPath.c_str());
+    }
+
+    return (int)(summary.nDetoxed + summary.nResumed);
+}
+
+/*! 
+    @brief Orders triage results by descending score
+    @details Functions with equal scores are ordered by address.
+
+    @param[in] a The first triage result
+    @param[in] b The second triage result
+    @return Returns true if a ranks before b
+*/
+bool
+CompareTriageResults (
+    const TRIAGE_RESULT& a,
+    const TRIAGE_RESULT& b
+    )
+{
+    if (a.nScore != b.nScore)
+    {
+        return a.nScore > b.nScore;
+    }
+
+    return a.startEA < b.startEA;
+}
+
+/*! 
+    @brief Ranks a database's functions by how obfuscated they appear to be
+    @details Computes each function's junk indicators with TriageFunction(),
+             which is much faster than decompiling the function, and writes
+             the functions to a CSV file, highest score first. The file's
+             first column holds the functions' start addresses, so it may be
+             given as the "list" option of a batch run, which then detoxes
+             the functions in rank order. The highest-ranked functions are
+             also listed in the output window.
+
+    @param[in] pOptions Describes which functions to triage; strOutputPath
+                        is the path of the CSV file
+    @return Returns the number of functions triaged, returns -1 on error
+*/
+int
+TriageDatabase (
+    const BATCH_OPTIONS* pOptions
+    )
+{
+    eavec_t functions;
+    qvector<TRIAGE_RESULT> results;
+    TRIAGE_SCRATCH scratch;
+    TRIAGE_RESULT result;
+    char szOutputPath[QMAXPATH];
+    char szName[MAXSTR];
+
+    if (!CollectBatchFunctions(pOptions, &functions))
+    {
+        return -1;
+    }
+
+    //
+    // Default to <database>.triage.csv
+    //
+    if (pOptions->strOutputPath.empty())
+    {
+        set_file_ext(
+            szOutputPath,
+            sizeof(szOutputPath),
+            database_idb,
+            "triage.csv");
+    }
+    else
+    {
+        qstrncpy(
+            szOutputPath,
+            pOptions->strOutputPath.c_str(),
+            sizeof(szOutputPath));
+    }
+
+    FILE* pOutputFile = qfopen(
+        szOutputPath,
+        "w");
+    if (pOutputFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot create triage file \"%s\".\n",
+            szOutputPath);
+        return -1;
+    }
+
+    uint64 qwStart = get_nsec_stamp();
+
+    bool fX86 = (ph.id == PLFM_386);
+    results.reserve(
+        functions.size());
+    for (size_t i = 0; i < functions.size(); i++)
+    {
+        func_t* pFunc = get_func(
+            functions[i]);
+        if ((pFunc != NULL) &&
+            TriageFunction(pFunc, fX86, &scratch, &result, NULL))
+        {
+            results.push_back(
+                result);
+        }
+    }
+
+    std::sort(
+        results.begin(),
+        results.end(),
+        CompareTriageResults);
+
+    qfprintf(
+        pOutputFile,
+        "start_ea,name,score,junk_pct,instructions,blocks,defs,dead_defs,"
+        "dead_stack_stores,helpers,dead_labels,unreachable_insns\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        char szEA[32];
+        qstring strName;
+        double dJunk = 100.0 * results[i].nScore /
+            results[i].nInstructions;
+
+        if (NULL == get_func_name(
+            results[i].startEA,
+            szName,
+            sizeof(szName)))
+        {
+            szName[0] = '\0';
+        }
+        AppendCsvQuoted(
+            &strName,
+            szName);
+        qsnprintf(
+            szEA,
+            sizeof(szEA),
+            "%a",
+            results[i].startEA);
+
+        qfprintf(
+            pOutputFile,
+            "%s,%s,%u,%.1f,%u,%u,%u,%u,%u,%u,%u,%u\n",
+            szEA,
+            strName.c_str(),
+            results[i].nScore,
+            dJunk,
+            results[i].nInstructions,
+            results[i].nBlocks,
+            results[i].nDefs,
+            results[i].nDeadDefs,
+            results[i].nDeadStackStores,
+            results[i].nHelpers,
+            results[i].nDeadLabels,
+            results[i].nUnreachable);
+
+        if (i < CROWDDETOX_TRIAGE_TOP_COUNT)
+        {
+            msg(
+                "CrowdDetox: #%u %a %s: score %u (%.1f%% junk)\n",
+                (uint32)(i + 1),
+                results[i].startEA,
+                szName,
+                results[i].nScore,
+                dJunk);
+        }
+    }
+
+    qfclose(
+        pOutputFile);
+
+    msg(
+        "CrowdDetox: Triaged %u functions into \"%s\" in %" FMT_64 "u ms.\n",
+        (uint32)results.size(),
+        szOutputPath,
+        (get_nsec_stamp() - qwStart) / 1000000);
+
+    return (int)results.size();
+}
+
+/*! 
+    @brief Builds the path of a file in a coordinator's spool directory
+
+    @param[out] szPath Receives the path
+    @param[in] cbPath The size of the szPath buffer
+    @param[in] szSpoolDirectory The spool directory
+    @param[in] szFormat printf-style format of the file name
+*/
+void
+MakeSpoolPath (
+    char* szPath,
+    size_t cbPath,
+    const char* szSpoolDirectory,
+    const char* szFormat,
+    ...
+    )
+{
+    char szName[QMAXPATH];
+    va_list va;
+
+    va_start(
+        va,
+        szFormat);
+    qvsnprintf(
+        szName,
+        sizeof(szName),
+        szFormat,
+        va);
+    va_end(
+        va);
+
+    qmakepath(
+        szPath,
+        cbPath,
+        szSpoolDirectory,
+        szName,
+        NULL);
+}
+
+/*! 
+    @brief Appends the contents of one file to another
+
+    @param[in] pDestination The file to append to
+    @param[in] szSourcePath The path of the file to append
+    @return Returns true on success, returns false if the source file could
+            not be read
+*/
+bool
+AppendFile (
+    FILE* pDestination,
+    const char* szSourcePath
+    )
+{
+    char abBuffer[0x10000];
+    ssize_t cbRead;
+
+    FILE* pSource = qfopen(
+        szSourcePath,
+        "rb");
+    if (pSource == NULL)
+    {
+        return false;
+    }
+
+    while (0 < (cbRead = qfread(pSource, abBuffer, sizeof(abBuffer))))
+    {
+        qfwrite(
+            pDestination,
+            abBuffer,
+            cbRead);
+    }
+
+    qfclose(
+        pSource);
+
+    return true;
+}
+
+/*! 
+    @brief Makes a standalone copy of the current database for a worker
+
+    @param[in] szSpoolDirectory The coordinator's spool directory
+    @param[in] nWorker The worker's index
+    @param[in] nLaunch The number of times this worker was launched before
+    @param[out] szCopyPath Receives the path of the copy
+    @param[in] cbCopyPath The size of the szCopyPath buffer
+    @return Returns true on success, returns false on error
+*/
+bool
+CopyDatabaseForWorker (
+    const char* szSpoolDirectory,
+    int nWorker,
+    int nLaunch,
+    char* szCopyPath,
+    size_t cbCopyPath
+    )
+{
+    //
+    // Every launch gets a fresh copy, so a crashed worker's half-unpacked
+    // database never triggers IDA's "restore from packed" prompt
+    //
+    MakeSpoolPath(
+        szCopyPath,
+        cbCopyPath,
+        szSpoolDirectory,
+        "worker%d_%d.idb",
+        nWorker,
+        nLaunch);
+
+    FILE* pCopy = qfopen(
+        szCopyPath,
+        "wb");
+    if (pCopy == NULL)
+    {
+        return false;
+    }
+    bool fCopied = AppendFile(
+        pCopy,
+        database_idb);
+    qfclose(
+        pCopy);
+
+    return fCopied;
+}
+
+/*! 
+    @brief Deletes a worker's database copy and the files IDA unpacked from
+           it
+
+    @param[in] szCopyPath The path of the worker's .idb copy
+*/
+void
+DeleteWorkerDatabase (
+    const char* szCopyPath
+    )
+{
+    static const char* aszExtensions[] =
+    {
+        "idb",
+        "id0",
+        "id1",
+        "id2",
+        "nam",
+        "til"
+    };
+    char szPath[QMAXPATH];
+
+    for (int i = 0; i < _countof(aszExtensions); i++)
+    {
+        set_file_ext(
+            szPath,
+            sizeof(szPath),
+            szCopyPath,
+            aszExtensions[i]);
+        qunlink(
+            szPath);
+    }
+}
+
+/*! 
+    @brief Launches a headless IDA worker on a copy of the current database
+
+    @param[in] pOptions The batch options
+    @param[in] szSpoolDirectory The coordinator's spool directory
+    @param[in,out] pWorker The worker to launch
+    @return Returns true on success, returns false on error
+*/
+bool
+LaunchWorker (
+    const BATCH_OPTIONS* pOptions,
+    const char* szSpoolDirectory,
+    WORKER_SLOT* pWorker
+    )
+{
+    char szIdaPath[QMAXPATH];
+    char szScriptPath[QMAXPATH];
+    char szLogPath[QMAXPATH];
+    qstring strArguments;
+    qstring strError;
+    launch_process_params_t params;
+
+    if (!CopyDatabaseForWorker(
+        szSpoolDirectory,
+        pWorker->nWorker,
+        pWorker->nLaunches,
+        pWorker->szDatabasePath,
+        sizeof(pWorker->szDatabasePath)))
+    {
+        msg(
+            "CrowdDetox error: Cannot copy the database for worker %d.\n",
+            pWorker->nWorker);
+        return false;
+    }
+
+    if (pOptions->strIdaPath.empty())
+    {
+        qmakepath(
+            szIdaPath,
+            sizeof(szIdaPath),
+            idadir(NULL),
+            CROWDDETOX_WORKER_EXECUTABLE,
+            NULL);
+    }
+    else
+    {
+        qstrncpy(
+            szIdaPath,
+            pOptions->strIdaPath.c_str(),
+            sizeof(szIdaPath));
+    }
+
+    MakeSpoolPath(
+        szScriptPath,
+        sizeof(szScriptPath),
+        szSpoolDirectory,
+        "worker.idc");
+    MakeSpoolPath(
+        szLogPath,
+        sizeof(szLogPath),
+        szSpoolDirectory,
+        "worker%d.log",
+        pWorker->nWorker);
+
+    strArguments.sprnt(
+        "-A -S\"%s\" -L\"%s\" -OCrowdDetox:worker=%d \"%s\"",
+        szScriptPath,
+        szLogPath,
+        pWorker->nWorker,
+        pWorker->szDatabasePath);
+
+    params.flags = LP_HIDE_WINDOW;
+    params.path = szIdaPath;
+    params.args = strArguments.c_str();
+    params.startdir = szSpoolDirectory;
+
+    pWorker->hProcess = launch_process(
+        params,
+        &strError);
+    if (pWorker->hProcess == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot launch \"%s\": %s\n",
+            szIdaPath,
+            strError.c_str());
+        DeleteWorkerDatabase(
+            pWorker->szDatabasePath);
+        return false;
+    }
+
+    pWorker->nLaunches++;
+
+    return true;
+}
+
+/*! 
+    @brief Returns the shards claimed by a worker that exited before
+           finishing them to the shared queue
+
+    @param[in] szSpoolDirectory The coordinator's spool directory
+    @param[in] nWorker The worker's index
+    @param[in,out] pShardCrashes Per-shard crash counters
+    @return Returns the number of unfinished shards that the worker held
+*/
+uint32
+ReclaimWorkerShards (
+    const char* szSpoolDirectory,
+    int nWorker,
+    qvector<int>* pShardCrashes
+    )
+{
+    char szClaimPath[QMAXPATH];
+    char szRequeuePath[QMAXPATH];
+    uint32 nReclaimed = 0;
+
+    for (size_t k = 0; k < pShardCrashes->size(); k++)
+    {
+        MakeSpoolPath(
+            szClaimPath,
+            sizeof(szClaimPath),
+            szSpoolDirectory,
+            "shard%u.w%d",
+            (uint32)k,
+            nWorker);
+        if (!qfileexist(szClaimPath))
+        {
+            continue;
+        }
+
+        //
+        // Requeue the shard, unless it has now crashed a worker too often
+        //
+        pShardCrashes->at(k)++;
+        MakeSpoolPath(
+            szRequeuePath,
+            sizeof(szRequeuePath),
+            szSpoolDirectory,
+            pShardCrashes->at(k) < CROWDDETOX_MAX_SHARD_CRASHES ?
+                "shard%u.todo" : "shard%u.failed",
+            (uint32)k);
+        qrename(
+            szClaimPath,
+            szRequeuePath);
+
+        nReclaimed++;
+    }
+
+    return nReclaimed;
+}
+
+/*! 
+    @brief Estimates how long a function takes to decompile, relative to
+           other functions, from its size
+    @details Hex-Rays' data flow analysis grows faster than linearly with the
+             number of basic blocks, so the instruction count is weighted by
+             the block count.
+
+    @param[in] pFunc The function
+    @return Returns the function's estimated cost in arbitrary units
+*/
+uint64
+EstimateFunctionCost (
+    func_t* pFunc
+    )
+{
+    func_item_iterator_t items;
+    uint64 nInstructions = 0;
+
+    for (bool fOk = items.set(pFunc); fOk; fOk = items.next_code())
+    {
+        nInstructions++;
+    }
+
+    qflow_chart_t flowChart(
+        NULL,
+        pFunc,
+        BADADDR,
+        BADADDR,
+        0);
+
+    return nInstructions * (16 + flowChart.size());
+}
+
+/*! 
+    @brief Sorts a batch run's functions by their expected cost, most
+           expensive first
+    @details A function detoxed by an earlier batch run is expected to take
+             as long as it took then (as cached in the CROWDDETOX_NETNODE
+             netnode). The cost of any other function is estimated with
+             EstimateFunctionCost(), scaled to nanoseconds by comparing the
+             estimates of the cached functions with their actual timings.
+
+    @param[in,out] pFunctions The start addresses of the functions to sort
+    @param[out] pCosts Receives the expected cost of each function, in the
+                       sorted order
+*/
+void
+ScheduleLongestFirst (
+    eavec_t* pFunctions,
+    qvector<uint64>* pCosts
+    )
+{
+    DETOX_CACHE_ENTRY entry;
+    qvector<uint64> estimates;
+    qvector<uint64> timings;
+    double dEstimated = 0;
+    double dTimed = 0;
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+
+    estimates.resize(
+        pFunctions->size());
+    timings.resize(
+        pFunctions->size());
+    for (size_t i = 0; i < pFunctions->size(); i++)
+    {
+        func_t* pFunc = get_func(
+            pFunctions->at(i));
+        estimates[i] = (pFunc != NULL) ? EstimateFunctionCost(pFunc) : 0;
+        timings[i] = 0;
+
+        if (sizeof(entry) == nodeCache.supval(
+            pFunctions->at(i),
+            &entry,
+            sizeof(entry)))
+        {
+            timings[i] = entry.qwDecompileNs + entry.qwDetoxNs;
+            dEstimated += estimates[i];
+            dTimed += timings[i];
+        }
+    }
+
+    //
+    // Without any cached timings, the estimates are used as they are
+    //
+    double dScale = ((dEstimated > 0) && (dTimed > 0)) ?
+        dTimed / dEstimated : 1.0;
+
+    qvector<std::pair<uint64, ea_t> > order;
+    order.resize(
+        pFunctions->size());
+    for (size_t i = 0; i < pFunctions->size(); i++)
+    {
+        order[i].first = (timings[i] != 0) ?
+            timings[i] : (uint64)(estimates[i] * dScale);
+        order[i].second = pFunctions->at(i);
+    }
+
+    std::sort(
+        order.begin(),
+        order.end());
+
+    pCosts->resize(
+        order.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        pFunctions->at(i) = order[order.size() - 1 - i].second;
+        pCosts->at(i) = order[order.size() - 1 - i].first;
+    }
+}
+
+/*! 
+    @brief Splits a batch run across several headless IDA worker processes
+    @details Hex-Rays is single-threaded, so the batch is split into shards
+             of functions that are claimed by worker processes, each running
+             on its own copy of the database. The shard queue lives in a
+             spool directory next to the output file: a worker claims a
+             shard by atomically renaming shard<k>.todo to shard<k>.w<id>.
+             Shards are queued most expensive first (see
+             ScheduleLongestFirst()) and every worker claims them from the
+             front of the queue. Crashed workers are
+             restarted on a fresh database copy and their unfinished shards
+             are requeued. Finally, the per-shard results are merged into
+             one output file and into this database's CROWDDETOX_NETNODE
+             cache.
+
+    @param[in] pOptions Describes which functions to process, where to write
+                        the results, and how many workers to use
+    @return Returns the number of functions detoxed, returns -1 on error
+*/
+int
+CoordinateWorkers (
+    const BATCH_OPTIONS* pOptions
+    )
+{
+    eavec_t functions;
+    char szOutputPath[QMAXPATH];
+    char szSpoolDirectory[QMAXPATH];
+    char szPath[QMAXPATH];
+    char szDonePath[QMAXPATH];
+    qvector<WORKER_SLOT> workers;
+    qvector<int> shardCrashes;
+    qvector<uint64> costs;
+    BATCH_SUMMARY summary;
+    uint32 nShards;
+    int nWorkers;
+    FILE* pFile;
+
+    if (!g_fInitialized)
+    {
+        msg(
+            "CrowdDetox error: Hex-Rays is not available.\n");
+        return -1;
+    }
+
+    if (!CollectBatchFunctions(pOptions, &functions))
+    {
+        return -1;
+    }
+
+    nWorkers = pOptions->nWorkers > 0 ? pOptions->nWorkers : qgetnumcpus();
+    uint64 qwBatchStart = get_nsec_stamp();
+
+    //
+    // Create the spool directory next to the output file
+    //
+    GetBatchOutputPath(
+        pOptions,
+        szOutputPath,
+        sizeof(szOutputPath));
+    qsnprintf(
+        szSpoolDirectory,
+        sizeof(szSpoolDirectory),
+        "%s.spool",
+        szOutputPath);
+    qmkdir(
+        szSpoolDirectory,
+        0755);
+
+    //
+    // Queue the most expensive functions first, so that no worker is left
+    // with a giant function while the others run out of work. A shard is
+    // closed once it holds nShardSize functions or its share of the total
+    // expected cost, so expensive functions get shards of their own.
+    //
+    ScheduleLongestFirst(
+        &functions,
+        &costs);
 
-                //
-                // Don't cleanup cit_break, cit_continue, cit_goto, cit_empty,
-                // cot_empty, cit_asm, or cit_return items
-                //
-                if ((pItem->op == cit_break) ||
-                    (pItem->op == cit_continue) ||
-                    (pItem->op == cit_goto) ||
-                    (pItem->op == cit_empty) ||
-                    (pItem->op == cot_empty) ||
-                    (pItem->op == cit_asm) ||
-                    (pItem->op == cit_return))
-                {
-                    //
-                    // Don't cleanup descendants of these items, either
-                    //
-                    prune_now();
+    uint64 qwTotalCost = 0;
+    for (size_t i = 0; i < costs.size(); i++)
+    {
+        qwTotalCost += costs[i];
+    }
+    uint64 qwShardCost = qwTotalCost /
+        ((uint64)nWorkers * CROWDDETOX_SHARDS_PER_WORKER);
 
-                    return 0;
-                }
+    //
+    // Write the shard queue
+    //
+    nShards = 0;
+    for (size_t i = 0, j; i < functions.size(); i = j)
+    {
+        uint64 qwCost = 0;
+
+        MakeSpoolPath(
+            szPath,
+            sizeof(szPath),
+            szSpoolDirectory,
+            "shard%u.todo",
+            nShards);
+        pFile = qfopen(
+            szPath,
+            "w");
+        if (pFile == NULL)
+        {
+            msg(
+                "CrowdDetox error: Cannot create \"%s\".\n",
+                szPath);
+            return -1;
+        }
+        for (j = i;
+            (j < functions.size()) && (j < i + pOptions->nShardSize) &&
+                ((j == i) || (qwCost < qwShardCost));
+            j++)
+        {
+            qfprintf(
+                pFile,
+                "%a\n",
+                functions[j]);
+            qwCost += costs[j];
+        }
+        qfclose(
+            pFile);
 
-                //
-                // Cleanup everything else unless it's marked as legitimate
-                //
-                if (pVectorLegitItems->has(pItem))
-                {
-                    return 0;
-                }
+        nShards++;
+    }
+    shardCrashes.resize(
+        nShards,
+        0);
 
-                //
-                // Only cleanup statements, not expressions
-                //
-                if (pItem->is_expr())
-                {
-                    return 0;
-                }
+    //
+    // Write the job description and the script that every worker runs
+    //
+    MakeSpoolPath(
+        szPath,
+        sizeof(szPath),
+        szSpoolDirectory,
+        "job.cfg");
+    pFile = qfopen(
+        szPath,
+        "w");
+    if (pFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot create \"%s\".\n",
+            szPath);
+        return -1;
+    }
+    //
+    // Every CPU already runs a worker process, so workers only use analysis
+    // threads when explicitly asked to
+    //
+    qfprintf(
+        pFile,
+        "shards=%u\nworkers=%d\ncheckpoint=%u\nthreads=%d\nexport=%d\n"
+        "memory=%u\nstats=%d\nearly=%d\ndeadstores=%d\nmaturity=%d\n"
+        "arena=%u\npurity=%d\nglobals=%d\nreturns=%d\nparams=%d\n",
+        nShards,
+        nWorkers,
+        pOptions->nCheckpointInterval,
+        pOptions->nThreads > 0 ? pOptions->nThreads : 0,
+        pOptions->strExportPath.empty() ?
+            CROWDDETOX_EXPORT_NONE : pOptions->nExportFormat,
+        pOptions->nMemoryBudgetMB,
+        pOptions->strStatsPath.empty() ? 0 : 1,
+        pOptions->fEarlyDetox ? 1 : 0,
+        pOptions->fDeadStores ? 1 : 0,
+        pOptions->nMaturity,
+        pOptions->nArenaBlockKB,
+        pOptions->fPurity ? 1 : 0,
+        pOptions->fGlobals ? 1 : 0,
+        pOptions->fReturns ? 1 : 0,
+        pOptions->fParameters ? 1 : 0);
+    if (!pOptions->strSignaturesPath.empty())
+    {
+        qfprintf(
+            pFile,
+            "signatures=%s\n",
+            pOptions->strSignaturesPath.c_str());
+    }
+    qfclose(
+        pFile);
+
+    MakeSpoolPath(
+        szPath,
+        sizeof(szPath),
+        szSpoolDirectory,
+        "worker.idc");
+    pFile = qfopen(
+        szPath,
+        "w");
+    if (pFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot create \"%s\".\n",
+            szPath);
+        return -1;
+    }
+    qfprintf(
+        pFile,
+        "static main()\n"
+        "{\n"
+        "    Wait();\n"
+        "    RunPlugin(\"hexrays_CrowdDetox\", %d);\n"
+        "    Exit(0);\n"
+        "}\n",
+        CROWDDETOX_RUN_WORKER);
+    qfclose(
+        pFile);
 
-                //
-                // Keep cleaning up goto labels under this item until no labels
-                // remain
-                //
-                visitingMode = CleaningUpGotoLabels;
-                fGotoCleaned = true;
-                while (fGotoCleaned)
-                {
-                    fGotoCleaned = false;
-                    apply_to(
-                        pItem,
-                        NULL);
-                }
-                visitingMode = Pruning;
+    //
+    // Workers open copies of the database as it is on disk now, side-effect
+    // summaries and global variable and return value indexes included
+    //
+    if (pOptions->fPurity)
+    {
+        SummarizeSideEffects();
+    }
+    if (pOptions->fGlobals)
+    {
+        BuildGlobalIndex();
+    }
+    if (pOptions->fReturns)
+    {
+        BuildReturnIndex();
+    }
+    save_database(
+        database_idb,
+        false);
 
-                //
-                // Execute the actual cleanup() call
-                //
-                ((cinsn_t*)pItem)->cleanup();
+#ifndef __NT__
+    //
+    // Allow the text-mode workers to run without a terminal
+    //
+    qsetenv(
+        "TVHEADLESS",
+        "1");
+#endif
 
-                fPruned = true;
-                return 1;
+    msg(
+        "CrowdDetox: Detoxing %u functions in %u shards with %d workers.\n",
+        (uint32)functions.size(),
+        nShards,
+        nWorkers);
+
+    //
+    // Launch the workers
+    //
+    workers.resize(
+        nWorkers);
+    for (int i = 0; i < nWorkers; i++)
+    {
+        memset(
+            &workers[i],
+            0,
+            sizeof(workers[i]));
+        workers[i].nWorker = i;
+        LaunchWorker(
+            pOptions,
+            szSpoolDirectory,
+            &workers[i]);
+    }
+
+    //
+    // Supervise the workers until all of them have exited
+    //
+    for (;;)
+    {
+        int nRunning = 0;
+
+        for (int i = 0; i < nWorkers; i++)
+        {
+            int nExitCode;
+            WORKER_SLOT* pWorker = &workers[i];
+
+            if (pWorker->hProcess == NULL)
+            {
+                continue;
+            }
+
+            if (0 != check_process_exit(pWorker->hProcess, &nExitCode, 0))
+            {
+                nRunning++;
+                continue;
             }
 
+            pWorker->hProcess = NULL;
+            DeleteWorkerDatabase(
+                pWorker->szDatabasePath);
+
             //
-            // If we're in CleaningUpGotoLabels mode...
+            // A worker that exits while still holding shards has crashed;
+            // requeue its shards and restart it
             //
-            else if (visitingMode == CleaningUpGotoLabels)
+            uint32 nReclaimed = ReclaimWorkerShards(
+                szSpoolDirectory,
+                i,
+                &shardCrashes);
+            if ((nReclaimed == 0) && (nExitCode == 0))
             {
-                //
-                // Keep searching this tree branch until we find a goto label
-                //
-                if (pItem->label_num == -1)
+                continue;
+            }
+
+            msg(
+                "CrowdDetox: Worker %d exited with code %d holding %u "
+                "unfinished shards.\n",
+                i,
+                nExitCode,
+                nReclaimed);
+
+            if ((pWorker->nLaunches < CROWDDETOX_MAX_WORKER_LAUNCHES) &&
+                LaunchWorker(pOptions, szSpoolDirectory, pWorker))
+            {
+                nRunning++;
+            }
+        }
+
+        if (nRunning == 0)
+        {
+            break;
+        }
+
+        qsleep(
+            CROWDDETOX_POLL_INTERVAL_MS);
+    }
+
+    //
+    // Merge the per-shard results in shard order
+    //
+    pFile = qfopen(
+        szOutputPath,
+        "wb");
+    if (pFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot create \"%s\".\n",
+            szOutputPath);
+        return -1;
+    }
+
+    FILE* pExportFile = NULL;
+    if (!pOptions->strExportPath.empty())
+    {
+        pExportFile = qfopen(
+            pOptions->strExportPath.c_str(),
+            "wb");
+        if (pExportFile == NULL)
+        {
+            msg(
+                "CrowdDetox error: Cannot create \"%s\".\n",
+                pOptions->strExportPath.c_str());
+            qfclose(
+                pFile);
+            return -1;
+        }
+    }
+
+    FILE* pStatsFile = NULL;
+    if (!pOptions->strStatsPath.empty())
+    {
+        pStatsFile = qfopen(
+            pOptions->strStatsPath.c_str(),
+            "wb");
+        if (pStatsFile == NULL)
+        {
+            msg(
+                "CrowdDetox error: Cannot create \"%s\".\n",
+                pOptions->strStatsPath.c_str());
+            qfclose(
+                pFile);
+            if (pExportFile != NULL)
+            {
+                qfclose(
+                    pExportFile);
+            }
+            return -1;
+        }
+        WriteStatsHeader(
+            pStatsFile);
+    }
+
+    netnode nodeCache(
+        CROWDDETOX_NETNODE,
+        0,
+        true);
+    memset(
+        &summary,
+        0,
+        sizeof(summary));
+
+    for (uint32 k = 0; k < nShards; k++)
+    {
+        DETOX_RESULT_RECORD record;
+
+        MakeSpoolPath(
+            szDonePath,
+            sizeof(szDonePath),
+            szSpoolDirectory,
+            "shard%u.done",
+            k);
+        if (!qfileexist(szDonePath))
+        {
+            msg(
+                "CrowdDetox: Shard %u was not completed.\n",
+                k);
+            continue;
+        }
+
+        MakeSpoolPath(
+            szPath,
+            sizeof(szPath),
+            szSpoolDirectory,
+            "shard%u.c",
+            k);
+        AppendFile(
+            pFile,
+            szPath);
+        qunlink(
+            szPath);
+
+        if (pExportFile != NULL)
+        {
+            MakeSpoolPath(
+                szPath,
+                sizeof(szPath),
+                szSpoolDirectory,
+                "shard%u.export",
+                k);
+            AppendFile(
+                pExportFile,
+                szPath);
+            qunlink(
+                szPath);
+        }
+
+        if (pStatsFile != NULL)
+        {
+            MakeSpoolPath(
+                szPath,
+                sizeof(szPath),
+                szSpoolDirectory,
+                "shard%u.csv",
+                k);
+            AppendFile(
+                pStatsFile,
+                szPath);
+            qunlink(
+                szPath);
+        }
+
+        MakeSpoolPath(
+            szPath,
+            sizeof(szPath),
+            szSpoolDirectory,
+            "shard%u.rec",
+            k);
+        FILE* pRecordFile = qfopen(
+            szPath,
+            "rb");
+        if (pRecordFile != NULL)
+        {
+            while (sizeof(record) == qfread(pRecordFile, &record, sizeof(record)))
+            {
+                nodeCache.supset(
+                    record.ea,
+                    &record.entry,
+                    sizeof(record.entry));
+                if (record.dwParameters & PARAMETERS_INDEXED)
                 {
-                    return 0;
+                    nodeCache.altset(
+                        record.ea,
+                        record.dwParameters,
+                        CROWDDETOX_PARAMETER_TAG);
                 }
 
-                //
-                // We found an item with a goto label, so save its old label
-                // number
-                //
-                nOldLabelNumber = pItem->label_num;
+                summary.qwDecompileNs += record.entry.qwDecompileNs;
+                summary.qwDetoxNs += record.entry.qwDetoxNs;
+                summary.qwLongestNs = qmax(
+                    summary.qwLongestNs,
+                    record.entry.qwDecompileNs + record.entry.qwDetoxNs);
+                summary.nDetoxed++;
+            }
+            qfclose(
+                pRecordFile);
+        }
+        qunlink(
+            szPath);
+        qunlink(
+            szDonePath);
+    }
 
-                //
-                // Find a new place to assign this label
-                //
-                pParent = pItem;
-                pNewDestination = NULL;
-                while (pNewDestination == NULL)
-                {
-                    while (NULL != (pParent = pFunction->body.find_parent_of(pParent)))
-                    {
-                        if (pParent->op == cit_block)
-                        {
-                            break;
-                        }
-                    }
+    qfclose(
+        pFile);
+    if (pExportFile != NULL)
+    {
+        qfclose(
+            pExportFile);
+    }
+    if (pStatsFile != NULL)
+    {
+        qfclose(
+            pStatsFile);
+        AppendStatsRollup(
+            pOptions->strStatsPath.c_str());
+    }
 
-                    if (pParent == NULL)
-                    {
-                        //
-                        // We couldn't find any parent block, which means we
-                        // can't move the goto label. Instead, change the gotos
-                        // that point to this label into returns.
-                        //
+    summary.nFailed = (uint32)functions.size() - summary.nDetoxed;
+    summary.nWorkers = nWorkers;
+    summary.nMaturity = pOptions->nMaturity;
+    ReportBatchSummary(
+        &summary,
+        get_nsec_stamp() - qwBatchStart);
 
-                        //
-                        // Change gotos that jump to nOldLabelNumber to instead
-                        // be returns
-                        //
-                        nNewLabelNumber = -1;
-                        visitingMode = ChangingGotos;
-                        apply_to(
-                            &pFunction->body,
-                            NULL);
-                    
-                        fGotoCleaned = true;
-                        return 1;
-                    }
+    return (int)summary.nDetoxed;
+}
 
-                    //
-                    // The parent block was found. See if there are any
-                    // children of that parent block whose EA is greater than
-                    // that of the current label's item.
-                    //
-                    pCurrentParent = pParent;
-                    vectorChildrenOfParentBlock.clear();
-                    visitingMode = FindingChildrenOfParent;
-                    apply_to(
-                        pParent,
-                        NULL);
-                    visitingMode = CleaningUpGotoLabels;
+/*! 
+    @brief Runs a batch worker launched by CoordinateWorkers()
+    @details The worker's database copy lives in the coordinator's spool
+             directory. The worker claims shards from the front of the
+             shared queue until no unclaimed shard remains.
 
-                    for (size_t i = 0;
-                        i < vectorChildrenOfParentBlock.size();
-                        i++)
-                    {
-                        if (!(vectorChildrenOfParentBlock[i]->ea > pItem->ea))
-                        {
-                            continue;
-                        }
+    @param[in] nWorker The worker's index
+    @return Returns the number of functions detoxed, returns -1 on error
+*/
+int
+RunWorker (
+    int nWorker
+    )
+{
+    char szSpoolDirectory[QMAXPATH];
+    char szPath[QMAXPATH];
+    char szClaimPath[QMAXPATH];
+    char szRecordPath[QMAXPATH];
+    char szExportPath[QMAXPATH];
+    char szStatsPath[QMAXPATH];
+    char szSignaturesPath[QMAXPATH] = "";
+    char szLine[MAXSTR];
+    uint32 nShards = 0;
+    int nWorkers = 1;
+    uint32 nCheckpointInterval = CROWDDETOX_DEFAULT_CHECKPOINT_INTERVAL;
+    int nThreads = 0;
+    int nExportFormat = CROWDDETOX_EXPORT_NONE;
+    uint32 nMemoryBudgetMB = CROWDDETOX_DEFAULT_MEMORY_BUDGET_MB;
+    bool fStats = false;
+    bool fEarlyDetox = false;
+    bool fDeadStores = false;
+    ctree_maturity_t nMaturity = CMAT_FINAL;
+    BATCH_SUMMARY summary;
+    BATCH_RUN run;
+
+    if (!g_fInitialized)
+    {
+        return -1;
+    }
 
-                        if ((pNewDestination == NULL) ||
-                            (vectorChildrenOfParentBlock[i]->ea <
-                            pNewDestination->ea))
-                        {
-                            pNewDestination = vectorChildrenOfParentBlock[i];
-                        }
-                    }
-                }
+    qdirname(
+        szSpoolDirectory,
+        sizeof(szSpoolDirectory),
+        database_idb);
+
+    //
+    // Read the job description
+    //
+    MakeSpoolPath(
+        szPath,
+        sizeof(szPath),
+        szSpoolDirectory,
+        "job.cfg");
+    FILE* pFile = qfopen(
+        szPath,
+        "r");
+    if (pFile == NULL)
+    {
+        msg(
+            "CrowdDetox error: Cannot open \"%s\".\n",
+            szPath);
+        return -1;
+    }
+    while (NULL != qfgets(szLine, sizeof(szLine), pFile))
+    {
+        if (0 == strncmp(szLine, "shards=", 7))
+        {
+            nShards = atoi(szLine + 7);
+        }
+        else if (0 == strncmp(szLine, "workers=", 8))
+        {
+            nWorkers = atoi(szLine + 8);
+        }
+        else if (0 == strncmp(szLine, "checkpoint=", 11))
+        {
+            nCheckpointInterval = atoi(szLine + 11);
+        }
+        else if (0 == strncmp(szLine, "threads=", 8))
+        {
+            nThreads = atoi(szLine + 8);
+        }
+        else if (0 == strncmp(szLine, "export=", 7))
+        {
+            nExportFormat = atoi(szLine + 7);
+        }
+        else if (0 == strncmp(szLine, "memory=", 7))
+        {
+            nMemoryBudgetMB = atoi(szLine + 7);
+        }
+        else if (0 == strncmp(szLine, "stats=", 6))
+        {
+            fStats = (0 != atoi(szLine + 6));
+        }
+        else if (0 == strncmp(szLine, "early=", 6))
+        {
+            fEarlyDetox = (0 != atoi(szLine + 6));
+        }
+        else if (0 == strncmp(szLine, "deadstores=", 11))
+        {
+            fDeadStores = (0 != atoi(szLine + 11));
+        }
+        else if (0 == strncmp(szLine, "maturity=", 9))
+        {
+            nMaturity = (ctree_maturity_t)atoi(szLine + 9);
+        }
+        else if ((0 == strncmp(szLine, "arena=", 6)) && (atoi(szLine + 6) > 0))
+        {
+            g_cbArenaBlockSize = (size_t)atoi(szLine + 6) << 10;
+        }
+        else if (0 == strncmp(szLine, "purity=", 7))
+        {
+            g_fPurity = (0 != atoi(szLine + 7));
+        }
+        else if (0 == strncmp(szLine, "globals=", 8))
+        {
+            g_fGlobalIndex = (0 != atoi(szLine + 8));
+        }
+        else if (0 == strncmp(szLine, "returns=", 8))
+        {
+            g_fReturnIndex = (0 != atoi(szLine + 8));
+        }
+        else if (0 == strncmp(szLine, "params=", 7))
+        {
+            g_fParameterIndex = (0 != atoi(szLine + 7));
+        }
+        else if (0 == strncmp(szLine, "signatures=", 11))
+        {
+            qstrncpy(
+                szSignaturesPath,
+                szLine + 11,
+                sizeof(szSignaturesPath));
+            szSignaturesPath[strcspn(szSignaturesPath, "\r\n")] = '\0';
+        }
+    }
+    qfclose(
+        pFile);
 
-                //
-                // We now have a pNewDestination for our label
-                //
+    if ((szSignaturesPath[0] != '\0') && !LoadJunkSignatures(
+        szSignaturesPath))
+    {
+        return -1;
+    }
 
-                //
-                // If the new destination already has a label number...
-                //
-                if (pNewDestination->label_num != -1)
-                {
-                    //
-                    // Update all goto items in the graph that originally
-                    // pointed to the old label to now point to
-                    // pNewDestination's label
-                    //
-                    nNewLabelNumber = pNewDestination->label_num;
-                    visitingMode = ChangingGotos;
-                    apply_to(
-                        &pFunction->body,
-                        NULL);
-                    
-                    fGotoCleaned = true;
-                    return 1;
-                }
+    if ((nShards == 0) || (nWorkers <= 0))
+    {
+        return 0;
+    }
 
-                //
-                // Otherwise, just move the label
-                //
-                pNewDestination->label_num = pItem->label_num;
-                pItem->label_num = -1;
+    memset(
+        &summary,
+        0,
+        sizeof(summary));
 
-                fGotoCleaned = true;
+    //
+    // The queue holds the most expensive shards first, so every worker
+    // sweeps it from the front (staggered by its index to avoid fighting
+    // over the same shards) until a full sweep claims nothing
+    //
+    uint32 nFirstShard = (uint32)nWorker % nShards;
+    bool fClaimed = true;
+    while (fClaimed)
+    {
+        fClaimed = false;
 
-                return 1;
+        for (uint32 j = 0; j < nShards; j++)
+        {
+            eavec_t functions;
+            uint32 k = (nFirstShard + j) % nShards;
+
+            MakeSpoolPath(
+                szPath,
+                sizeof(szPath),
+                szSpoolDirectory,
+                "shard%u.todo",
+                k);
+            MakeSpoolPath(
+                szClaimPath,
+                sizeof(szClaimPath),
+                szSpoolDirectory,
+                "shard%u.w%d",
+                k,
+                nWorker);
+            if (0 != qrename(szPath, szClaimPath))
+            {
+                continue;
             }
+            fClaimed = true;
 
             //
-            // If we're in FindingChildrenOfParent mode...
+            // Read the shard's function addresses
             //
-            else if (visitingMode == FindingChildrenOfParent)
+            pFile = qfopen(
+                szClaimPath,
+                "r");
+            if (pFile == NULL)
             {
-                //
-                // If the item is a child of the current parent, add it to the
-                // vectorChildrenOfParentBlock vector
-                //
-                if (parents.back() == pCurrentParent)
+                continue;
+            }
+            while (NULL != qfgets(szLine, sizeof(szLine), pFile))
+            {
+                ea_t ea;
+                if (NULL != ParseHexAddress(szLine, &ea))
                 {
-                    vectorChildrenOfParentBlock.push_back(pItem);
+                    functions.push_back(
+                        ea);
                 }
-
-                return 0;
             }
+            qfclose(
+                pFile);
 
             //
-            // If we're in the ChaningGotos mode...
+            // Detox the shard's functions. A shard requeued after a crash
+            // resumes from its journal, skipping the crashing function.
             //
-            else if (visitingMode == ChangingGotos)
+            MakeSpoolPath(
+                szPath,
+                sizeof(szPath),
+                szSpoolDirectory,
+                "shard%u.c",
+                k);
+            MakeSpoolPath(
+                szRecordPath,
+                sizeof(szRecordPath),
+                szSpoolDirectory,
+                "shard%u.rec",
+                k);
+            MakeSpoolPath(
+                szExportPath,
+                sizeof(szExportPath),
+                szSpoolDirectory,
+                "shard%u.export",
+                k);
+            MakeSpoolPath(
+                szStatsPath,
+                sizeof(szStatsPath),
+                szSpoolDirectory,
+                "shard%u.csv",
+                k);
+            if (!BeginBatchRun(
+                szPath,
+                szRecordPath,
+                (nExportFormat != CROWDDETOX_EXPORT_NONE) ?
+                    szExportPath : NULL,
+                nExportFormat,
+                fStats ? szStatsPath : NULL,
+                nCheckpointInterval,
+                &functions,
+                &run,
+                &summary))
             {
-                //
-                // Change cit_goto items to either point to a new goto label or
-                // to be a cit_return instead.
-                //
-
-                if (!((pItem->op == cit_goto) &&
-                    (((cinsn_t*)pItem)->cgoto->label_num == nOldLabelNumber)))
-                {
-                    return 0;
-                }
-
-                if (nNewLabelNumber != -1)
-                {
-                    //
-                    // Change the destination label of the goto
-                    //
-                    ((cinsn_t*)pItem)->cgoto->label_num = nNewLabelNumber;
-                    return 0;
-                }
-
-                //
-                // Change the goto to a return
-                //
-                cinsn_t* pRet = new cinsn_t();
-                pRet->ea = pItem->ea;
-                pRet->op = cit_return;
-                pRet->label_num = pItem->label_num;
-                pRet->index = pItem->index;
-                pRet->creturn = new creturn_t();
+                return -1;
+            }
 
-                ((cinsn_t*)pItem)->replace_by(pRet);
-                ((cinsn_t*)pItem)->cleanup();
+            DetoxFunctionList(
+                &functions,
+                nThreads,
+                (uint64)nMemoryBudgetMB << 20,
+                fEarlyDetox,
+                fDeadStores,
+                nMaturity,
+                &run,
+                &summary);
 
-                return 0;
-            }
+            EndBatchRun(
+                &run,
+                true);
 
-            return 1;
+            //
+            // Publish the shard's results
+            //
+            MakeSpoolPath(
+                szPath,
+                sizeof(szPath),
+                szSpoolDirectory,
+                "shard%u.done",
+                k);
+            qrename(
+                szClaimPath,
+                szPath);
         }
+    }
 
+    return (int)summary.nDetoxed;
+}
 
-        public:
-
-        //
-        // This flag keeps track of whether or not any ctree items were pruned
-        // during the ctree traversal
-        //
-        bool fPruned;
+//
+// Argument types of the CROWDDETOX_IDC_BATCH IDC function:
+// CrowdDetoxBatch(start_ea, end_ea, output_path)
+//
+static const char g_abBatchIdcArgs[] = { VT_LONG, VT_LONG, VT_STR2, 0 };
 
-        //
-        // PRUNE_ITEMS_VISITOR constructor
-        //
-        PRUNE_ITEMS_VISITOR(cfunc_t* _pFunction, qvector<citem_t*>* _pVectorLegitItems):
-            ctree_visitor_t(CV_PARENTS),
-            pFunction(_pFunction),
-            pVectorLegitItems(_pVectorLegitItems),
-            visitingMode(Pruning),
-            fGotoCleaned(false),
-            fPruned(false),
-            nOldLabelNumber(-1),
-            nNewLabelNumber(-1)
-        {
-        }
-    };
+/*! 
+    @brief IDC wrapper for DetoxDatabase()
+    @details Called from IDC as CrowdDetoxBatch(start_ea, end_ea,
+             output_path), or from IDAPython as
+             idc.Eval('CrowdDetoxBatch(0, BADADDR, "out.c")'). An empty
+             output_path selects the default output file. The other options
+             are taken from the -OCrowdDetox:... command line options.
+             Returns the number of functions detoxed, or -1 on error.
+
+    @param[in] argv The IDC function arguments
+    @param[out] pResult Receives the IDC function's return value
+    @return Always returns eOk
+*/
+error_t
+idaapi
+IdcCrowdDetoxBatch (
+    idc_value_t* argv,
+    idc_value_t* pResult
+    )
+{
+    BATCH_OPTIONS options;
 
-    //
-    // Keep traversing the function's ctree until there are no items left to
-    // prune
-    //
-    PRUNE_ITEMS_VISITOR piv(pFunction, &fliv.vectorLegitItems);
-    do
+    if (!ParseBatchOptions(
+        get_plugin_options("CrowdDetox"),
+        &options) ||
+        !ApplyBatchOptions(
+        &options))
     {
-        piv.fPruned = false;
-        piv.apply_to(
-            &pFunction->body,
-            NULL);
-    } while (piv.fPruned);
+        pResult->num = -1;
+        return eOk;
+    }
+    options.startEA = (ea_t)argv[0].num;
+    options.endEA = (ea_t)argv[1].num;
+    options.strOutputPath = argv[2].c_str();
 
+    pResult->num = DetoxDatabase(
+        &options);
 
-    //
-    // Clear the CVAR_USED flag from all variables not found to be legitimate
-    //
-    pVariables = pFunction->get_lvars();
-    for (size_t i = 0; i < pVariables->size(); i++)
-    {
-        if (!fliv.afVariableIsLegit[i])
-        {
-            pVariables->at(i).clear_used();
-        }
-    }
+    return eOk;
 }
 
-/*! 
-    @brief Hex-Rays callback function, where CrowdDetox hooks into
-           decompilation process
+//
+// Argument types of the CROWDDETOX_IDC_COORDINATE IDC function:
+// CrowdDetoxCoordinate(start_ea, end_ea, output_path, workers)
+//
+static const char g_abCoordinateIdcArgs[] =
+    { VT_LONG, VT_LONG, VT_STR2, VT_LONG, 0 };
 
-    @param[in] pUserData Reserved
-    @param[in] event Hex-Rays decompiler event code
-    @param[in] va Additional arguments
-    @return Always returns 0
+/*! 
+    @brief IDC wrapper for CoordinateWorkers()
+    @details Called from IDC as CrowdDetoxCoordinate(start_ea, end_ea,
+             output_path, workers). A workers value of 0 launches one worker
+             per CPU. The other options are taken from the -OCrowdDetox:...
+             command line options. Returns the number of functions detoxed,
+             or -1 on error.
+
+    @param[in] argv The IDC function arguments
+    @param[out] pResult Receives the IDC function's return value
+    @return Always returns eOk
 */
-int
+error_t
 idaapi
-HexRaysEventCallback (
-    void* pUserData,
-    hexrays_event_t event,
-    va_list va
+IdcCrowdDetoxCoordinate (
+    idc_value_t* argv,
+    idc_value_t* pResult
     )
 {
-    UNUSED(pUserData);
+    BATCH_OPTIONS options;
 
-    cfunc_t* pFunction;
-    ctree_maturity_t maturity;
-
-    //
-    // If the event wasn't a change in the maturity level of the decompilation
-    // then disregard the event
-    //
-    if (event != hxe_maturity)
+    if (!ParseBatchOptions(
+        get_plugin_options("CrowdDetox"),
+        &options) ||
+        !ApplyBatchOptions(
+        &options))
     {
-        return 0;
+        pResult->num = -1;
+        return eOk;
     }
+    options.startEA = (ea_t)argv[0].num;
+    options.endEA = (ea_t)argv[1].num;
+    options.strOutputPath = argv[2].c_str();
+    options.nWorkers = (int)argv[3].num;
 
-    //
-    // Get the new maturity level of the decompilation
-    //
-    pFunction = va_arg(
-        va,
-        cfunc_t*);
-    maturity = va_argi(
-        va,
-        ctree_maturity_t);
+    pResult->num = CoordinateWorkers(
+        &options);
 
-    //
-    // If Hex-Rays has not yet finished its decompilation then disregard the
-    // event
-    //
-    if (maturity != CMAT_FINAL)
+    return eOk;
+}
+
+//
+// Argument types of the CROWDDETOX_IDC_TRIAGE IDC function:
+// CrowdDetoxTriage(start_ea, end_ea, output_path)
+//
+static const char g_abTriageIdcArgs[] = { VT_LONG, VT_LONG, VT_STR2, 0 };
+
+/*! 
+    @brief IDC wrapper for TriageDatabase()
+    @details Called from IDC as CrowdDetoxTriage(start_ea, end_ea,
+             output_path). An empty output_path selects the default output
+             file. The other options are taken from the -OCrowdDetox:...
+             command line options. Returns the number of functions triaged,
+             or -1 on error.
+
+    @param[in] argv The IDC function arguments
+    @param[out] pResult Receives the IDC function's return value
+    @return Always returns eOk
+*/
+error_t
+idaapi
+IdcCrowdDetoxTriage (
+    idc_value_t* argv,
+    idc_value_t* pResult
+    )
+{
+    BATCH_OPTIONS options;
+
+    if (!ParseBatchOptions(
+        get_plugin_options("CrowdDetox"),
+        &options) ||
+        !ApplyBatchOptions(
+        &options))
     {
-        return 0;
+        pResult->num = -1;
+        return eOk;
     }
+    options.startEA = (ea_t)argv[0].num;
+    options.endEA = (ea_t)argv[1].num;
+    options.strOutputPath = argv[2].c_str();
 
-    //
-    // Hex-Rays has finalized its decompilation of the function, so now remove
-    // the junk code and variables from the decompiled function
-    //
-    Detox(
-        pFunction);
+    pResult->num = TriageDatabase(
+        &options);
 
-    return 0;
+    return eOk;
 }
 
 /*! 
@@ -1159,9 +12849,60 @@ PLUGIN_init (
     msg(
         "CrowdDetox plugin loaded; to detox a function's decompilation, press "
         "'Shift-F5'.\n"
-        "If a function's return value is not used by its caller, you should "
-        "manually set the function's prototype to specify that it returns "
-        "'void' in order to assist the CrowdDetox plugin.\n");
+        "If a function's return value is not used by its callers, either "
+        "run with -OCrowdDetox:returns=1 or manually set the function's "
+        "prototype to specify that it returns 'void' in order to assist the "
+        "CrowdDetox plugin.\n");
+
+    //
+    // Expose the batch entry point to IDC and IDAPython scripts
+    //
+    if (!set_idc_func_ex(
+        CROWDDETOX_IDC_BATCH,
+        IdcCrowdDetoxBatch,
+        g_abBatchIdcArgs,
+        EXTFUN_BASE))
+    {
+        msg(
+            "Failed to register the %s IDC function.\n",
+            CROWDDETOX_IDC_BATCH);
+    }
+    if (!set_idc_func_ex(
+        CROWDDETOX_IDC_COORDINATE,
+        IdcCrowdDetoxCoordinate,
+        g_abCoordinateIdcArgs,
+        EXTFUN_BASE))
+    {
+        msg(
+            "Failed to register the %s IDC function.\n",
+            CROWDDETOX_IDC_COORDINATE);
+    }
+    if (!set_idc_func_ex(
+        CROWDDETOX_IDC_TRIAGE,
+        IdcCrowdDetoxTriage,
+        g_abTriageIdcArgs,
+        EXTFUN_BASE))
+    {
+        msg(
+            "Failed to register the %s IDC function.\n",
+            CROWDDETOX_IDC_TRIAGE);
+    }
+
+    LoadJunkSignatures(
+        NULL);
+
+    //
+    // Keep the global variable index up to date, if this database has one
+    //
+    netnode nodeCache(
+        CROWDDETOX_NETNODE);
+    if (nodeCache.hashval_long(CROWDDETOX_GLOBAL_INDEX_KEY) != 0)
+    {
+        g_fGlobalIndexHooked = hook_to_notification_point(
+            HT_IDP,
+            GlobalIndexCallback,
+            NULL);
+    }
 
     g_fInitialized = true;
 
@@ -1179,15 +12920,47 @@ PLUGIN_term (
 {
     if (g_fInitialized)
     {
+        set_idc_func_ex(
+            CROWDDETOX_IDC_BATCH,
+            NULL,
+            NULL,
+            0);
+        set_idc_func_ex(
+            CROWDDETOX_IDC_COORDINATE,
+            NULL,
+            NULL,
+            0);
+        set_idc_func_ex(
+            CROWDDETOX_IDC_TRIAGE,
+            NULL,
+            NULL,
+            0);
+
+        if (g_fGlobalIndexHooked)
+        {
+            unhook_from_notification_point(
+                HT_IDP,
+                GlobalIndexCallback,
+                NULL);
+            g_fGlobalIndexHooked = false;
+        }
+
         term_hexrays_plugin();
     }
 }
 
 /*! 
-    @brief This function runs when a user presses Shift-F5
-    @details Runs Detox() on the current function
+    @brief This function runs when a user presses Shift-F5 or when a script
+           invokes the plugin
+    @details With CROWDDETOX_RUN_INTERACTIVE, runs Detox() on the current
+             function (preceded by DetoxEarly() if the "early" option is
+             set). With CROWDDETOX_RUN_BATCH, CROWDDETOX_RUN_COORDINATOR,
+             CROWDDETOX_RUN_WORKER, or CROWDDETOX_RUN_TRIAGE, runs
+             DetoxDatabase(), CoordinateWorkers(), RunWorker(), or
+             TriageDatabase(), respectively, using the -OCrowdDetox:...
+             command line options.
  
-    @param[in] arg Reserved
+    @param[in] arg One of the CROWDDETOX_RUN_* values
 */
 void
 idaapi
@@ -1195,34 +12968,103 @@ PLUGIN_run (
     int arg
     )
 {
-    UNUSED(arg);
+    BATCH_OPTIONS options;
+
+    if (!ParseBatchOptions(
+        get_plugin_options("CrowdDetox"),
+        &options) ||
+        !ApplyBatchOptions(
+        &options))
+    {
+        return;
+    }
+
+    if (arg != CROWDDETOX_RUN_INTERACTIVE)
+    {
+        switch (arg)
+        {
+        case CROWDDETOX_RUN_BATCH:
+            DetoxDatabase(
+                &options);
+            break;
+        case CROWDDETOX_RUN_COORDINATOR:
+            CoordinateWorkers(
+                &options);
+            break;
+        case CROWDDETOX_RUN_WORKER:
+            if (options.nWorkerIndex >= 0)
+            {
+                RunWorker(
+                    options.nWorkerIndex);
+            }
+            break;
+        case CROWDDETOX_RUN_TRIAGE:
+            TriageDatabase(
+                &options);
+            break;
+        default:
+            break;
+        }
+        return;
+    }
 
+    if (options.fPurity)
+    {
+        SummarizeSideEffects();
+    }
+    if (options.fGlobals)
+    {
+        BuildGlobalIndex();
+    }
+    if (options.fReturns)
+    {
+        BuildReturnIndex();
+    }
     //
     // Install the Hex-Rays event callback function
     //
     if (!install_hexrays_callback(
         HexRaysEventCallback,
-        NULL))
+        &options))
     {
         msg(
             "Failed to install CrowdDetox Hex-Rays callback.\n");
         return;
     }
+    if (options.fEarlyDetox && !install_hexrays_callback(
+        EarlyDetoxEventCallback,
+        NULL))
+    {
+        msg(
+            "Failed to install CrowdDetox early Hex-Rays callback.\n");
+        options.fEarlyDetox = false;
+    }
 
     //
     // Open the Hex-Rays pseudocode window, or refresh the current pseudocode
     // window if it's already open
     //
+    uint64 qwStart = get_nsec_stamp();
     open_pseudocode(
         get_screen_ea(),
         0);
+    msg(
+        "CrowdDetox: Decompiled and detoxed (at maturity %s) in %.1f ms.\n",
+        g_aszMaturityNames[options.nMaturity],
+        (get_nsec_stamp() - qwStart) / 1e6);
 
     //
     // Uninstall the Hex-Rays event callback function
     //
     remove_hexrays_callback(
         HexRaysEventCallback,
-        NULL);
+        &options);
+    if (options.fEarlyDetox)
+    {
+        remove_hexrays_callback(
+            EarlyDetoxEventCallback,
+            NULL);
+    }
 }
 
 plugin_t PLUGIN =